@@ -0,0 +1,182 @@
+#include <filesystem>
+#include <stdexcept>
+#include <magic_enum.hpp>
+
+#include "Managers/Resource/resource_manager.hpp"
+#include "Managers/Resource/Common/handle.hpp"
+#include "Managers/Resource/Common/model.hpp"
+#include "Managers/Raytrace/Common/raytrace_scene.hpp"
+#include "Managers/Raytrace/Common/bvh_builder.hpp"
+#include "Managers/Raytrace/Common/bvh_analyzer.hpp"
+#include "Managers/Raytrace/Common/vertex.hpp"
+
+
+namespace
+{
+	/** Build settings default to the ones used by bottom level trees of renderer */
+	struct Options
+	{
+		String path;
+		Int32 raysCount = 1 << 18;
+		EBVHBuildMode buildMode = EBVHBuildMode::SpatialSAH;
+		Int32 maxLeafTrianglesCount = 4;
+		Float32 spatialSplitBudget = 0.3f;
+		Int32 restructurePassesCount = 3;
+		Int32 layoutClusterSize = 0;
+	};
+
+	Void print_usage()
+	{
+		SPDLOG_INFO("Usage: BVHAnalyzer <scene.gltf | cache.bvh> [options]");
+		SPDLOG_INFO("  --rays <count>     sample rays traced on CPU, 0 skips traversal statistics");
+		SPDLOG_INFO("  --mode <name>      Median, BinnedSAH, Linear or SpatialSAH");
+		SPDLOG_INFO("  --leaf <count>     max triangles in leaf");
+		SPDLOG_INFO("  --budget <factor>  spatial splits budget");
+		SPDLOG_INFO("  --passes <count>   treelet restructuring passes");
+		SPDLOG_INFO("  --cluster <count>  nodes in layout cluster");
+		SPDLOG_INFO("Run from RayTracer directory, trees are cached in its Cache folder");
+	}
+
+	Bool parse_option(const String& name, const String& value, Options& options)
+	{
+		if (name == "--rays")
+		{
+			options.raysCount = std::stoi(value);
+			return true;
+		}
+		if (name == "--mode")
+		{
+			const auto buildMode = magic_enum::enum_cast<EBVHBuildMode>(value);
+			if (!buildMode.has_value() || buildMode.value() == EBVHBuildMode::Count)
+			{
+				SPDLOG_ERROR("Unknown build mode {}", value);
+				return false;
+			}
+			options.buildMode = buildMode.value();
+			return true;
+		}
+		if (name == "--leaf")
+		{
+			options.maxLeafTrianglesCount = std::stoi(value);
+			return true;
+		}
+		if (name == "--budget")
+		{
+			options.spatialSplitBudget = std::stof(value);
+			return true;
+		}
+		if (name == "--passes")
+		{
+			options.restructurePassesCount = std::stoi(value);
+			return true;
+		}
+		if (name == "--cluster")
+		{
+			options.layoutClusterSize = std::stoi(value);
+			return true;
+		}
+
+		SPDLOG_ERROR("Unknown option {}", name);
+		return false;
+	}
+
+	Bool parse_options(Int32 argc, Char* argv[], Options& options)
+	{
+		if (argc < 2)
+		{
+			return false;
+		}
+
+		options.path = argv[1];
+		for (Int32 i = 2; i + 1 < argc; i += 2)
+		{
+			const String name = argv[i];
+			const String value = argv[i + 1];
+			// Numbers are parsed by std::stoi and std::stof, which throw on malformed or too large values
+			try
+			{
+				if (!parse_option(name, value, options))
+				{
+					return false;
+				}
+			}
+			catch (const std::exception&)
+			{
+				SPDLOG_ERROR("Invalid value {} of option {}", value, name);
+				return false;
+			}
+		}
+		return (argc % 2) == 0;
+	}
+
+	/** Cache keeps only reordered indexes and nodes, so structure is reported without sample rays */
+	Int32 analyze_cache(const Options& options)
+	{
+		BVHBuilder bvh;
+		DynamicArray<UInt32> indexes;
+		if (!bvh.load_cache(options.path, indexes))
+		{
+			return 1;
+		}
+
+		const DynamicArray<Vertex> vertexes;
+		SPDLOG_INFO("Analysis of cached tree {}", options.path);
+		BVHAnalyzer(vertexes, indexes).analyze(bvh, 0);
+		return 0;
+	}
+
+	/** Every model gets the same bottom level tree as in renderer, so cache of renderer is reused */
+	Int32 analyze_scene(const Options& options)
+	{
+		SResourceManager& resourceManager = SResourceManager::get();
+		resourceManager.startup();
+		resourceManager.load_gltf_asset(options.path);
+
+		const DynamicArray<Model>& models = resourceManager.get_models();
+		for (UInt64 modelId = 0; modelId < models.size(); ++modelId)
+		{
+			const Model& model = models[modelId];
+			DynamicArray<Vertex> vertexes;
+			DynamicArray<UInt32> indexes;
+			RaytraceScene::get_model_geometry(model, vertexes, indexes);
+			if (indexes.empty())
+			{
+				continue;
+			}
+
+			BVHBuilder bvh;
+			bvh.buildMode = options.buildMode;
+			bvh.maxLeafTrianglesCount = options.maxLeafTrianglesCount;
+			bvh.spatialSplitBudget = options.spatialSplitBudget;
+			bvh.restructurePassesCount = options.restructurePassesCount;
+			bvh.layoutClusterSize = options.layoutClusterSize;
+			bvh.create_tree(vertexes, indexes);
+
+			SPDLOG_INFO("Analysis of model {} ({}), {} mode, duplication factor {:.2f}",
+						modelId,
+						model.name,
+						magic_enum::enum_name(options.buildMode),
+						bvh.get_duplication_factor());
+			BVHAnalyzer(vertexes, indexes).analyze(bvh, options.raysCount);
+		}
+
+		resourceManager.shutdown();
+		return 0;
+	}
+}
+
+Int32 main(Int32 argc, Char* argv[])
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		print_usage();
+		return 1;
+	}
+
+	if (std::filesystem::path(options.path).extension() == ".bvh")
+	{
+		return analyze_cache(options);
+	}
+	return analyze_scene(options);
+}
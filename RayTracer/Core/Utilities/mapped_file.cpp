@@ -0,0 +1,113 @@
+#include "mapped_file.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+Bool MappedFile::open(const String& path)
+{
+	close();
+#ifdef _WIN32
+	fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE)
+	{
+		fileHandle = nullptr;
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+	size = UInt64(fileSize.QuadPart);
+
+	mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mappingHandle == nullptr)
+	{
+		close();
+		return false;
+	}
+
+	data = static_cast<const UInt8*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+#else
+	fileDescriptor = ::open(path.c_str(), O_RDONLY);
+	if (fileDescriptor == -1)
+	{
+		return false;
+	}
+
+	struct stat status;
+	if (fstat(fileDescriptor, &status) != 0 || status.st_size == 0)
+	{
+		close();
+		return false;
+	}
+	size = UInt64(status.st_size);
+
+	Void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+	data = mapping == MAP_FAILED ? nullptr : static_cast<const UInt8*>(mapping);
+#endif
+	if (data == nullptr)
+	{
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+Void MappedFile::close()
+{
+#ifdef _WIN32
+	if (data != nullptr)
+	{
+		UnmapViewOfFile(data);
+	}
+	if (mappingHandle != nullptr)
+	{
+		CloseHandle(mappingHandle);
+		mappingHandle = nullptr;
+	}
+	if (fileHandle != nullptr)
+	{
+		CloseHandle(fileHandle);
+		fileHandle = nullptr;
+	}
+#else
+	if (data != nullptr)
+	{
+		munmap(const_cast<UInt8*>(data), size);
+	}
+	if (fileDescriptor != -1)
+	{
+		::close(fileDescriptor);
+		fileDescriptor = -1;
+	}
+#endif
+	data = nullptr;
+	size = 0;
+}
+
+const UInt8* MappedFile::get_data() const
+{
+	return data;
+}
+
+UInt64 MappedFile::get_size() const
+{
+	return size;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+/** Read only view of whole file mapped into memory, pages are loaded on first access */
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	MappedFile(MappedFile&) = delete;
+	~MappedFile();
+
+	Bool open(const String& path);
+	Void close();
+
+	[[nodiscard]]
+	const UInt8* get_data() const;
+	[[nodiscard]]
+	UInt64 get_size() const;
+
+private:
+	const UInt8* data = nullptr;
+	UInt64 size = 0;
+#ifdef _WIN32
+	Void* fileHandle = nullptr;
+	Void* mappingHandle = nullptr;
+#else
+	Int32 fileDescriptor = -1;
+#endif
+};
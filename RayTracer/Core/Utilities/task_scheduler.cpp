@@ -0,0 +1,175 @@
+#include "task_scheduler.hpp"
+
+namespace
+{
+	thread_local Int32 tWorkerId = -1;
+}
+
+TaskScheduler& TaskScheduler::get()
+{
+	static TaskScheduler instance;
+	return instance;
+}
+
+TaskScheduler::TaskScheduler()
+	: queues(glm::max(std::thread::hardware_concurrency(), 1U))
+	, queuedCount(0)
+	, isRunning(true)
+{
+	const Int32 workersCount = Int32(queues.size()) - 1;
+	workers.reserve(workersCount);
+	for (Int32 workerId = 0; workerId < workersCount; ++workerId)
+	{
+		workers.emplace_back(&TaskScheduler::worker_loop, this, workerId);
+	}
+}
+
+TaskScheduler::~TaskScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		isRunning = false;
+	}
+	wakeUp.notify_all();
+
+	for (std::thread& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+Void TaskScheduler::run(TaskGroup& group, Task task)
+{
+	group.pendingCount.fetch_add(1, std::memory_order_relaxed);
+	if (workers.empty())
+	{
+		task();
+		group.pendingCount.fetch_sub(1, std::memory_order_release);
+		return;
+	}
+
+	WorkerQueue& queue = queues[get_queue_id()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.jobs.push_back({ std::move(task), &group });
+	}
+	queuedCount.fetch_add(1, std::memory_order_release);
+
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+	}
+	wakeUp.notify_one();
+}
+
+Void TaskScheduler::wait(TaskGroup& group)
+{
+	const Int32 queueId = get_queue_id();
+	while (group.pendingCount.load(std::memory_order_acquire) > 0)
+	{
+		if (!try_execute(queueId))
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+Void TaskScheduler::parallel_for(Int32 begin, Int32 end, Int32 grainSize, const std::function<Void(Int32, Int32)>& body)
+{
+	grainSize = glm::max(grainSize, 1);
+	if (end - begin <= grainSize)
+	{
+		body(begin, end);
+		return;
+	}
+
+	TaskGroup group;
+	for (Int32 chunkBegin = begin; chunkBegin < end; chunkBegin += grainSize)
+	{
+		const Int32 chunkEnd = glm::min(chunkBegin + grainSize, end);
+		run(group, [&body, chunkBegin, chunkEnd]() { body(chunkBegin, chunkEnd); });
+	}
+	wait(group);
+}
+
+UInt32 TaskScheduler::get_threads_count() const
+{
+	return UInt32(queues.size());
+}
+
+Void TaskScheduler::worker_loop(Int32 workerId)
+{
+	tWorkerId = workerId;
+	while (true)
+	{
+		if (try_execute(workerId))
+		{
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		wakeUp.wait(lock, [this]()
+		{
+			return !isRunning || queuedCount.load(std::memory_order_acquire) > 0;
+		});
+
+		if (!isRunning)
+		{
+			return;
+		}
+	}
+}
+
+Bool TaskScheduler::try_execute(Int32 queueId)
+{
+	Job job;
+	if (!pop(queueId, job) && !steal(queueId, job))
+	{
+		return false;
+	}
+
+	queuedCount.fetch_sub(1, std::memory_order_relaxed);
+	job.task();
+	job.group->pendingCount.fetch_sub(1, std::memory_order_release);
+	return true;
+}
+
+Bool TaskScheduler::pop(Int32 queueId, Job& job)
+{
+	WorkerQueue& queue = queues[queueId];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.jobs.empty())
+	{
+		return false;
+	}
+
+	// Newest task first, its data is most likely still in cache
+	job = std::move(queue.jobs.back());
+	queue.jobs.pop_back();
+	return true;
+}
+
+Bool TaskScheduler::steal(Int32 queueId, Job& job)
+{
+	const Int32 queuesCount = Int32(queues.size());
+	for (Int32 i = 1; i < queuesCount; ++i)
+	{
+		WorkerQueue& queue = queues[(queueId + i) % queuesCount];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.jobs.empty())
+		{
+			continue;
+		}
+
+		// Oldest task is usually the biggest one
+		job = std::move(queue.jobs.front());
+		queue.jobs.pop_front();
+		return true;
+	}
+
+	return false;
+}
+
+Int32 TaskScheduler::get_queue_id() const
+{
+	return tWorkerId == -1 ? Int32(queues.size()) - 1 : tWorkerId;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/** Fork-join pool, every worker owns a queue and steals from others when it runs out of work */
+class TaskScheduler
+{
+public:
+	using Task = std::function<Void()>;
+
+	/** Counts tasks spawned for one join point */
+	struct TaskGroup
+	{
+		std::atomic<Int32> pendingCount{ 0 };
+	};
+
+	TaskScheduler(TaskScheduler&) = delete;
+	static TaskScheduler& get();
+
+	Void run(TaskGroup& group, Task task);
+	/** Calling thread executes queued tasks until every task of the group finishes */
+	Void wait(TaskGroup& group);
+	Void parallel_for(Int32 begin, Int32 end, Int32 grainSize, const std::function<Void(Int32, Int32)>& body);
+
+	[[nodiscard]]
+	UInt32 get_threads_count() const;
+
+private:
+	TaskScheduler();
+	~TaskScheduler();
+
+	struct Job
+	{
+		Task task;
+		TaskGroup* group;
+	};
+
+	struct WorkerQueue
+	{
+		std::mutex mutex;
+		std::deque<Job> jobs;
+	};
+
+	DynamicArray<std::thread> workers;
+	// Last queue is shared by threads that are not owned by scheduler
+	DynamicArray<WorkerQueue> queues;
+	std::atomic<Int32> queuedCount;
+	std::mutex sleepMutex;
+	std::condition_variable wakeUp;
+	Bool isRunning;
+
+	Void worker_loop(Int32 workerId);
+	Bool try_execute(Int32 queueId);
+	Bool pop(Int32 queueId, Job& job);
+	Bool steal(Int32 queueId, Job& job);
+	Int32 get_queue_id() const;
+};
@@ -0,0 +1,226 @@
+#include "bvh_analyzer.hpp"
+
+#include "bvh_builder.hpp"
+#include "bvh_traversal.hpp"
+#include "vertex.hpp"
+
+BVHAnalyzer::BVHAnalyzer(const DynamicArray<Vertex>& vertexes, const DynamicArray<UInt32>& indexes)
+	: vertexes(vertexes)
+	, indexes(indexes)
+{
+}
+
+Void BVHAnalyzer::analyze(const BVHBuilder& bvh, Int32 raysCount) const
+{
+	if (bvh.hierarchy.empty())
+	{
+		SPDLOG_WARN("Tree is empty, nothing to analyze");
+		return;
+	}
+
+	Statistics statistics;
+	gather_statistics(bvh, statistics);
+	log_structure(bvh, statistics);
+	log_memory(bvh);
+	if (raysCount > 0 && vertexes.empty())
+	{
+		SPDLOG_INFO("Sample rays skipped, scene vertexes are not loaded");
+		return;
+	}
+	if (raysCount > 0)
+	{
+		log_traversal(bvh, raysCount);
+	}
+}
+
+Void BVHAnalyzer::gather_statistics(const BVHBuilder& bvh, Statistics& statistics) const
+{
+	const BVHNode& root = bvh.hierarchy[bvh.rootId];
+	const Float32 rootArea = surface_area(root.min, root.max);
+
+	// Explicit stack, because trees of linear builder can be deeper than call stack allows
+	DynamicArray<Pair<Int32, Int32>> stack;
+	stack.emplace_back(bvh.rootId, 0);
+	while (!stack.empty())
+	{
+		const auto [nodeId, depth] = stack.back();
+		stack.pop_back();
+		const BVHNode& node = bvh.hierarchy[nodeId];
+		statistics.maxDepth = glm::max(statistics.maxDepth, depth);
+
+		if (node.primitiveCount > 0)
+		{
+			if (Int32(statistics.depthHistogram.size()) <= depth)
+			{
+				statistics.depthHistogram.resize(depth + 1, 0);
+			}
+			if (Int32(statistics.leafSizeHistogram.size()) <= node.primitiveCount)
+			{
+				statistics.leafSizeHistogram.resize(node.primitiveCount + 1, 0);
+			}
+			statistics.depthHistogram[depth]++;
+			statistics.leafSizeHistogram[node.primitiveCount]++;
+			statistics.leavesCount++;
+			statistics.leafDepthsSum += UInt64(depth);
+			statistics.referencesCount += UInt64(node.primitiveCount);
+			statistics.maxLeafSize = glm::max(statistics.maxLeafSize, node.primitiveCount);
+			continue;
+		}
+
+		const Float32 overlapArea = get_overlap_area(bvh.hierarchy[node.leftId], bvh.hierarchy[node.rightId]);
+		const Float32 nodeArea = surface_area(node.min, node.max);
+		const Float32 overlapRatio = nodeArea > 0.0f ? overlapArea / nodeArea : 0.0f;
+		statistics.overlapRatiosSum += overlapRatio;
+		statistics.maxOverlapRatio = glm::max(statistics.maxOverlapRatio, overlapRatio);
+		statistics.overlapAreaSum += rootArea > 0.0f ? overlapArea / rootArea : 0.0f;
+
+		stack.emplace_back(node.rightId, depth + 1);
+		stack.emplace_back(node.leftId, depth + 1);
+	}
+}
+
+Void BVHAnalyzer::log_structure(const BVHBuilder& bvh, const Statistics& statistics) const
+{
+	const Int32 nodesCount = Int32(bvh.hierarchy.size());
+	const Int32 internalCount = nodesCount - statistics.leavesCount;
+	SPDLOG_INFO("Nodes: {}, leaves: {}, triangle references: {}, indexes: {}",
+				nodesCount,
+				statistics.leavesCount,
+				statistics.referencesCount,
+				indexes.size());
+	SPDLOG_INFO("SAH cost: {:.2f}", bvh.calculate_sah_cost());
+	SPDLOG_INFO("Depth, max: {}, average of leaves: {:.2f}",
+				statistics.maxDepth,
+				Float32(statistics.leafDepthsSum) / Float32(glm::max(statistics.leavesCount, 1)));
+	for (UInt64 depth = 0; depth < statistics.depthHistogram.size(); ++depth)
+	{
+		const Int32 count = statistics.depthHistogram[depth];
+		if (count > 0)
+		{
+			SPDLOG_INFO("  depth {:>3}: {:>9} leaves, {:>6.2f}%",
+						depth,
+						count,
+						100.0f * Float32(count) / Float32(statistics.leavesCount));
+		}
+	}
+
+	SPDLOG_INFO("Leaf size, max: {}, average: {:.2f}",
+				statistics.maxLeafSize,
+				Float32(statistics.referencesCount) / Float32(glm::max(statistics.leavesCount, 1)));
+	for (UInt64 size = 1; size < statistics.leafSizeHistogram.size(); ++size)
+	{
+		const Int32 count = statistics.leafSizeHistogram[size];
+		if (count > 0)
+		{
+			SPDLOG_INFO("  {:>3} triangles: {:>9} leaves, {:>6.2f}%",
+						size,
+						count,
+						100.0f * Float32(count) / Float32(statistics.leavesCount));
+		}
+	}
+
+	// Sum relative to root is the expected count of extra nodes a random ray enters inside overlaps
+	SPDLOG_INFO("Sibling overlap, average: {:.2f}% of parent area, max: {:.2f}%, sum: {:.2f} of root area",
+				100.0f * statistics.overlapRatiosSum / Float32(glm::max(internalCount, 1)),
+				100.0f * statistics.maxOverlapRatio,
+				statistics.overlapAreaSum);
+}
+
+Void BVHAnalyzer::log_memory(const BVHBuilder& bvh) const
+{
+	DynamicArray<BVH4Node> bvh4;
+	DynamicArray<BVH8Node> bvh8;
+	DynamicArray<CompressedBVHNode> compressed;
+	bvh.create_wide_tree(bvh4);
+	bvh.create_wide_tree(bvh8);
+	bvh.create_compressed_tree(bvh4, compressed);
+
+	const UInt64 nodesCount = bvh.hierarchy.size();
+	SPDLOG_INFO("Memory, indexes: {:.2f} MB, binary: {:.2f} MB, octant links: {:.2f} MB",
+				Float32(indexes.size() * sizeof(UInt32)) / MEGABYTE,
+				Float32(nodesCount * sizeof(BVHNode)) / MEGABYTE,
+				Float32(nodesCount * sizeof(BVHOctantLinks)) / MEGABYTE);
+	SPDLOG_INFO("Memory, BVH4: {:.2f} MB in {} nodes, BVH8: {:.2f} MB in {} nodes, compressed BVH4: {:.2f} MB",
+				Float32(bvh4.size() * sizeof(BVH4Node)) / MEGABYTE,
+				bvh4.size(),
+				Float32(bvh8.size() * sizeof(BVH8Node)) / MEGABYTE,
+				bvh8.size(),
+				Float32(compressed.size() * sizeof(CompressedBVHNode)) / MEGABYTE);
+}
+
+Void BVHAnalyzer::log_traversal(const BVHBuilder& bvh, Int32 raysCount) const
+{
+	DynamicArray<BVH4Node> bvh4;
+	DynamicArray<BVH8Node> bvh8;
+	DynamicArray<BVHOctantLinks> octantLinks;
+	bvh.create_wide_tree(bvh4);
+	bvh.create_wide_tree(bvh8);
+	bvh.create_octant_links(octantLinks);
+
+	using Ray = BVHTraversal::Ray;
+	using Hit = BVHTraversal::Hit;
+	const BVHTraversal traversal(vertexes, indexes);
+	if (!traversal.is_stack_enough(bvh, bvh4) || !traversal.is_stack_enough(bvh, bvh8))
+	{
+		return;
+	}
+	const DynamicArray<Ray> rays = traversal.generate_rays(raysCount);
+	DynamicArray<Hit> binaryHits(rays.size());
+	DynamicArray<Hit> orderedHits(rays.size());
+	DynamicArray<Hit> bvh4Hits(rays.size());
+	DynamicArray<Hit> bvh8Hits(rays.size());
+
+	traversal.trace_rays(rays, binaryHits, [&](const Ray& ray, Hit& hit)
+	{
+		return traversal.intersect(bvh.hierarchy, bvh.rootId, ray, hit);
+	});
+	traversal.trace_rays(rays, orderedHits, [&](const Ray& ray, Hit& hit)
+	{
+		return traversal.intersect(bvh.hierarchy, octantLinks, bvh.rootId, ray, hit);
+	});
+	traversal.trace_rays(rays, bvh4Hits, [&](const Ray& ray, Hit& hit)
+	{
+		return traversal.intersect(bvh4, ray, hit);
+	});
+	traversal.trace_rays(rays, bvh8Hits, [&](const Ray& ray, Hit& hit)
+	{
+		return traversal.intersect(bvh8, ray, hit);
+	});
+
+	Int32 hitsCount = 0;
+	for (const Hit& hit : binaryHits)
+	{
+		hitsCount += hit.triangleId != -1 ? 1 : 0;
+	}
+
+	SPDLOG_INFO("{} sample rays, {:.2f}% hit triangles", rays.size(), 100.0f * Float32(hitsCount) / Float32(glm::max(Int32(rays.size()), 1)));
+	SPDLOG_INFO("Per ray, binary: {:.1f} nodes, {:.1f} triangles",
+				traversal.get_average_visits(binaryHits),
+				traversal.get_average_tests(binaryHits));
+	SPDLOG_INFO("Per ray, binary ordered by octant: {:.1f} nodes, {:.1f} triangles",
+				traversal.get_average_visits(orderedHits),
+				traversal.get_average_tests(orderedHits));
+	SPDLOG_INFO("Per ray, BVH4: {:.1f} nodes, {:.1f} triangles",
+				traversal.get_average_visits(bvh4Hits),
+				traversal.get_average_tests(bvh4Hits));
+	SPDLOG_INFO("Per ray, BVH8: {:.1f} nodes, {:.1f} triangles",
+				traversal.get_average_visits(bvh8Hits),
+				traversal.get_average_tests(bvh8Hits));
+}
+
+Float32 BVHAnalyzer::get_overlap_area(const BVHNode& left, const BVHNode& right) const
+{
+	const FVector3 overlapMin = glm::max(left.min, right.min);
+	const FVector3 overlapMax = glm::min(left.max, right.max);
+	if (overlapMin.x > overlapMax.x || overlapMin.y > overlapMax.y || overlapMin.z > overlapMax.z)
+	{
+		return 0.0f;
+	}
+	return surface_area(overlapMin, overlapMax);
+}
+
+Float32 BVHAnalyzer::surface_area(const FVector3& min, const FVector3& max) const
+{
+	const FVector3 extent = max - min;
+	return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
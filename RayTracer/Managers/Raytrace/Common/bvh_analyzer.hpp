@@ -0,0 +1,44 @@
+#pragma once
+#include "bvh_node.hpp"
+
+struct Vertex;
+class BVHBuilder;
+
+/** Quality report of built tree, structure is measured from nodes alone, traversal cost from sample rays */
+class BVHAnalyzer
+{
+public:
+	BVHAnalyzer(const DynamicArray<Vertex>& vertexes, const DynamicArray<UInt32>& indexes);
+
+	/** Logs whole report, sample rays are skipped if count is zero or vertexes are empty */
+	Void analyze(const BVHBuilder& bvh, Int32 raysCount) const;
+
+private:
+	static constexpr Float32 MEGABYTE = 1024.0f * 1024.0f;
+
+	struct Statistics
+	{
+		Int32 leavesCount = 0;
+		Int32 maxDepth = 0;
+		Int32 maxLeafSize = 0;
+		UInt64 leafDepthsSum = 0;
+		UInt64 referencesCount = 0;
+		// Leaves counted by their depth and by count of their triangles
+		DynamicArray<Int32> depthHistogram;
+		DynamicArray<Int32> leafSizeHistogram;
+		// Area of intersection of children bounds, relative to area of their parent and to area of root
+		Float32 overlapRatiosSum = 0.0f;
+		Float32 maxOverlapRatio = 0.0f;
+		Float32 overlapAreaSum = 0.0f;
+	};
+
+	const DynamicArray<Vertex>& vertexes;
+	const DynamicArray<UInt32>& indexes;
+
+	Void gather_statistics(const BVHBuilder& bvh, Statistics& statistics) const;
+	Void log_structure(const BVHBuilder& bvh, const Statistics& statistics) const;
+	Void log_memory(const BVHBuilder& bvh) const;
+	Void log_traversal(const BVHBuilder& bvh, Int32 raysCount) const;
+	Float32 get_overlap_area(const BVHNode& left, const BVHNode& right) const;
+	Float32 surface_area(const FVector3& min, const FVector3& max) const;
+};
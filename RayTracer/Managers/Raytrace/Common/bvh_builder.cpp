@@ -1,10 +1,16 @@
 #include "bvh_builder.hpp"
 
 #include "vertex.hpp"
-#include <cstdlib>
+#include "Utilities/mapped_file.hpp"
+#include "Utilities/task_scheduler.hpp"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
 #include <fstream>
+#include <mutex>
+#include <random>
 
-Void BVHBuilder::create_tree(const DynamicArray<Vertex>& vertexes, const DynamicArray<UInt32>& indexes)
+Void BVHBuilder::create_tree(const DynamicArray<Vertex>& vertexes, DynamicArray<UInt32>& indexes)
 {
     if (indexes.size() % 3 != 0)
     {
@@ -14,177 +20,2096 @@ Void BVHBuilder::create_tree(const DynamicArray<Vertex>& vertexes, const Dynamic
     const UInt64 triangleCount = indexes.size() / 3;
 
     SPDLOG_INFO("Build tree of {} triangles", triangleCount);
-    if (load_tree("scene.bvh"))
+    // Cache is addressed by its content, so changed scene or settings never reuse old tree
+    const UInt64 sceneHash = calculate_scene_hash(vertexes, indexes);
+    const String cachePath = fmt::format("{}{:016x}.bvh", CACHE_PATH, sceneHash);
+    if (load_tree(cachePath, sceneHash, indexes))
     {
-        SPDLOG_INFO("BVH loaded from file");
-        rootId = Int32(triangleCount);
+        duplicationFactor = Float32(indexes.size()) / Float32(triangleCount * 3);
+        SPDLOG_INFO("BVH loaded from {}, nodes: {}", cachePath, hierarchy.size());
         return;
     }
 
+    const auto startTime = std::chrono::steady_clock::now();
+    TaskScheduler& scheduler = TaskScheduler::get();
     const UInt64 hierarchySize = triangleCount * 2 - 1;
-    DynamicArray<Int32> objects;
-    objects.reserve(triangleCount);
-    hierarchy.reserve(hierarchySize);
-    for (UInt64 triangleId = 0; triangleId < indexes.size(); triangleId += 3)
+    leavesCount = Int32(triangleCount);
+    // Single scratch buffer, every split partitions its own range in place
+    DynamicArray<PrimitiveReference> references(triangleCount);
+    hierarchy.resize(hierarchySize);
+    scheduler.parallel_for(0, leavesCount, PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
     {
-        BVHNode node;
-        const FVector3& a = vertexes[indexes[triangleId + 0]].position;
-        const FVector3& b = vertexes[indexes[triangleId + 1]].position;
-        const FVector3& c = vertexes[indexes[triangleId + 2]].position;
+        for (Int32 nodeId = begin; nodeId < end; ++nodeId)
+        {
+            const UInt64 triangleId = UInt64(nodeId) * 3;
+            BVHNode& node = hierarchy[nodeId];
+            const FVector3& a = vertexes[indexes[triangleId + 0]].position;
+            const FVector3& b = vertexes[indexes[triangleId + 1]].position;
+            const FVector3& c = vertexes[indexes[triangleId + 2]].position;
+
+            min(a, b, c, node.min);
+            max(a, b, c, node.max);
+
+            node.rightId = Int32(triangleId);
+            node.leftId = Int32(triangleId);
+            pad(node);
+
+            PrimitiveReference& reference = references[nodeId];
+            reference.min = node.min;
+            reference.max = node.max;
+            reference.id  = nodeId;
+        }
+    });
+    SPDLOG_INFO("Leaf nodes created...");
+
+    if (buildMode == EBVHBuildMode::Linear)
+    {
+        rootId = create_linear_hierarchy(references);
+    } else {
+        if (buildMode == EBVHBuildMode::SpatialSAH)
+        {
+            rootId = create_spatial_hierarchy(vertexes, indexes, references);
+        } else {
+            rootId = create_hierarchy(references, 0, leavesCount);
+        }
+    }
+
+    // Binary tree is built with one triangle per leaf, small subtrees are collapsed into leaves afterwards
+    DynamicArray<Int32> trianglesCounts(hierarchy.size());
+    count_triangles(rootId, trianglesCounts);
+    DynamicArray<BVHNode> binaryHierarchy;
+    binaryHierarchy.swap(hierarchy);
+    hierarchy.reserve(binaryHierarchy.size());
+    DynamicArray<UInt32> reorderedIndexes;
+    reorderedIndexes.reserve(indexes.size());
+    rootId = collapse_hierarchy(binaryHierarchy, trianglesCounts, rootId, indexes, reorderedIndexes);
+    hierarchy.shrink_to_fit();
+    indexes.swap(reorderedIndexes);
+    duplicationFactor = Float32(indexes.size()) / Float32(triangleCount * 3);
+
+    restructure_treelets();
+    relayout_hierarchy();
+    fill_stackless_data(rootId, -1);
+    const Float32 buildTime = std::chrono::duration<Float32, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    SPDLOG_INFO("Hierarchy built in {:.2f} ms on {} threads", buildTime, scheduler.get_threads_count());
+    save_tree(cachePath, sceneHash, indexes);
+    SPDLOG_INFO("Build tree complete, nodes: {} ({:.2f} MB), SAH cost: {:.2f}, duplication factor: {:.3f}", 
+                hierarchy.size(), 
+                Float32(hierarchy.size() * sizeof(BVHNode)) / (1024.0f * 1024.0f), 
+                calculate_sah_cost(),
+                duplicationFactor);
+}
+
+Float32 BVHBuilder::calculate_sah_cost() const
+{
+    if (hierarchy.empty())
+    {
+        return 0.0f;
+    }
+
+    const BVHNode& root = hierarchy[rootId];
+    const Float32 rootArea = surface_area(root.min, root.max);
+    if (rootArea <= 0.0f)
+    {
+        return 0.0f;
+    }
+
+    Float32 cost = 0.0f;
+    for (const BVHNode& node : hierarchy)
+    {
+        const Float32 area = surface_area(node.min, node.max) / rootArea;
+        if (node.leftId != node.rightId)
+        {
+            cost += TRAVERSAL_COST * area;
+        } else {
+            cost += INTERSECTION_COST * area * Float32(node.primitiveCount);
+        }
+    }
+
+    return cost;
+}
+
+Float32 BVHBuilder::get_duplication_factor() const
+{
+    return duplicationFactor;
+}
+
+template<Int32 Width>
+Void BVHBuilder::create_wide_tree(DynamicArray<WideBVHNode<Width>>& wideHierarchy) const
+{
+    wideHierarchy.clear();
+    if (hierarchy.empty())
+    {
+        return;
+    }
+
+    // Wide nodes are about Width - 1 times less numerous than binary internal nodes
+    wideHierarchy.reserve(hierarchy.size() / (Width - 1) + 1);
+    const BVHNode& root = hierarchy[rootId];
+    if (root.leftId == root.rightId)
+    { // Whole scene fits into one leaf
+        WideBVHNode<Width>& wideRoot = wideHierarchy.emplace_back();
+        for (Int32 slot = 0; slot < Width; ++slot)
+        {
+            set_wide_child(wideRoot, slot, root);
+            wideRoot.childIds[slot] = slot == 0 ? root.primitiveId : -1;
+            wideRoot.primitiveCounts[slot] = slot == 0 ? root.primitiveCount : 0;
+        }
+        return;
+    }
+
+    collapse_wide_node(rootId, wideHierarchy);
+    SPDLOG_INFO("BVH{} created, nodes: {} ({:.2f} MB)", 
+                Width, 
+                wideHierarchy.size(), 
+                Float32(wideHierarchy.size() * sizeof(WideBVHNode<Width>)) / (1024.0f * 1024.0f));
+}
+
+template<Int32 Width>
+Int32 BVHBuilder::collapse_wide_node(Int32 nodeId, DynamicArray<WideBVHNode<Width>>& wideHierarchy) const
+{
+    const BVHNode& node = hierarchy[nodeId];
+    Array<Int32, Width> children;
+    children[0] = node.leftId;
+    children[1] = node.rightId;
+    Int32 childrenCount = 2;
+
+    // Internal child with the largest area is replaced by its own children, 
+    // so the biggest boxes, hit by most rays, are removed from the tree
+    while (childrenCount < Width)
+    {
+        Int32 expandedSlot = -1;
+        Float32 largestArea = -1.0f;
+        for (Int32 slot = 0; slot < childrenCount; ++slot)
+        {
+            const BVHNode& child = hierarchy[children[slot]];
+            const Float32 area = surface_area(child.min, child.max);
+            if (child.leftId != child.rightId && area > largestArea)
+            {
+                largestArea = area;
+                expandedSlot = slot;
+            }
+        }
+
+        if (expandedSlot == -1)
+        {
+            break;
+        }
+
+        const BVHNode& expanded = hierarchy[children[expandedSlot]];
+        children[expandedSlot] = expanded.leftId;
+        children[childrenCount++] = expanded.rightId;
+    }
+
+    const Int32 wideId = Int32(wideHierarchy.size());
+    wideHierarchy.emplace_back();
+    for (Int32 slot = 0; slot < Width; ++slot)
+    {
+        if (slot >= childrenCount)
+        { // Empty slot is recognized by its id, traversal masks it out
+            WideBVHNode<Width>& wideNode = wideHierarchy[wideId];
+            wideNode.minX[slot] = wideNode.minY[slot] = wideNode.minZ[slot] = 0.0f;
+            wideNode.maxX[slot] = wideNode.maxY[slot] = wideNode.maxZ[slot] = 0.0f;
+            wideNode.childIds[slot] = -1;
+            wideNode.primitiveCounts[slot] = 0;
+            continue;
+        }
+
+        const BVHNode& child = hierarchy[children[slot]];
+        const Bool isLeaf = child.leftId == child.rightId;
+        // Children are appended after the node, so reference to it can not be kept across recursion
+        const Int32 childId = isLeaf ? child.primitiveId : collapse_wide_node(children[slot], wideHierarchy);
+        WideBVHNode<Width>& wideNode = wideHierarchy[wideId];
+        set_wide_child(wideNode, slot, child);
+        wideNode.childIds[slot] = childId;
+        wideNode.primitiveCounts[slot] = isLeaf ? child.primitiveCount : 0;
+    }
+
+    return wideId;
+}
+
+template<Int32 Width>
+Void BVHBuilder::set_wide_child(WideBVHNode<Width>& wideNode, Int32 slot, const BVHNode& child) const
+{
+    wideNode.minX[slot] = child.min.x;
+    wideNode.minY[slot] = child.min.y;
+    wideNode.minZ[slot] = child.min.z;
+    wideNode.maxX[slot] = child.max.x;
+    wideNode.maxY[slot] = child.max.y;
+    wideNode.maxZ[slot] = child.max.z;
+}
+
+template Void BVHBuilder::create_wide_tree<4>(DynamicArray<BVH4Node>& wideHierarchy) const;
+template Void BVHBuilder::create_wide_tree<8>(DynamicArray<BVH8Node>& wideHierarchy) const;
+
+template<Int32 Width>
+Int32 BVHBuilder::get_wide_tree_depth(const DynamicArray<WideBVHNode<Width>>& wideHierarchy) const
+{
+    if (wideHierarchy.empty())
+    {
+        return 0;
+    }
 
-        min(a, b, c, node.min);
-        max(a, b, c, node.max);
+    // Children are appended after their parent, so depth of every node is known before its children are visited
+    DynamicArray<Int32> depths(wideHierarchy.size(), 0);
+    Int32 maxDepth = 0;
+    for (Int32 nodeId = 0; nodeId < Int32(wideHierarchy.size()); ++nodeId)
+    {
+        const WideBVHNode<Width>& node = wideHierarchy[nodeId];
+        maxDepth = glm::max(maxDepth, depths[nodeId]);
+        for (Int32 slot = 0; slot < Width; ++slot)
+        {
+            if (node.childIds[slot] != -1 && node.primitiveCounts[slot] == 0)
+            {
+                depths[node.childIds[slot]] = depths[nodeId] + 1;
+            }
+        }
+    }
+    return maxDepth;
+}
+
+template Int32 BVHBuilder::get_wide_tree_depth<4>(const DynamicArray<BVH4Node>& wideHierarchy) const;
+template Int32 BVHBuilder::get_wide_tree_depth<8>(const DynamicArray<BVH8Node>& wideHierarchy) const;
+
+Void BVHBuilder::create_compressed_tree(const DynamicArray<BVH4Node>& wideHierarchy, DynamicArray<CompressedBVHNode>& compressedHierarchy) const
+{
+    if (maxLeafTrianglesCount > Int32(Limits<UInt8>::max()))
+    {
+        SPDLOG_ERROR("Leaves with up to {} triangles can not be compressed", maxLeafTrianglesCount);
+        return;
+    }
+
+    compressedHierarchy.resize(wideHierarchy.size());
+    TaskScheduler::get().parallel_for(0, Int32(wideHierarchy.size()), PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+    {
+        for (Int32 i = begin; i < end; ++i)
+        {
+            compress_node(wideHierarchy[i], compressedHierarchy[i]);
+        }
+    });
 
-        node.rightId = UInt32(triangleId);
-        node.leftId = UInt32(triangleId);
+    SPDLOG_INFO("Compressed BVH created, nodes: {} ({:.2f} MB)", 
+                compressedHierarchy.size(), 
+                Float32(compressedHierarchy.size() * sizeof(CompressedBVHNode)) / (1024.0f * 1024.0f));
+}
+
+Void BVHBuilder::create_octant_links(DynamicArray<BVHOctantLinks>& octantLinks) const
+{
+    octantLinks.resize(hierarchy.size());
+    if (hierarchy.empty())
+    {
+        return;
+    }
+
+    TaskScheduler::get().parallel_for(0, BVHOctantLinks::OCTANTS_COUNT, 1, [&](Int32 begin, Int32 end)
+    {
+        for (Int32 octant = begin; octant < end; ++octant)
+        {
+            fill_octant_links(rootId, -1, octant, octantLinks);
+        }
+    });
+}
+
+Void BVHBuilder::create_instance_tree(const DynamicArray<FVector3>& instancesMin, const DynamicArray<FVector3>& instancesMax)
+{
+    // Instances are few and move, so tree is neither collapsed nor cached
+    hierarchy.clear();
+    rootId = -1;
+    leavesCount = Int32(instancesMin.size());
+    if (leavesCount == 0)
+    {
+        return;
+    }
+
+    hierarchy.resize(UInt64(leavesCount) * 2 - 1);
+    DynamicArray<PrimitiveReference> references(leavesCount);
+    for (Int32 instanceId = 0; instanceId < leavesCount; ++instanceId)
+    {
+        BVHNode& node = hierarchy[instanceId];
+        node.min = instancesMin[instanceId];
+        node.max = instancesMax[instanceId];
+        node.leftId = instanceId;
+        node.rightId = instanceId;
+        node.primitiveCount = 1;
         pad(node);
+        references[instanceId] = { node.min, instanceId, node.max };
+    }
+    for (Int32 nodeId = leavesCount; nodeId < Int32(hierarchy.size()); ++nodeId)
+    {
+        hierarchy[nodeId].primitiveCount = 0;
+    }
+
+    rootId = create_hierarchy(references, 0, leavesCount);
+    relayout_hierarchy();
+    fill_stackless_data(rootId, -1);
+}
+
+Pair<Int32, Int32> BVHBuilder::refit(const DynamicArray<Vertex>& vertexes, const DynamicArray<UInt32>& indexes, Int32 indexesOffset)
+{
+    if (hierarchy.empty())
+    {
+        return { 0, 0 };
+    }
+
+    // Leaves are gathered in depth first order, so neighbouring threads walk up through neighbouring nodes
+    DynamicArray<Int32> leafIds;
+    leafIds.reserve(hierarchy.size() / 2 + 1);
+    for (Int32 nodeId = 0; nodeId < Int32(hierarchy.size()); ++nodeId)
+    {
+        if (hierarchy[nodeId].primitiveCount > 0)
+        {
+            leafIds.emplace_back(nodeId);
+        }
+    }
+
+    Pair<Int32, Int32> changedRange = { Int32(hierarchy.size()), 0 };
+    std::mutex rangeMutex;
+    TaskScheduler::get().parallel_for(0, Int32(leafIds.size()), PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+    {
+        Pair<Int32, Int32> localRange = { Int32(hierarchy.size()), 0 };
+        for (Int32 i = begin; i < end; ++i)
+        {
+            BVHNode& leaf = hierarchy[leafIds[i]];
+            const FVector3 oldMin = leaf.min;
+            const FVector3 oldMax = leaf.max;
+            calculate_leaf_bounds(vertexes, indexes, indexesOffset + leaf.primitiveId, leaf.primitiveCount, leaf.min, leaf.max);
+            if (leaf.min != oldMin || leaf.max != oldMax)
+            {
+                merge_ranges({ leafIds[i], leafIds[i] + 1 }, localRange);
+            }
+        }
+
+        const std::lock_guard<std::mutex> lock(rangeMutex);
+        merge_ranges(localRange, changedRange);
+    });
+    merge_ranges(update_internal_bounds(leafIds), changedRange);
+
+    if (changedRange.first >= changedRange.second)
+    {
+        changedRange = { 0, 0 };
+    }
+    return changedRange;
+}
+
+template<Int32 Width>
+Void BVHBuilder::refit_wide_tree(const DynamicArray<Vertex>& vertexes, 
+                                 const DynamicArray<UInt32>& indexes, 
+                                 DynamicArray<WideBVHNode<Width>>& wideHierarchy,
+                                 Int32 indexesOffset) const
+{
+    TaskScheduler::get().parallel_for(0, Int32(wideHierarchy.size()), PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+    {
+        for (Int32 wideId = begin; wideId < end; ++wideId)
+        {
+            WideBVHNode<Width>& wideNode = wideHierarchy[wideId];
+            for (Int32 slot = 0; slot < Width; ++slot)
+            {
+                if (wideNode.primitiveCounts[slot] == 0)
+                {
+                    continue;
+                }
+
+                BVHNode leaf;
+                calculate_leaf_bounds(vertexes, 
+                                      indexes, 
+                                      indexesOffset + wideNode.childIds[slot], 
+                                      wideNode.primitiveCounts[slot], 
+                                      leaf.min, 
+                                      leaf.max);
+                set_wide_child(wideNode, slot, leaf);
+            }
+        }
+    });
+
+    // Children are always stored after their parent, so walking backwards visits them first
+    for (Int32 wideId = Int32(wideHierarchy.size()) - 1; wideId >= 0; --wideId)
+    {
+        WideBVHNode<Width>& wideNode = wideHierarchy[wideId];
+        for (Int32 slot = 0; slot < Width; ++slot)
+        {
+            if (wideNode.childIds[slot] == -1 || wideNode.primitiveCounts[slot] > 0)
+            {
+                continue;
+            }
+
+            const WideBVHNode<Width>& child = wideHierarchy[wideNode.childIds[slot]];
+            BVHNode bounds;
+            bounds.min = FVector3(Limits<Float32>::max());
+            bounds.max = FVector3(-Limits<Float32>::max());
+            for (Int32 childSlot = 0; childSlot < Width; ++childSlot)
+            {
+                if (child.childIds[childSlot] != -1)
+                {
+                    bounds.min = glm::min(bounds.min, FVector3(child.minX[childSlot], child.minY[childSlot], child.minZ[childSlot]));
+                    bounds.max = glm::max(bounds.max, FVector3(child.maxX[childSlot], child.maxY[childSlot], child.maxZ[childSlot]));
+                }
+            }
+            set_wide_child(wideNode, slot, bounds);
+        }
+    }
+}
+
+template Void BVHBuilder::refit_wide_tree<4>(const DynamicArray<Vertex>& vertexes, 
+                                             const DynamicArray<UInt32>& indexes, 
+                                             DynamicArray<BVH4Node>& wideHierarchy,
+                                             Int32 indexesOffset) const;
+template Void BVHBuilder::refit_wide_tree<8>(const DynamicArray<Vertex>& vertexes, 
+                                             const DynamicArray<UInt32>& indexes, 
+                                             DynamicArray<BVH8Node>& wideHierarchy,
+                                             Int32 indexesOffset) const;
+
+Void BVHBuilder::copy_tree(DynamicArray<BVHNode>& nodes, Int32 nodesOffset, Int32 indexesOffset) const
+{
+    nodes.resize(glm::max(nodes.size(), UInt64(nodesOffset) + hierarchy.size()));
+    for (UInt64 i = 0; i < hierarchy.size(); ++i)
+    {
+        BVHNode node = hierarchy[i];
+        if (node.primitiveCount > 0)
+        {
+            node.leftId += indexesOffset;
+            node.rightId += indexesOffset;
+            node.primitiveId += indexesOffset;
+        } else {
+            node.leftId += nodesOffset;
+            node.rightId += nodesOffset;
+        }
+        for (Int32* link : { &node.parentId, &node.nextId, &node.skipId })
+        {
+            *link = *link == -1 ? -1 : *link + nodesOffset;
+        }
+        nodes[nodesOffset + i] = node;
+    }
+}
+
+Void BVHBuilder::copy_octant_links(const DynamicArray<BVHOctantLinks>& octantLinks, DynamicArray<BVHOctantLinks>& links, Int32 nodesOffset) const
+{
+    links.resize(glm::max(links.size(), UInt64(nodesOffset) + octantLinks.size()));
+    for (UInt64 i = 0; i < octantLinks.size(); ++i)
+    {
+        BVHOctantLinks nodeLinks = octantLinks[i];
+        for (IVector2& link : nodeLinks.links)
+        {
+            link.x = link.x == -1 ? -1 : link.x + nodesOffset;
+            link.y = link.y == -1 ? -1 : link.y + nodesOffset;
+        }
+        links[nodesOffset + i] = nodeLinks;
+    }
+}
+
+template<typename Node>
+Void BVHBuilder::copy_wide_tree(const DynamicArray<Node>& wideHierarchy, DynamicArray<Node>& nodes, Int32 nodesOffset, Int32 indexesOffset) const
+{
+    nodes.resize(glm::max(nodes.size(), UInt64(nodesOffset) + wideHierarchy.size()));
+    for (UInt64 i = 0; i < wideHierarchy.size(); ++i)
+    {
+        Node node = wideHierarchy[i];
+        for (Int32 slot = 0; slot < Node::WIDTH; ++slot)
+        {
+            if (node.childIds[slot] != -1)
+            {
+                node.childIds[slot] += node.primitiveCounts[slot] > 0 ? indexesOffset : nodesOffset;
+            }
+        }
+        nodes[nodesOffset + i] = node;
+    }
+}
+
+template Void BVHBuilder::copy_wide_tree<BVH4Node>(const DynamicArray<BVH4Node>& wideHierarchy, 
+                                                   DynamicArray<BVH4Node>& nodes, 
+                                                   Int32 nodesOffset, 
+                                                   Int32 indexesOffset) const;
+template Void BVHBuilder::copy_wide_tree<BVH8Node>(const DynamicArray<BVH8Node>& wideHierarchy, 
+                                                   DynamicArray<BVH8Node>& nodes, 
+                                                   Int32 nodesOffset, 
+                                                   Int32 indexesOffset) const;
+template Void BVHBuilder::copy_wide_tree<CompressedBVHNode>(const DynamicArray<CompressedBVHNode>& wideHierarchy, 
+                                                            DynamicArray<CompressedBVHNode>& nodes, 
+                                                            Int32 nodesOffset, 
+                                                            Int32 indexesOffset) const;
+
+Void BVHBuilder::calculate_leaf_bounds(const DynamicArray<Vertex>& vertexes,
+                                       const DynamicArray<UInt32>& indexes,
+                                       Int32 firstId,
+                                       Int32 count,
+                                       FVector3& leafMin,
+                                       FVector3& leafMax) const
+{
+    // Same as in build, every triangle box is padded before leaf is merged
+    leafMin = FVector3(Limits<Float32>::max());
+    leafMax = FVector3(-Limits<Float32>::max());
+    for (Int32 i = 0; i < count; ++i)
+    {
+        const Int32 triangleId = firstId + i * 3;
+        BVHNode triangle;
+        min(vertexes[indexes[triangleId + 0]].position, vertexes[indexes[triangleId + 1]].position, vertexes[indexes[triangleId + 2]].position, triangle.min);
+        max(vertexes[indexes[triangleId + 0]].position, vertexes[indexes[triangleId + 1]].position, vertexes[indexes[triangleId + 2]].position, triangle.max);
+        pad(triangle);
+        leafMin = glm::min(leafMin, triangle.min);
+        leafMax = glm::max(leafMax, triangle.max);
+    }
+}
+
+Void BVHBuilder::merge_ranges(const Pair<Int32, Int32>& range, Pair<Int32, Int32>& result) const
+{
+    if (range.first < range.second)
+    {
+        result.first  = glm::min(result.first, range.first);
+        result.second = glm::max(result.second, range.second);
+    }
+}
+
+Void BVHBuilder::compress_node(const BVH4Node& wideNode, CompressedBVHNode& node) const
+{
+    const Array<const Array<Float32, 4>*, 3> childMins = { &wideNode.minX, &wideNode.minY, &wideNode.minZ };
+    const Array<const Array<Float32, 4>*, 3> childMaxs = { &wideNode.maxX, &wideNode.maxY, &wideNode.maxZ };
+    const Array<Array<UInt8, 4>*, 3> quantizedMins = { &node.minX, &node.minY, &node.minZ };
+    const Array<Array<UInt8, 4>*, 3> quantizedMaxs = { &node.maxX, &node.maxY, &node.maxZ };
+
+    FVector3 parentMin(Limits<Float32>::max());
+    FVector3 parentMax(-Limits<Float32>::max());
+    for (Int32 slot = 0; slot < CompressedBVHNode::WIDTH; ++slot)
+    {
+        node.childIds[slot] = wideNode.childIds[slot];
+        node.primitiveCounts[slot] = UInt8(wideNode.primitiveCounts[slot]);
+        if (wideNode.childIds[slot] == -1)
+        {
+            continue;
+        }
+
+        for (Int32 axis = 0; axis < 3; ++axis)
+        {
+            parentMin[axis] = glm::min(parentMin[axis], (*childMins[axis])[slot]);
+            parentMax[axis] = glm::max(parentMax[axis], (*childMaxs[axis])[slot]);
+        }
+    }
+
+    node.origin = parentMin;
+    node.exponents[3] = 0;
+    node.padding = 0;
+    for (Int32 axis = 0; axis < 3; ++axis)
+    {
+        // The smallest power of two step, for which the highest level still covers parent box after rounding
+        const Float32 extent = parentMax[axis] - parentMin[axis];
+        Int32 exponent = extent > 0.0f ? Int32(std::ceil(std::log2(extent / Float32(QUANTIZATION_LEVELS)))) : -126;
+        exponent = glm::clamp(exponent, -126, 127);
+        while (exponent < 127 && node.origin[axis] + Float32(QUANTIZATION_LEVELS) * std::ldexp(1.0f, exponent) < parentMax[axis])
+        {
+            ++exponent;
+        }
+        node.exponents[axis] = Int8(exponent);
+        const Float32 step = std::ldexp(1.0f, exponent);
+
+        for (Int32 slot = 0; slot < CompressedBVHNode::WIDTH; ++slot)
+        {
+            if (wideNode.childIds[slot] == -1)
+            {
+                (*quantizedMins[axis])[slot] = 0;
+                (*quantizedMaxs[axis])[slot] = 0;
+                continue;
+            }
+
+            const Float32 childMin = (*childMins[axis])[slot];
+            const Float32 childMax = (*childMaxs[axis])[slot];
+            Int32 quantizedMin = glm::clamp(Int32(std::floor((childMin - node.origin[axis]) / step)), 0, QUANTIZATION_LEVELS);
+            Int32 quantizedMax = glm::clamp(Int32(std::ceil((childMax - node.origin[axis]) / step)), 0, QUANTIZATION_LEVELS);
+            // Rounding of subtraction can move decoded bound inside of child
+            while (quantizedMin > 0 && node.origin[axis] + Float32(quantizedMin) * step > childMin)
+            {
+                --quantizedMin;
+            }
+            while (quantizedMax < QUANTIZATION_LEVELS && node.origin[axis] + Float32(quantizedMax) * step < childMax)
+            {
+                ++quantizedMax;
+            }
+            (*quantizedMins[axis])[slot] = UInt8(quantizedMin);
+            (*quantizedMaxs[axis])[slot] = UInt8(quantizedMax);
+        }
+    }
+}
+
+Void BVHBuilder::fill_stackless_data(Int32 nodeId, Int32 parentId)
+{
+    BVHNode& node = hierarchy[nodeId];
+    node.parentId = parentId;
+
+    if (node.leftId != node.rightId)
+    {
+        node.nextId = node.leftId;
+        node.primitiveId = -1;
+        if (parentId != -1)
+        {
+            const BVHNode& parentNode = hierarchy[parentId];
+            if (nodeId == parentNode.leftId)
+            {
+                node.skipId = parentNode.rightId;
+            } else {
+                node.skipId = parentNode.skipId;
+            }
+        } else {
+            node.skipId = -1;
+        }
+        fill_stackless_data(node.leftId, nodeId);
+        fill_stackless_data(node.rightId, nodeId);
+        return;
+    }
+
+    // Node is leaf
+    node.primitiveId = node.leftId;
+    if (parentId == -1) // Tree is built from one node
+    {
+        node.nextId = -1;
+        node.skipId = -1;
+        return;
+    }
+
+    const BVHNode& parentNode = hierarchy[parentId];
+    if (nodeId == parentNode.leftId)
+    {
+        node.nextId = parentNode.rightId;
+        node.skipId = parentNode.rightId;
+    } else {
+        node.nextId = parentNode.skipId;
+        node.skipId = parentNode.skipId;
+    }
+}
+
+Void BVHBuilder::fill_octant_links(Int32 nodeId, Int32 skipId, Int32 octant, DynamicArray<BVHOctantLinks>& octantLinks) const
+{
+    const BVHNode& node = hierarchy[nodeId];
+    IVector2& link = octantLinks[nodeId].links[octant];
+    link.y = skipId;
+    if (node.leftId == node.rightId)
+    {
+        link.x = skipId;
+        return;
+    }
+
+    // Children are ordered along the axis, on which their centers are the farthest apart
+    const BVHNode& left = hierarchy[node.leftId];
+    const BVHNode& right = hierarchy[node.rightId];
+    const FVector3 offset = centroid(right.min, right.max) - centroid(left.min, left.max);
+    const FVector3 distance = glm::abs(offset);
+    const Int32 axis = distance.x >= distance.y && distance.x >= distance.z ? 0 : (distance.y >= distance.z ? 1 : 2);
+    const Bool isNegative = (octant & (1 << axis)) != 0;
+    const Bool isRightNear = (offset[axis] < 0.0f) != isNegative;
+    const Int32 nearId = isRightNear ? node.rightId : node.leftId;
+    const Int32 farId = isRightNear ? node.leftId : node.rightId;
+
+    link.x = nearId;
+    fill_octant_links(nearId, farId, octant, octantLinks);
+    fill_octant_links(farId, skipId, octant, octantLinks);
+}
+
+Int32 BVHBuilder::create_hierarchy(DynamicArray<PrimitiveReference>& references, Int32 begin, Int32 end)
+{
+    const Int32 objectSpan = end - begin;
+    if (objectSpan == 1)
+    {
+        return references[begin].id;
+    }
+
+    const Int32 mid = buildMode == EBVHBuildMode::BinnedSAH
+                    ? split_sah(references, begin, end)
+                    : split_median(references, begin, end);
+
+    // Range [begin, end) owns internal nodes [leavesCount + begin, leavesCount + end - 1),
+    // so every subtree writes to its own slots without any synchronization
+    const Int32 nodeId = leavesCount + mid - 1;
+    Int32 leftId, rightId;
+    if (objectSpan >= PARALLEL_BUILD_THRESHOLD)
+    {
+        TaskScheduler& scheduler = TaskScheduler::get();
+        TaskScheduler::TaskGroup group;
+        scheduler.run(group, [&]() { leftId = create_hierarchy(references, begin, mid); });
+        rightId = create_hierarchy(references, mid, end);
+        scheduler.wait(group);
+    } else {
+        leftId  = create_hierarchy(references, begin, mid);
+        rightId = create_hierarchy(references, mid, end);
+    }
+
+    BVHNode& node = hierarchy[nodeId];
+    const BVHNode& left  = hierarchy[leftId];
+    const BVHNode& right = hierarchy[rightId];
+    node.leftId  = leftId;
+    node.rightId = rightId;
+    node.min = glm::min(left.min, right.min);
+    node.max = glm::max(left.max, right.max);
+
+    return nodeId;
+}
+
+Int32 BVHBuilder::create_linear_hierarchy(const DynamicArray<PrimitiveReference>& references)
+{
+    if (leavesCount == 1)
+    {
+        return 0;
+    }
+
+    TaskScheduler& scheduler = TaskScheduler::get();
+    const Int32 chunksCount = (leavesCount + PARALLEL_GRAIN_SIZE - 1) / PARALLEL_GRAIN_SIZE;
+    DynamicArray<Pair<FVector3, FVector3>> chunkBounds(chunksCount);
+    scheduler.parallel_for(0, leavesCount, PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+    {
+        Pair<FVector3, FVector3>& bounds = chunkBounds[begin / PARALLEL_GRAIN_SIZE];
+        calculate_centroid_bounds(references, begin, end, bounds.first, bounds.second);
+    });
+
+    FVector3 centroidMin = chunkBounds[0].first;
+    FVector3 centroidMax = chunkBounds[0].second;
+    for (const Pair<FVector3, FVector3>& bounds : chunkBounds)
+    {
+        centroidMin = glm::min(centroidMin, bounds.first);
+        centroidMax = glm::max(centroidMax, bounds.second);
+    }
+
+    // Morton code interleaves quantized centroid coordinates, so sorting by it orders triangles along Z-curve
+    const Int32 axisBitsCount = leavesCount > LONG_MORTON_CODE_THRESHOLD ? 21 : 10;
+    const Float32 cellsCount = Float32((1U << axisBitsCount) - 1U);
+    const FVector3 extent = centroidMax - centroidMin;
+    FVector3 scale;
+    for (Int32 axis = 0; axis < 3; ++axis)
+    {
+        scale[axis] = extent[axis] > 0.0f ? cellsCount / extent[axis] : 0.0f;
+    }
+
+    DynamicArray<MortonPrimitive> primitives(leavesCount);
+    scheduler.parallel_for(0, leavesCount, PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+    {
+        for (Int32 i = begin; i < end; ++i)
+        {
+            const PrimitiveReference& reference = references[i];
+            const FVector3 cell = (centroid(reference.min, reference.max) - centroidMin) * scale;
+            MortonPrimitive& primitive = primitives[i];
+            primitive.code = (expand_bits(UInt64(cell.x)) << 2) | (expand_bits(UInt64(cell.y)) << 1) | expand_bits(UInt64(cell.z));
+            primitive.id = reference.id;
+        }
+    });
+    sort_morton_primitives(primitives, axisBitsCount * 3);
+
+    // Every internal node finds its own range and split independently (Karras 2012),
+    // internal node i is stored at leavesCount + i and its children are either leaves or internal nodes
+    const Int32 internalCount = leavesCount - 1;
+    scheduler.parallel_for(0, internalCount, PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+    {
+        for (Int32 i = begin; i < end; ++i)
+        {
+            const Int32 direction = get_common_prefix(primitives, i, i + 1) - get_common_prefix(primitives, i, i - 1) > 0 ? 1 : -1;
+            const Int32 minimumPrefix = get_common_prefix(primitives, i, i - direction);
+
+            Int32 maxLength = 2;
+            while (get_common_prefix(primitives, i, i + maxLength * direction) > minimumPrefix)
+            {
+                maxLength *= 2;
+            }
+
+            Int32 length = 0;
+            for (Int32 step = maxLength / 2; step >= 1; step /= 2)
+            {
+                if (get_common_prefix(primitives, i, i + (length + step) * direction) > minimumPrefix)
+                {
+                    length += step;
+                }
+            }
+
+            const Int32 j = i + length * direction;
+            const Int32 nodePrefix = get_common_prefix(primitives, i, j);
+            Int32 split = 0;
+            Int32 divider = 2;
+            Int32 step;
+            do
+            {
+                step = (length + divider - 1) / divider;
+                if (get_common_prefix(primitives, i, i + (split + step) * direction) > nodePrefix)
+                {
+                    split += step;
+                }
+                divider *= 2;
+            } while (step > 1);
+
+            const Int32 gamma = i + split * direction + glm::min(direction, 0);
+            const Int32 nodeId = leavesCount + i;
+            BVHNode& node = hierarchy[nodeId];
+            node.leftId  = glm::min(i, j) == gamma ? primitives[gamma].id : leavesCount + gamma;
+            node.rightId = glm::max(i, j) == gamma + 1 ? primitives[gamma + 1].id : leavesCount + gamma + 1;
+            hierarchy[node.leftId].parentId  = nodeId;
+            hierarchy[node.rightId].parentId = nodeId;
+        }
+    });
+    hierarchy[leavesCount].parentId = -1;
+
+    // Leaves in Morton order, so walks from neighbouring leaves meet in nodes that are close in memory
+    DynamicArray<Int32> leafIds(leavesCount);
+    scheduler.parallel_for(0, leavesCount, PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+    {
+        for (Int32 i = begin; i < end; ++i)
+        {
+            leafIds[i] = primitives[i].id;
+        }
+    });
+    update_internal_bounds(leafIds);
+    return leavesCount;
+}
+
+Int32 BVHBuilder::create_spatial_hierarchy(const DynamicArray<Vertex>& vertexes, 
+                                           const DynamicArray<UInt32>& indexes, 
+                                           DynamicArray<PrimitiveReference>& references)
+{
+    // Every reference becomes a leaf of binary tree, so the budget bounds count of nodes too
+    SpatialBuildState state{ vertexes, indexes };
+    state.referencesCount = leavesCount;
+    state.maxReferencesCount = leavesCount + Int32(Float32(leavesCount) * glm::max(spatialSplitBudget, 0.0f));
+
+    FVector3 rootMin = FVector3(Limits<Float32>::max());
+    FVector3 rootMax = FVector3(Limits<Float32>::lowest());
+    for (const PrimitiveReference& reference : references)
+    {
+        rootMin = glm::min(rootMin, reference.min);
+        rootMax = glm::max(rootMax, reference.max);
+    }
+    state.minOverlapArea = SPATIAL_SPLIT_OVERLAP * surface_area(rootMin, rootMax);
+
+    hierarchy.resize(UInt64(state.maxReferencesCount) * 2 - 1);
+    const Int32 spatialRootId = create_spatial_node(state, references);
+    hierarchy.resize(state.nodesCount);
+    SPDLOG_INFO("Spatial splits added {} references to {} triangles", state.referencesCount - leavesCount, leavesCount);
+    return spatialRootId;
+}
+
+Int32 BVHBuilder::create_spatial_node(SpatialBuildState& state, DynamicArray<PrimitiveReference>& references)
+{
+    const Int32 referencesCount = Int32(references.size());
+    const Int32 nodeId = state.nodesCount.fetch_add(1, std::memory_order_relaxed);
+    if (referencesCount == 1)
+    {
+        BVHNode& leaf = hierarchy[nodeId];
+        leaf.min = references[0].min;
+        leaf.max = references[0].max;
+        leaf.leftId = references[0].id * 3;
+        leaf.rightId = leaf.leftId;
+        pad(leaf);
+        return nodeId;
+    }
+
+    FVector3 nodeMin = FVector3(Limits<Float32>::max());
+    FVector3 nodeMax = FVector3(Limits<Float32>::lowest());
+    for (const PrimitiveReference& reference : references)
+    {
+        nodeMin = glm::min(nodeMin, reference.min);
+        nodeMax = glm::max(nodeMax, reference.max);
+    }
+
+    FVector3 centroidMin, centroidMax;
+    AxisBins bins;
+    const Int32 binsCount = glm::min(referencesCount, SAH_BINS_COUNT);
+    calculate_centroid_bounds(references, 0, referencesCount, centroidMin, centroidMax);
+    const FVector3 scale = get_bins_scale(centroidMin, centroidMax, binsCount);
+    fill_bins(references, 0, referencesCount, centroidMin, scale, binsCount, bins);
+    Int32 objectAxis, objectSplit;
+    const Float32 objectCost = find_best_split(bins, binsCount, centroidMax - centroidMin, objectAxis, objectSplit);
+
+    // Children of object split overlapping each other are the case spatial split is made for
+    Float32 overlapArea = Limits<Float32>::max();
+    if (objectAxis != -1)
+    {
+        FVector3 leftMin = FVector3(Limits<Float32>::max());
+        FVector3 leftMax = FVector3(Limits<Float32>::lowest());
+        FVector3 rightMin = leftMin;
+        FVector3 rightMax = leftMax;
+        for (Int32 binId = 0; binId < binsCount; ++binId)
+        {
+            const Bin& bin = bins[objectAxis][binId];
+            FVector3& boundsMin = binId < objectSplit ? leftMin : rightMin;
+            FVector3& boundsMax = binId < objectSplit ? leftMax : rightMax;
+            boundsMin = glm::min(boundsMin, bin.min);
+            boundsMax = glm::max(boundsMax, bin.max);
+        }
+        const FVector3 overlapMin = glm::max(leftMin, rightMin);
+        const FVector3 overlapMax = glm::min(leftMax, rightMax);
+        const Bool isOverlapping = overlapMin.x < overlapMax.x && overlapMin.y < overlapMax.y && overlapMin.z < overlapMax.z;
+        overlapArea = isOverlapping ? surface_area(overlapMin, overlapMax) : 0.0f;
+    }
+
+    DynamicArray<PrimitiveReference> left, right;
+    Int32 spatialAxis = -1;
+    Float32 spatialPosition = 0.0f;
+    Float32 spatialCost = Limits<Float32>::max();
+    if (overlapArea > state.minOverlapArea && state.referencesCount.load(std::memory_order_relaxed) < state.maxReferencesCount)
+    {
+        spatialCost = find_spatial_split(state, references, nodeMin, nodeMax, spatialAxis, spatialPosition);
+    }
+
+    const Bool isSpatialSplit = spatialAxis != -1 && 
+                                spatialCost < objectCost && 
+                                split_spatial(state, references, spatialAxis, spatialPosition, left, right);
+    if (!isSpatialSplit)
+    {
+        left.reserve(referencesCount / 2 + 1);
+        right.reserve(referencesCount / 2 + 1);
+        for (const PrimitiveReference& reference : references)
+        {
+            const Bool isOnLeft = objectAxis != -1 && 
+                                  get_bin_id(centroid(reference.min, reference.max)[objectAxis], 
+                                             centroidMin[objectAxis], 
+                                             scale[objectAxis], 
+                                             binsCount) < objectSplit;
+            (isOnLeft ? left : right).push_back(reference);
+        }
+
+        if (left.empty() || right.empty())
+        { // All centroids are in the same place, any split is as good as another
+            left.assign(references.begin(), references.begin() + referencesCount / 2);
+            right.assign(references.begin() + referencesCount / 2, references.end());
+        }
+    }
+    // Parent references are not needed anymore, deep recursion would keep them all alive
+    DynamicArray<PrimitiveReference>().swap(references);
+
+    Int32 leftId, rightId;
+    if (referencesCount >= PARALLEL_BUILD_THRESHOLD)
+    {
+        TaskScheduler& scheduler = TaskScheduler::get();
+        TaskScheduler::TaskGroup group;
+        scheduler.run(group, [&]() { leftId = create_spatial_node(state, left); });
+        rightId = create_spatial_node(state, right);
+        scheduler.wait(group);
+    } else {
+        leftId  = create_spatial_node(state, left);
+        rightId = create_spatial_node(state, right);
+    }
+
+    // Nodes were preallocated, so references stay valid while subtrees are built
+    BVHNode& node = hierarchy[nodeId];
+    node.leftId  = leftId;
+    node.rightId = rightId;
+    node.min = glm::min(hierarchy[leftId].min, hierarchy[rightId].min);
+    node.max = glm::max(hierarchy[leftId].max, hierarchy[rightId].max);
+    return nodeId;
+}
+
+Float32 BVHBuilder::find_spatial_split(const SpatialBuildState& state,
+                                       const DynamicArray<PrimitiveReference>& references,
+                                       const FVector3& nodeMin,
+                                       const FVector3& nodeMax,
+                                       Int32& bestAxis,
+                                       Float32& bestPosition) const
+{
+    const Int32 referencesCount = Int32(references.size());
+    bestAxis = -1;
+    bestPosition = 0.0f;
+    Float32 bestCost = Limits<Float32>::max();
+    for (Int32 axis = 0; axis < 3; ++axis)
+    {
+        const Float32 extent = nodeMax[axis] - nodeMin[axis];
+        if (extent <= 0.0f)
+        {
+            continue;
+        }
+
+        const Float32 binSize = extent / Float32(SPATIAL_BINS_COUNT);
+        const Float32 scale = 1.0f / binSize;
+        Array<SpatialBin, SPATIAL_BINS_COUNT> bins;
+        for (SpatialBin& bin : bins)
+        {
+            bin.min = FVector3(Limits<Float32>::max());
+            bin.max = FVector3(Limits<Float32>::lowest());
+            bin.entries = 0;
+            bin.exits = 0;
+        }
+
+        // Reference is chopped into every bin it crosses, so bins are bounded by parts of triangles
+        for (const PrimitiveReference& reference : references)
+        {
+            const Int32 firstBin = get_bin_id(reference.min[axis], nodeMin[axis], scale, SPATIAL_BINS_COUNT);
+            const Int32 lastBin  = get_bin_id(reference.max[axis], nodeMin[axis], scale, SPATIAL_BINS_COUNT);
+            for (Int32 binId = firstBin; binId <= lastBin; ++binId)
+            {
+                SpatialBin& bin = bins[binId];
+                if (firstBin == lastBin)
+                {
+                    bin.min = glm::min(bin.min, reference.min);
+                    bin.max = glm::max(bin.max, reference.max);
+                    continue;
+                }
+
+                const Float32 slabMin = nodeMin[axis] + Float32(binId) * binSize;
+                const Float32 slabMax = binId == SPATIAL_BINS_COUNT - 1 ? nodeMax[axis] : slabMin + binSize;
+                FVector3 clippedMin, clippedMax;
+                if (clip_reference(state, reference, axis, slabMin, slabMax, clippedMin, clippedMax))
+                {
+                    bin.min = glm::min(bin.min, clippedMin);
+                    bin.max = glm::max(bin.max, clippedMax);
+                }
+            }
+            bins[firstBin].entries++;
+            bins[lastBin].exits++;
+        }
+
+        Array<Float32, SPATIAL_BINS_COUNT - 1> rightAreas;
+        Array<Int32, SPATIAL_BINS_COUNT - 1> rightCounts;
+        FVector3 boundsMin = FVector3(Limits<Float32>::max());
+        FVector3 boundsMax = FVector3(Limits<Float32>::lowest());
+        Int32 count = 0;
+        for (Int32 i = SPATIAL_BINS_COUNT - 1; i > 0; --i)
+        {
+            boundsMin = glm::min(boundsMin, bins[i].min);
+            boundsMax = glm::max(boundsMax, bins[i].max);
+            count += bins[i].exits;
+            rightAreas[i - 1]  = count > 0 ? surface_area(boundsMin, boundsMax) : 0.0f;
+            rightCounts[i - 1] = count;
+        }
+
+        boundsMin = FVector3(Limits<Float32>::max());
+        boundsMax = FVector3(Limits<Float32>::lowest());
+        count = 0;
+        for (Int32 i = 0; i < SPATIAL_BINS_COUNT - 1; ++i)
+        {
+            boundsMin = glm::min(boundsMin, bins[i].min);
+            boundsMax = glm::max(boundsMax, bins[i].max);
+            count += bins[i].entries;
+            // Split which keeps every reference on one of its sides would never end
+            if (count == 0 || rightCounts[i] == 0 || count == referencesCount || rightCounts[i] == referencesCount)
+            {
+                continue;
+            }
+
+            const Float32 cost = Float32(count) * surface_area(boundsMin, boundsMax)
+                               + Float32(rightCounts[i]) * rightAreas[i];
+            if (cost < bestCost)
+            {
+                bestCost     = cost;
+                bestAxis     = axis;
+                bestPosition = nodeMin[axis] + Float32(i + 1) * binSize;
+            }
+        }
+    }
+
+    return bestCost;
+}
+
+Bool BVHBuilder::split_spatial(SpatialBuildState& state,
+                               const DynamicArray<PrimitiveReference>& references,
+                               Int32 axis,
+                               Float32 position,
+                               DynamicArray<PrimitiveReference>& left,
+                               DynamicArray<PrimitiveReference>& right) const
+{
+    FVector3 leftMin = FVector3(Limits<Float32>::max());
+    FVector3 leftMax = FVector3(Limits<Float32>::lowest());
+    FVector3 rightMin = leftMin;
+    FVector3 rightMax = leftMax;
+    DynamicArray<Array<PrimitiveReference, 3>> straddling;
+    for (const PrimitiveReference& reference : references)
+    {
+        if (reference.max[axis] <= position)
+        {
+            left.push_back(reference);
+            leftMin = glm::min(leftMin, reference.min);
+            leftMax = glm::max(leftMax, reference.max);
+            continue;
+        }
+        if (reference.min[axis] >= position)
+        {
+            right.push_back(reference);
+            rightMin = glm::min(rightMin, reference.min);
+            rightMax = glm::max(rightMax, reference.max);
+            continue;
+        }
+
+        // Whole reference and both of its parts, one of parts can be lost in float error
+        Array<PrimitiveReference, 3>& parts = straddling.emplace_back();
+        parts[0] = reference;
+        parts[1].id = reference.id;
+        parts[2].id = reference.id;
+        const Bool hasLeft = clip_reference(state, reference, axis, Limits<Float32>::lowest(), position, parts[1].min, parts[1].max);
+        const Bool hasRight = clip_reference(state, reference, axis, position, Limits<Float32>::max(), parts[2].min, parts[2].max);
+        if (!hasLeft || !hasRight)
+        {
+            straddling.pop_back();
+            (hasLeft ? left : right).push_back(reference);
+            FVector3& boundsMin = hasLeft ? leftMin : rightMin;
+            FVector3& boundsMax = hasLeft ? leftMax : rightMax;
+            boundsMin = glm::min(boundsMin, reference.min);
+            boundsMax = glm::max(boundsMax, reference.max);
+            continue;
+        }
+        leftMin = glm::min(leftMin, parts[1].min);
+        leftMax = glm::max(leftMax, parts[1].max);
+        rightMin = glm::min(rightMin, parts[2].min);
+        rightMax = glm::max(rightMax, parts[2].max);
+    }
+    const Int32 leftCount = Int32(left.size() + straddling.size());
+    const Int32 rightCount = Int32(right.size() + straddling.size());
+
+    // Reference is kept whole on one side, if growing that side is cheaper than duplicating it (unsplitting)
+    const Float32 leftArea = surface_area(leftMin, leftMax);
+    const Float32 rightArea = surface_area(rightMin, rightMax);
+    const Float32 splitCost = leftArea * Float32(leftCount) + rightArea * Float32(rightCount);
+    Int32 duplicatesCount = 0;
+    for (const Array<PrimitiveReference, 3>& parts : straddling)
+    {
+        const Float32 leftCost = surface_area(glm::min(leftMin, parts[0].min), glm::max(leftMax, parts[0].max)) * Float32(leftCount)
+                               + rightArea * Float32(rightCount - 1);
+        const Float32 rightCost = leftArea * Float32(leftCount - 1)
+                                + surface_area(glm::min(rightMin, parts[0].min), glm::max(rightMax, parts[0].max)) * Float32(rightCount);
+        if (leftCost < splitCost && leftCost <= rightCost)
+        {
+            left.push_back(parts[0]);
+        } else {
+            if (rightCost < splitCost)
+            {
+                right.push_back(parts[0]);
+            } else {
+                left.push_back(parts[1]);
+                right.push_back(parts[2]);
+                duplicatesCount++;
+            }
+        }
+    }
+
+    const Int32 referencesCount = Int32(references.size());
+    if (left.empty() || right.empty() || Int32(left.size()) == referencesCount || Int32(right.size()) == referencesCount)
+    {
+        left.clear();
+        right.clear();
+        return false;
+    }
+
+    // Subtrees on other threads take from the same budget
+    if (state.referencesCount.fetch_add(duplicatesCount, std::memory_order_relaxed) + duplicatesCount > state.maxReferencesCount)
+    {
+        state.referencesCount.fetch_sub(duplicatesCount, std::memory_order_relaxed);
+        left.clear();
+        right.clear();
+        return false;
+    }
+    return true;
+}
+
+Bool BVHBuilder::clip_reference(const SpatialBuildState& state, 
+                                const PrimitiveReference& reference, 
+                                Int32 axis, 
+                                Float32 slabMin, 
+                                Float32 slabMax, 
+                                FVector3& clippedMin, 
+                                FVector3& clippedMax) const
+{
+    // Bounds of triangle part inside of slab are spanned by its vertexes inside and by edge crossings of slab planes
+    const UInt64 triangleId = UInt64(reference.id) * 3;
+    const Array<FVector3, 3> points = { state.vertexes[state.indexes[triangleId + 0]].position,
+                                        state.vertexes[state.indexes[triangleId + 1]].position,
+                                        state.vertexes[state.indexes[triangleId + 2]].position };
+    clippedMin = FVector3(Limits<Float32>::max());
+    clippedMax = FVector3(Limits<Float32>::lowest());
+    for (Int32 i = 0; i < 3; ++i)
+    {
+        const FVector3& start = points[i];
+        const FVector3& end = points[(i + 1) % 3];
+        if (start[axis] >= slabMin && start[axis] <= slabMax)
+        {
+            clippedMin = glm::min(clippedMin, start);
+            clippedMax = glm::max(clippedMax, start);
+        }
+
+        for (const Float32 plane : { slabMin, slabMax })
+        {
+            if ((start[axis] < plane && end[axis] > plane) || (start[axis] > plane && end[axis] < plane))
+            {
+                FVector3 crossing = start + (end - start) * ((plane - start[axis]) / (end[axis] - start[axis]));
+                crossing[axis] = plane;
+                clippedMin = glm::min(clippedMin, crossing);
+                clippedMax = glm::max(clippedMax, crossing);
+            }
+        }
+    }
+
+    // Reference could be clipped before, its part can not be larger than itself
+    clippedMin = glm::max(clippedMin, reference.min);
+    clippedMax = glm::min(clippedMax, reference.max);
+    return clippedMin.x <= clippedMax.x && clippedMin.y <= clippedMax.y && clippedMin.z <= clippedMax.z;
+}
+
+Void BVHBuilder::sort_morton_primitives(DynamicArray<MortonPrimitive>& primitives, Int32 bitsCount)
+{
+    // LSD radix sort, every chunk counts its digits, then scatters them to offsets from global prefix sum
+    TaskScheduler& scheduler = TaskScheduler::get();
+    const Int32 primitivesCount = Int32(primitives.size());
+    const Int32 chunksCount = (primitivesCount + PARALLEL_GRAIN_SIZE - 1) / PARALLEL_GRAIN_SIZE;
+    DynamicArray<MortonPrimitive> sorted(primitives.size());
+    DynamicArray<RadixHistogram> histograms(chunksCount);
+
+    for (Int32 shift = 0; shift < bitsCount; shift += RADIX_BITS)
+    {
+        scheduler.parallel_for(0, primitivesCount, PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+        {
+            RadixHistogram& histogram = histograms[begin / PARALLEL_GRAIN_SIZE];
+            histogram.fill(0);
+            for (Int32 i = begin; i < end; ++i)
+            {
+                histogram[(primitives[i].code >> shift) & (RADIX_BUCKETS_COUNT - 1)]++;
+            }
+        });
+
+        Int32 offset = 0;
+        for (Int32 bucket = 0; bucket < RADIX_BUCKETS_COUNT; ++bucket)
+        {
+            for (RadixHistogram& histogram : histograms)
+            {
+                const Int32 count = histogram[bucket];
+                histogram[bucket] = offset;
+                offset += count;
+            }
+        }
+
+        scheduler.parallel_for(0, primitivesCount, PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+        {
+            RadixHistogram& offsets = histograms[begin / PARALLEL_GRAIN_SIZE];
+            for (Int32 i = begin; i < end; ++i)
+            {
+                const UInt64 bucket = (primitives[i].code >> shift) & (RADIX_BUCKETS_COUNT - 1);
+                sorted[offsets[bucket]++] = primitives[i];
+            }
+        });
+        primitives.swap(sorted);
+    }
+}
+
+Int32 BVHBuilder::get_common_prefix(const DynamicArray<MortonPrimitive>& primitives, Int32 first, Int32 second) const
+{
+    if (second < 0 || second >= Int32(primitives.size()))
+    {
+        return -1;
+    }
+
+    const UInt64 firstCode  = primitives[first].code;
+    const UInt64 secondCode = primitives[second].code;
+    if (firstCode == secondCode)
+    { // Duplicated codes are told apart by their position in sorted array
+        return 64 + count_leading_zeros(UInt64(UInt32(first) ^ UInt32(second)) << 32);
+    }
+
+    return count_leading_zeros(firstCode ^ secondCode);
+}
+
+Pair<Int32, Int32> BVHBuilder::update_internal_bounds(const DynamicArray<Int32>& leafIds)
+{
+    // Walk up from every leaf, node bounds are computed by the thread that reaches it as second
+    TaskScheduler& scheduler = TaskScheduler::get();
+    DynamicArray<std::atomic<Int32>> visits(hierarchy.size());
+    Pair<Int32, Int32> changedRange = { Int32(hierarchy.size()), 0 };
+    std::mutex rangeMutex;
+
+    scheduler.parallel_for(0, Int32(leafIds.size()), PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+    {
+        Pair<Int32, Int32> localRange = { Int32(hierarchy.size()), 0 };
+        for (Int32 i = begin; i < end; ++i)
+        {
+            Int32 nodeId = hierarchy[leafIds[i]].parentId;
+            while (nodeId != -1 && visits[nodeId].fetch_add(1, std::memory_order_acq_rel) == 1)
+            {
+                BVHNode& node = hierarchy[nodeId];
+                const BVHNode& left  = hierarchy[node.leftId];
+                const BVHNode& right = hierarchy[node.rightId];
+                const FVector3 nodeMin = glm::min(left.min, right.min);
+                const FVector3 nodeMax = glm::max(left.max, right.max);
+                if (nodeMin != node.min || nodeMax != node.max)
+                {
+                    merge_ranges({ nodeId, nodeId + 1 }, localRange);
+                }
+                node.min = nodeMin;
+                node.max = nodeMax;
+                nodeId = node.parentId;
+            }
+        }
+
+        const std::lock_guard<std::mutex> lock(rangeMutex);
+        merge_ranges(localRange, changedRange);
+    });
+
+    return changedRange;
+}
+
+Void BVHBuilder::restructure_treelets()
+{
+    if (hierarchy.empty() || restructurePassesCount <= 0)
+    {
+        return;
+    }
+
+    const auto startTime = std::chrono::steady_clock::now();
+    const Float32 costBefore = calculate_sah_cost();
+    // Parents are needed to walk up, the rest of stackless data is filled afterwards
+    DynamicArray<Int32> leafIds;
+    leafIds.reserve(hierarchy.size() / 2 + 1);
+    hierarchy[rootId].parentId = -1;
+    for (Int32 nodeId = 0; nodeId < Int32(hierarchy.size()); ++nodeId)
+    {
+        const BVHNode& node = hierarchy[nodeId];
+        if (node.leftId == node.rightId)
+        {
+            leafIds.emplace_back(nodeId);
+        } else {
+            hierarchy[node.leftId].parentId = nodeId;
+            hierarchy[node.rightId].parentId = nodeId;
+        }
+    }
+
+    // Same walk as in refit, node is restructured by the thread that reaches it as second,
+    // so whole subtree below it is already final and no other thread touches it
+    DynamicArray<Float32> costs(hierarchy.size());
+    DynamicArray<std::atomic<Int32>> visits(hierarchy.size());
+    for (Int32 pass = 0; pass < restructurePassesCount; ++pass)
+    {
+        for (std::atomic<Int32>& visit : visits)
+        {
+            visit.store(0, std::memory_order_relaxed);
+        }
 
-        hierarchy.emplace_back(node);
-        Int32 nodeId = Int32(triangleId) / 3;
-        objects.emplace_back(nodeId);
+        TaskScheduler::get().parallel_for(0, Int32(leafIds.size()), TREELET_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+        {
+            for (Int32 i = begin; i < end; ++i)
+            {
+                const BVHNode& leaf = hierarchy[leafIds[i]];
+                costs[leafIds[i]] = INTERSECTION_COST * surface_area(leaf.min, leaf.max) * Float32(leaf.primitiveCount);
+                Int32 nodeId = leaf.parentId;
+                while (nodeId != -1 && visits[nodeId].fetch_add(1, std::memory_order_acq_rel) == 1)
+                {
+                    restructure_treelet(nodeId, costs);
+                    nodeId = hierarchy[nodeId].parentId;
+                }
+            }
+        });
     }
-    SPDLOG_INFO("Leaf nodes created...");
-    spdlog::set_pattern("%v");
-    rootId = create_hierarchy(objects, 0, Int32(objects.size()));
-    fill_stackless_data(rootId, -1);
-    save_tree("scene.bvh");
-    spdlog::set_pattern("%+");
-    SPDLOG_INFO("Build tree complete.");
+
+    const Float32 restructureTime = std::chrono::duration<Float32, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    SPDLOG_INFO("Treelets restructured in {:.2f} ms, passes: {}, SAH cost: {:.2f} -> {:.2f}", 
+                restructureTime, 
+                restructurePassesCount, 
+                costBefore, 
+                calculate_sah_cost());
 }
 
-Void BVHBuilder::fill_stackless_data(Int32 nodeId, Int32 parentId)
+Void BVHBuilder::restructure_treelet(Int32 nodeId, DynamicArray<Float32>& costs)
 {
-    BVHNode& node = hierarchy[nodeId];
-    node.parentId = parentId;
+    // Treelet grows by opening its largest internal leaf, which has the most to gain from better topology
+    Array<Int32, TREELET_LEAVES_COUNT> leafIds;
+    Array<Int32, TREELET_LEAVES_COUNT - 1> internalIds;
+    Int32 leavesCount = 2;
+    Int32 internalCount = 1;
+    leafIds[0] = hierarchy[nodeId].leftId;
+    leafIds[1] = hierarchy[nodeId].rightId;
+    internalIds[0] = nodeId;
+    while (leavesCount < TREELET_LEAVES_COUNT)
+    {
+        Int32 expandedSlot = -1;
+        Float32 largestArea = -1.0f;
+        for (Int32 slot = 0; slot < leavesCount; ++slot)
+        {
+            const BVHNode& leaf = hierarchy[leafIds[slot]];
+            const Float32 area = surface_area(leaf.min, leaf.max);
+            if (leaf.leftId != leaf.rightId && area > largestArea)
+            {
+                largestArea = area;
+                expandedSlot = slot;
+            }
+        }
 
-    if (node.leftId != node.rightId)
+        if (expandedSlot == -1)
+        {
+            break;
+        }
+
+        const BVHNode& expanded = hierarchy[leafIds[expandedSlot]];
+        internalIds[internalCount++] = leafIds[expandedSlot];
+        leafIds[expandedSlot] = expanded.leftId;
+        leafIds[leavesCount++] = expanded.rightId;
+    }
+
+    // Optimal cost of every subset of leaves, subsets are always smaller numbers than their supersets
+    const Int32 subsetsCount = 1 << leavesCount;
+    Array<FVector3, TREELET_SUBSETS_COUNT> subsetMins, subsetMaxs;
+    Array<Float32, TREELET_SUBSETS_COUNT> subsetCosts;
+    Array<Int32, TREELET_SUBSETS_COUNT> partitions;
+    for (Int32 subset = 1; subset < subsetsCount; ++subset)
     {
-        node.nextId = node.leftId;
-        node.primitiveId = -1;
-        if (parentId != -1)
+        const Int32 lowestBit = subset & -subset;
+        if (subset == lowestBit)
         {
-            const BVHNode& parentNode = hierarchy[parentId];
-            if (nodeId == parentNode.leftId)
+            Int32 slot = 0;
+            while ((1 << slot) != subset)
             {
-                node.skipId = parentNode.rightId;
+                ++slot;
+            }
+            subsetMins[subset] = hierarchy[leafIds[slot]].min;
+            subsetMaxs[subset] = hierarchy[leafIds[slot]].max;
+            subsetCosts[subset] = costs[leafIds[slot]];
+            continue;
+        }
+
+        subsetMins[subset] = glm::min(subsetMins[subset ^ lowestBit], subsetMins[lowestBit]);
+        subsetMaxs[subset] = glm::max(subsetMaxs[subset ^ lowestBit], subsetMaxs[lowestBit]);
+        // Partition and its complement are the same split, only the ones containing the lowest bit are tested
+        Float32 bestCost = Limits<Float32>::max();
+        for (Int32 partition = (subset - 1) & subset; partition > 0; partition = (partition - 1) & subset)
+        {
+            if ((partition & lowestBit) == 0)
+            {
+                continue;
+            }
+
+            const Float32 cost = subsetCosts[partition] + subsetCosts[subset ^ partition];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                partitions[subset] = partition;
+            }
+        }
+        subsetCosts[subset] = TRAVERSAL_COST * surface_area(subsetMins[subset], subsetMaxs[subset]) + bestCost;
+    }
+
+    // Internal nodes of treelet are reused for the new topology, its root stays in place
+    Array<Pair<Int32, Int32>, TREELET_LEAVES_COUNT - 1> stack;
+    Int32 stackSize = 0;
+    Int32 usedInternalCount = 1;
+    stack[stackSize++] = { subsetsCount - 1, nodeId };
+    while (stackSize > 0)
+    {
+        const Pair<Int32, Int32> current = stack[--stackSize];
+        const Int32 subset = current.first;
+        Array<Int32, 2> childIds;
+        const Array<Int32, 2> childSubsets = { partitions[subset], subset ^ partitions[subset] };
+        for (Int32 side = 0; side < 2; ++side)
+        {
+            const Int32 childSubset = childSubsets[side];
+            if ((childSubset & (childSubset - 1)) == 0)
+            {
+                Int32 slot = 0;
+                while ((1 << slot) != childSubset)
+                {
+                    ++slot;
+                }
+                childIds[side] = leafIds[slot];
             } else {
-                node.skipId = parentNode.skipId;
+                childIds[side] = internalIds[usedInternalCount++];
+                stack[stackSize++] = { childSubset, childIds[side] };
             }
-        } else {
-            node.skipId = -1;
+            hierarchy[childIds[side]].parentId = current.second;
         }
-        fill_stackless_data(node.leftId, nodeId);
-        fill_stackless_data(node.rightId, nodeId);
-        return;
+
+        BVHNode& node = hierarchy[current.second];
+        node.leftId = childIds[0];
+        node.rightId = childIds[1];
+        node.min = subsetMins[subset];
+        node.max = subsetMaxs[subset];
+        costs[current.second] = subsetCosts[subset];
     }
+}
 
-    // Node is leaf
-    node.primitiveId = node.leftId;
-    if (parentId == -1) // Tree is built from one node
+Void BVHBuilder::relayout_hierarchy()
+{
+    if (hierarchy.empty())
     {
-        node.nextId = -1;
-        node.skipId = -1;
         return;
     }
 
-    const BVHNode& parentNode = hierarchy[parentId];
-    if (nodeId == parentNode.leftId)
+    DynamicArray<Int32> order;
+    order.reserve(hierarchy.size());
+    if (layoutClusterSize <= 1)
     {
-        node.nextId = parentNode.rightId;
-        node.skipId = parentNode.rightId;
+        // Every node is its own cluster, so layout is plain depth first order, left first
+        DynamicArray<Int32> stack = { rootId };
+        while (!stack.empty())
+        {
+            const Int32 nodeId = stack.back();
+            stack.pop_back();
+            order.push_back(nodeId);
+            const BVHNode& node = hierarchy[nodeId];
+            if (node.leftId != node.rightId)
+            {
+                stack.push_back(node.rightId);
+                stack.push_back(node.leftId);
+            }
+        }
     } else {
-        node.nextId = parentNode.skipId;
-        node.skipId = parentNode.skipId;
+        // Clusters are laid out depth first too, so subtree follows its parent cluster
+        ClusterScratch scratch;
+        DynamicArray<Int32> clusterRootIds = { rootId };
+        DynamicArray<UInt8> isClustered(hierarchy.size(), 0);
+        while (!clusterRootIds.empty())
+        {
+            const Int32 clusterRootId = clusterRootIds.back();
+            clusterRootIds.pop_back();
+            gather_cluster(clusterRootId, isClustered, order, clusterRootIds, scratch);
+        }
+    }
+
+    DynamicArray<Int32> newIds(hierarchy.size(), -1);
+    for (Int32 newId = 0; newId < Int32(order.size()); ++newId)
+    {
+        newIds[order[newId]] = newId;
     }
+
+    // Leaves keep their triangle offsets, links are filled afterwards from the new ids
+    DynamicArray<BVHNode> relaidHierarchy(order.size());
+    for (Int32 newId = 0; newId < Int32(order.size()); ++newId)
+    {
+        BVHNode& node = relaidHierarchy[newId];
+        node = hierarchy[order[newId]];
+        if (node.leftId != node.rightId)
+        {
+            node.leftId = newIds[node.leftId];
+            node.rightId = newIds[node.rightId];
+        }
+    }
+    hierarchy.swap(relaidHierarchy);
+    rootId = 0;
 }
 
-Int32 BVHBuilder::create_hierarchy(const DynamicArray<Int32>& srcObjects, Int32 begin, Int32 end)
+Void BVHBuilder::gather_cluster(Int32 clusterRootId, 
+                                DynamicArray<UInt8>& isClustered, 
+                                DynamicArray<Int32>& order, 
+                                DynamicArray<Int32>& clusterRootIds,
+                                ClusterScratch& scratch) const
 {
-    const Int32 objectSpan = end - begin;
-    DynamicArray<Int32> objects = srcObjects;
-    const UInt64 nodeId = hierarchy.size();
+    // Cluster takes nodes with the largest area first, they are visited by most rays
+    const auto isSmaller = [](const Pair<Float32, Int32>& a, const Pair<Float32, Int32>& b) { return a.first < b.first; };
+    DynamicArray<Pair<Float32, Int32>>& frontier = scratch.frontier;
+    const BVHNode& clusterRoot = hierarchy[clusterRootId];
+    frontier.clear();
+    frontier.push_back({ surface_area(clusterRoot.min, clusterRoot.max), clusterRootId });
+    for (Int32 clusterCount = 0; clusterCount < layoutClusterSize && !frontier.empty(); ++clusterCount)
+    {
+        std::pop_heap(frontier.begin(), frontier.end(), isSmaller);
+        const Int32 nodeId = frontier.back().second;
+        frontier.pop_back();
+        isClustered[nodeId] = 1;
+        const BVHNode& node = hierarchy[nodeId];
+        if (node.leftId != node.rightId)
+        {
+            for (const Int32 childId : { node.leftId, node.rightId })
+            {
+                const BVHNode& child = hierarchy[childId];
+                frontier.push_back({ surface_area(child.min, child.max), childId });
+                std::push_heap(frontier.begin(), frontier.end(), isSmaller);
+            }
+        }
+    }
+
+    // Nodes of cluster are stored in depth first order, left first, so stackless walk moves forward
+    DynamicArray<Int32>& stack = scratch.stack;
+    DynamicArray<Int32>& childClusterRootIds = scratch.childClusterRootIds;
+    stack.assign(1, clusterRootId);
+    childClusterRootIds.clear();
+    while (!stack.empty())
+    {
+        const Int32 nodeId = stack.back();
+        stack.pop_back();
+        order.push_back(nodeId);
+        const BVHNode& node = hierarchy[nodeId];
+        if (node.leftId == node.rightId)
+        {
+            continue;
+        }
+
+        for (const Int32 childId : { node.leftId, node.rightId })
+        {
+            if (!isClustered[childId])
+            {
+                childClusterRootIds.push_back(childId);
+            }
+        }
+        for (const Int32 childId : { node.rightId, node.leftId })
+        {
+            if (isClustered[childId])
+            {
+                stack.push_back(childId);
+            }
+        }
+    }
+
+    // Clusters below are taken from the back, the leftmost has to be the last one
+    clusterRootIds.insert(clusterRootIds.end(), childClusterRootIds.rbegin(), childClusterRootIds.rend());
+}
+
+Int32 BVHBuilder::count_triangles(Int32 nodeId, DynamicArray<Int32>& trianglesCounts) const
+{
+    const BVHNode& node = hierarchy[nodeId];
+    if (node.leftId == node.rightId)
+    {
+        trianglesCounts[nodeId] = 1;
+    } else {
+        trianglesCounts[nodeId] = count_triangles(node.leftId, trianglesCounts) + count_triangles(node.rightId, trianglesCounts);
+    }
+    return trianglesCounts[nodeId];
+}
+
+Int32 BVHBuilder::collapse_hierarchy(const DynamicArray<BVHNode>& binaryHierarchy,
+                                     const DynamicArray<Int32>& trianglesCounts,
+                                     Int32 nodeId,
+                                     const DynamicArray<UInt32>& indexes,
+                                     DynamicArray<UInt32>& reorderedIndexes)
+{
+    const BVHNode& source = binaryHierarchy[nodeId];
+    const Int32 newId = Int32(hierarchy.size());
     BVHNode& node = hierarchy.emplace_back();
+    node.min = source.min;
+    node.max = source.max;
+
+    if (trianglesCounts[nodeId] <= glm::max(maxLeafTrianglesCount, 1))
+    {
+        node.leftId = Int32(reorderedIndexes.size());
+        node.rightId = node.leftId;
+        gather_triangles(binaryHierarchy, nodeId, indexes, reorderedIndexes);
+        // Both parts of triangle split by spatial splits can end up in the same leaf
+        node.primitiveCount = buildMode == EBVHBuildMode::SpatialSAH 
+                            ? remove_duplicated_triangles(reorderedIndexes, node.leftId) 
+                            : trianglesCounts[nodeId];
+        return newId;
+    }
+
+    node.primitiveCount = 0;
+    // Children are appended after the node, so reference to it can not be used anymore
+    const Int32 leftId = collapse_hierarchy(binaryHierarchy, trianglesCounts, source.leftId, indexes, reorderedIndexes);
+    const Int32 rightId = collapse_hierarchy(binaryHierarchy, trianglesCounts, source.rightId, indexes, reorderedIndexes);
+    hierarchy[newId].leftId = leftId;
+    hierarchy[newId].rightId = rightId;
+    return newId;
+}
+
+Void BVHBuilder::gather_triangles(const DynamicArray<BVHNode>& binaryHierarchy,
+                                  Int32 nodeId,
+                                  const DynamicArray<UInt32>& indexes,
+                                  DynamicArray<UInt32>& reorderedIndexes) const
+{
+    const BVHNode& node = binaryHierarchy[nodeId];
+    if (node.leftId != node.rightId)
+    {
+        gather_triangles(binaryHierarchy, node.leftId, indexes, reorderedIndexes);
+        gather_triangles(binaryHierarchy, node.rightId, indexes, reorderedIndexes);
+        return;
+    }
+
+    reorderedIndexes.insert(reorderedIndexes.end(), indexes.begin() + node.leftId, indexes.begin() + node.leftId + 3);
+}
+
+Int32 BVHBuilder::remove_duplicated_triangles(DynamicArray<UInt32>& indexes, Int32 firstId) const
+{
+    Int32 endId = firstId;
+    for (Int32 triangleId = firstId; triangleId < Int32(indexes.size()); triangleId += 3)
+    {
+        Bool isDuplicated = false;
+        for (Int32 keptId = firstId; keptId < endId && !isDuplicated; keptId += 3)
+        {
+            isDuplicated = std::equal(indexes.begin() + keptId, indexes.begin() + keptId + 3, indexes.begin() + triangleId);
+        }
+
+        if (!isDuplicated)
+        {
+            std::copy(indexes.begin() + triangleId, indexes.begin() + triangleId + 3, indexes.begin() + endId);
+            endId += 3;
+        }
+    }
+    indexes.resize(endId);
+    return (endId - firstId) / 3;
+}
+
+UInt64 BVHBuilder::expand_bits(UInt64 value) const
+{
+    // Inserts two zero bits after every one of 21 lowest bits
+    value &= 0x1fffffULL;
+    value = (value | value << 32) & 0x1f00000000ffffULL;
+    value = (value | value << 16) & 0x1f0000ff0000ffULL;
+    value = (value | value << 8)  & 0x100f00f00f00f00fULL;
+    value = (value | value << 4)  & 0x10c30c30c30c30c3ULL;
+    value = (value | value << 2)  & 0x1249249249249249ULL;
+    return value;
+}
+
+Int32 BVHBuilder::count_leading_zeros(UInt64 value) const
+{
+    if (value == 0)
+    {
+        return 64;
+    }
+
+    Int32 count = 0;
+    for (Int32 shift = 32; shift > 0; shift /= 2)
+    {
+        if ((value >> (64 - shift)) == 0)
+        {
+            count += shift;
+            value <<= shift;
+        }
+    }
+    return count;
+}
+
+Int32 BVHBuilder::split_median(DynamicArray<PrimitiveReference>& references, Int32 begin, Int32 end)
+{
     const Int32 currentAxis = rand_int(0, 2);
-    auto comparator = [&](const Int32 first, const Int32 second)
+    auto comparator = [&](const PrimitiveReference& first, const PrimitiveReference& second)
         {
-            return hierarchy[first].min[currentAxis] < hierarchy[second].min[currentAxis];
+            return first.min[currentAxis] < second.min[currentAxis];
         };
 
-    if (objectSpan == 1)
+    const Int32 mid = begin + (end - begin) / 2;
+    std::nth_element(references.begin() + begin, references.begin() + mid, references.begin() + end, comparator);
+    return mid;
+}
+
+Int32 BVHBuilder::split_sah(DynamicArray<PrimitiveReference>& references, Int32 begin, Int32 end)
+{
+    const Int32 objectSpan = end - begin;
+    // Deep ranges have only few references, there is no point in sweeping over mostly empty bins
+    const Int32 binsCount = glm::min(objectSpan, SAH_BINS_COUNT);
+    FVector3 centroidMin, centroidMax;
+    AxisBins bins;
+    if (objectSpan < PARALLEL_BUILD_THRESHOLD)
+    {
+        calculate_centroid_bounds(references, begin, end, centroidMin, centroidMax);
+        fill_bins(references, begin, end, centroidMin, get_bins_scale(centroidMin, centroidMax, binsCount), binsCount, bins);
+    } else {
+        // Top levels of the tree would serialize the whole build, so their binning is split into chunks
+        TaskScheduler& scheduler = TaskScheduler::get();
+        const Int32 grainSize = glm::max(PARALLEL_GRAIN_SIZE, objectSpan / Int32(scheduler.get_threads_count() * 4));
+        const Int32 chunksCount = (objectSpan + grainSize - 1) / grainSize;
+
+        DynamicArray<Pair<FVector3, FVector3>> chunkBounds(chunksCount);
+        scheduler.parallel_for(begin, end, grainSize, [&](Int32 chunkBegin, Int32 chunkEnd)
+        {
+            Pair<FVector3, FVector3>& bounds = chunkBounds[(chunkBegin - begin) / grainSize];
+            calculate_centroid_bounds(references, chunkBegin, chunkEnd, bounds.first, bounds.second);
+        });
+
+        centroidMin = chunkBounds[0].first;
+        centroidMax = chunkBounds[0].second;
+        for (const Pair<FVector3, FVector3>& bounds : chunkBounds)
+        {
+            centroidMin = glm::min(centroidMin, bounds.first);
+            centroidMax = glm::max(centroidMax, bounds.second);
+        }
+
+        const FVector3 scale = get_bins_scale(centroidMin, centroidMax, binsCount);
+        DynamicArray<AxisBins> chunkBins(chunksCount);
+        scheduler.parallel_for(begin, end, grainSize, [&](Int32 chunkBegin, Int32 chunkEnd)
+        {
+            fill_bins(references, chunkBegin, chunkEnd, centroidMin, scale, binsCount, chunkBins[(chunkBegin - begin) / grainSize]);
+        });
+
+        bins = chunkBins[0];
+        for (Int32 chunkId = 1; chunkId < chunksCount; ++chunkId)
+        {
+            for (Int32 axis = 0; axis < 3; ++axis)
+            {
+                for (Int32 binId = 0; binId < binsCount; ++binId)
+                {
+                    Bin& bin = bins[axis][binId];
+                    const Bin& chunkBin = chunkBins[chunkId][axis][binId];
+                    bin.min = glm::min(bin.min, chunkBin.min);
+                    bin.max = glm::max(bin.max, chunkBin.max);
+                    bin.count += chunkBin.count;
+                }
+            }
+        }
+    }
+
+    const FVector3 scale = get_bins_scale(centroidMin, centroidMax, binsCount);
+    Int32 bestAxis, bestSplit;
+    find_best_split(bins, binsCount, centroidMax - centroidMin, bestAxis, bestSplit);
+
+    const Int32 median = begin + objectSpan / 2;
+    if (bestAxis == -1)
+    { // All centroids are in the same place, any split is as good as another
+        return median;
+    }
+
+    auto isOnLeft = [&](const PrimitiveReference& reference)
+        {
+            const Float32 center = centroid(reference.min, reference.max)[bestAxis];
+            return get_bin_id(center, centroidMin[bestAxis], scale[bestAxis], binsCount) < bestSplit;
+        };
+    const Int32 mid = Int32(std::partition(references.begin() + begin, references.begin() + end, isOnLeft) - references.begin());
+    if (mid == begin || mid == end)
     {
-        hierarchy.pop_back();
-        return begin;
+        return median;
     }
-    else if (objectSpan == 2)
+
+    return mid;
+}
+
+Float32 BVHBuilder::find_best_split(const AxisBins& bins, Int32 binsCount, const FVector3& extent, Int32& bestAxis, Int32& bestSplit) const
+{
+    // Find the cheapest split among all bin boundaries on every axis
+    bestAxis = -1;
+    bestSplit = 0;
+    Float32 bestCost = Limits<Float32>::max();
+    for (Int32 axis = 0; axis < 3; ++axis)
     {
-        if (comparator(begin, begin + 1))
+        if (extent[axis] <= 0.0f)
         {
-            node.leftId = begin;
-            node.rightId = begin + 1;
+            continue;
         }
-        else {
-            node.leftId = begin + 1;
-            node.rightId = begin;
+
+        // Sweep from the right to get the cost of every right side, then from the left
+        Array<Float32, SAH_BINS_COUNT - 1> rightAreas;
+        Array<Int32, SAH_BINS_COUNT - 1> rightCounts;
+        FVector3 boundsMin = FVector3(Limits<Float32>::max());
+        FVector3 boundsMax = FVector3(Limits<Float32>::lowest());
+        Int32 count = 0;
+        for (Int32 i = binsCount - 1; i > 0; --i)
+        {
+            boundsMin = glm::min(boundsMin, bins[axis][i].min);
+            boundsMax = glm::max(boundsMax, bins[axis][i].max);
+            count += bins[axis][i].count;
+            rightAreas[i - 1]  = count > 0 ? surface_area(boundsMin, boundsMax) : 0.0f;
+            rightCounts[i - 1] = count;
+        }
+
+        boundsMin = FVector3(Limits<Float32>::max());
+        boundsMax = FVector3(Limits<Float32>::lowest());
+        count = 0;
+        for (Int32 i = 0; i < binsCount - 1; ++i)
+        {
+            boundsMin = glm::min(boundsMin, bins[axis][i].min);
+            boundsMax = glm::max(boundsMax, bins[axis][i].max);
+            count += bins[axis][i].count;
+            if (count == 0 || rightCounts[i] == 0)
+            {
+                continue;
+            }
+
+            const Float32 cost = Float32(count) * surface_area(boundsMin, boundsMax)
+                               + Float32(rightCounts[i]) * rightAreas[i];
+            if (cost < bestCost)
+            {
+                bestCost  = cost;
+                bestAxis  = axis;
+                bestSplit = i + 1;
+            }
         }
     }
-    else {
-        std::sort(objects.begin() + begin, objects.begin() + end, comparator);
 
-        const Int32 mid = begin + objectSpan / 2;
-        node.leftId = create_hierarchy(objects, begin, mid);
-        node.rightId = create_hierarchy(objects, mid, end);
+    return bestCost;
+}
+
+Void BVHBuilder::calculate_centroid_bounds(const DynamicArray<PrimitiveReference>& references, 
+                                           Int32 begin, 
+                                           Int32 end, 
+                                           FVector3& centroidMin, 
+                                           FVector3& centroidMax) const
+{
+    centroidMin = FVector3(Limits<Float32>::max());
+    centroidMax = FVector3(Limits<Float32>::lowest());
+    for (Int32 i = begin; i < end; ++i)
+    {
+        const FVector3 center = centroid(references[i].min, references[i].max);
+        centroidMin = glm::min(centroidMin, center);
+        centroidMax = glm::max(centroidMax, center);
     }
+}
 
-    const BVHNode& left  = hierarchy[node.leftId];
-    const BVHNode& right = hierarchy[node.rightId];
-    node.min = glm::min(left.min, right.min);
-    node.max = glm::max(left.max, right.max);
+Void BVHBuilder::fill_bins(const DynamicArray<PrimitiveReference>& references,
+                           Int32 begin,
+                           Int32 end,
+                           const FVector3& centroidMin,
+                           const FVector3& scale,
+                           Int32 binsCount,
+                           AxisBins& bins) const
+{
+    for (Array<Bin, SAH_BINS_COUNT>& axisBins : bins)
+    {
+        for (Int32 binId = 0; binId < binsCount; ++binId)
+        {
+            Bin& bin = axisBins[binId];
+            bin.min   = FVector3(Limits<Float32>::max());
+            bin.max   = FVector3(Limits<Float32>::lowest());
+            bin.count = 0;
+        }
+    }
 
-    SPDLOG_INFO("Progress: {0:.2f}%", Float32(hierarchy.size()) / Float32(hierarchy.capacity()) * 100.0f);
-    return nodeId;
+    // Every object is binned on all axes in one pass
+    for (Int32 i = begin; i < end; ++i)
+    {
+        const PrimitiveReference& reference = references[i];
+        const FVector3 center = centroid(reference.min, reference.max);
+        for (Int32 axis = 0; axis < 3; ++axis)
+        {
+            Bin& bin = bins[axis][get_bin_id(center[axis], centroidMin[axis], scale[axis], binsCount)];
+            bin.min = glm::min(bin.min, reference.min);
+            bin.max = glm::max(bin.max, reference.max);
+            bin.count++;
+        }
+    }
+}
+
+FVector3 BVHBuilder::get_bins_scale(const FVector3& centroidMin, const FVector3& centroidMax, Int32 binsCount) const
+{
+    const FVector3 extent = centroidMax - centroidMin;
+    FVector3 scale;
+    for (Int32 axis = 0; axis < 3; ++axis)
+    {
+        scale[axis] = extent[axis] > 0.0f ? Float32(binsCount) / extent[axis] : 0.0f;
+    }
+    return scale;
+}
+
+Int32 BVHBuilder::get_bin_id(Float32 center, Float32 centroidMin, Float32 scale, Int32 binsCount) const
+{
+    return glm::clamp(Int32((center - centroidMin) * scale), 0, binsCount - 1);
+}
+
+UInt64 BVHBuilder::calculate_scene_hash(const DynamicArray<Vertex>& vertexes, const DynamicArray<UInt32>& indexes) const
+{
+    // Chunk count depends only on input size, so hash does not depend on threads count
+    TaskScheduler& scheduler = TaskScheduler::get();
+    const Int32 vertexesCount = Int32(vertexes.size());
+    const Int32 indexesCount = Int32(indexes.size());
+    const Int32 vertexChunksCount = (vertexesCount + PARALLEL_GRAIN_SIZE - 1) / PARALLEL_GRAIN_SIZE;
+    const Int32 indexChunksCount = (indexesCount + PARALLEL_GRAIN_SIZE - 1) / PARALLEL_GRAIN_SIZE;
+    DynamicArray<UInt64> chunkHashes(UInt64(vertexChunksCount) + indexChunksCount);
+
+    // Only positions are used by builder, vertexes also contain padding with undefined values
+    scheduler.parallel_for(0, vertexesCount, PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+    {
+        UInt64 hash = FNV_OFFSET_BASIS;
+        for (Int32 i = begin; i < end; ++i)
+        {
+            hash = hash_bytes(&vertexes[i].position, sizeof(FVector3), hash);
+        }
+        chunkHashes[begin / PARALLEL_GRAIN_SIZE] = hash;
+    });
+    scheduler.parallel_for(0, indexesCount, PARALLEL_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+    {
+        chunkHashes[vertexChunksCount + begin / PARALLEL_GRAIN_SIZE] = hash_bytes(indexes.data() + begin, UInt64(end - begin) * sizeof(UInt32), FNV_OFFSET_BASIS);
+    });
+
+    UInt64 hash = FNV_OFFSET_BASIS;
+    hash = hash_bytes(&vertexesCount, sizeof(vertexesCount), hash);
+    hash = hash_bytes(&indexesCount, sizeof(indexesCount), hash);
+    hash = hash_bytes(&buildMode, sizeof(buildMode), hash);
+    hash = hash_bytes(&maxLeafTrianglesCount, sizeof(maxLeafTrianglesCount), hash);
+    hash = hash_bytes(&spatialSplitBudget, sizeof(spatialSplitBudget), hash);
+    hash = hash_bytes(&restructurePassesCount, sizeof(restructurePassesCount), hash);
+    hash = hash_bytes(&layoutClusterSize, sizeof(layoutClusterSize), hash);
+    return hash_bytes(chunkHashes.data(), chunkHashes.size() * sizeof(UInt64), hash);
+}
+
+UInt64 BVHBuilder::hash_bytes(const Void* data, UInt64 size, UInt64 hash) const
+{
+    // FNV-1a
+    const UInt8* bytes = static_cast<const UInt8*>(data);
+    for (UInt64 i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
 }
 
-Void BVHBuilder::save_tree(const String& path)
+Void BVHBuilder::save_tree(const String& path, UInt64 sceneHash, const DynamicArray<UInt32>& indexes)
 {
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+    CacheHeader header;
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.sceneHash = sceneHash;
+    header.indexesCount = indexes.size();
+    header.nodesCount = Int32(hierarchy.size());
+    header.rootId = rootId;
+
     std::ofstream file;
     file.open(path, std::ios::binary);
+    if (!file)
+    {
+        SPDLOG_WARN("Failed to save BVH cache {}", path);
+        return;
+    }
+
+    file.write(reinterpret_cast<const Char*>(&header), sizeof(CacheHeader));
+    file.write(reinterpret_cast<const Char*>(indexes.data()), indexes.size() * sizeof(UInt32));
     file.write(reinterpret_cast<const Char*>(hierarchy.data()), hierarchy.size() * sizeof(BVHNode));
     file.close();
 }
 
-Bool BVHBuilder::load_tree(const String& path)
+Bool BVHBuilder::load_cache(const String& path, DynamicArray<UInt32>& indexes)
 {
-    std::ifstream file;
-    file.open(path, std::ios::binary | std::ios::ate);
-    if (!file)
+    MappedFile file;
+    if (!file.open(path) || file.get_size() < sizeof(CacheHeader))
     {
-        SPDLOG_WARN("Failed to open {}", path);
+        SPDLOG_ERROR("BVH cache {} can't be read", path);
         return false;
     }
 
-    const UInt64 size = file.tellg();
+    CacheHeader header;
+    std::memcpy(&header, file.get_data(), sizeof(CacheHeader));
+    file.close();
 
-    file.seekg(0, std::ios::beg);
-    hierarchy.resize(size / sizeof(BVHNode));
+    // Count of distinct triangles isn't stored, so duplicated references can't be told apart
+    indexes.clear();
+    duplicationFactor = 1.0f;
+    return load_tree(path, header.sceneHash, indexes);
+}
 
-    file.read(reinterpret_cast<Char*>(hierarchy.data()), size);
-    file.close();
+Bool BVHBuilder::load_tree(const String& path, UInt64 sceneHash, DynamicArray<UInt32>& indexes)
+{
+    MappedFile file;
+    if (!file.open(path))
+    {
+        SPDLOG_INFO("BVH cache {} not found", path);
+        return false;
+    }
+
+    CacheHeader header;
+    if (file.get_size() < sizeof(CacheHeader))
+    {
+        SPDLOG_WARN("BVH cache {} is corrupted, rebuilding", path);
+        return false;
+    }
+    std::memcpy(&header, file.get_data(), sizeof(CacheHeader));
+
+    const UInt64 indexesSize = header.indexesCount * sizeof(UInt32);
+    const UInt64 nodesSize = UInt64(glm::max(header.nodesCount, 0)) * sizeof(BVHNode);
+    if (header.magic != CACHE_MAGIC ||
+        header.version != CACHE_VERSION ||
+        header.sceneHash != sceneHash ||
+        header.indexesCount < indexes.size() ||
+        header.indexesCount % 3 != 0 ||
+        header.nodesCount <= 0 ||
+        header.rootId < 0 ||
+        header.rootId >= header.nodesCount ||
+        file.get_size() != sizeof(CacheHeader) + indexesSize + nodesSize)
+    {
+        SPDLOG_WARN("BVH cache {} is stale, rebuilding", path);
+        return false;
+    }
+
+    // Spatial splits store triangles referenced by several leaves more than once
+    const UInt8* data = file.get_data() + sizeof(CacheHeader);
+    indexes.resize(header.indexesCount);
+    std::memcpy(indexes.data(), data, indexesSize);
+    hierarchy.resize(header.nodesCount);
+    std::memcpy(hierarchy.data(), data + indexesSize, nodesSize);
+    rootId = header.rootId;
+    // Every triangle reference started as its own leaf, the same as in build
+    leavesCount = Int32(header.indexesCount / 3);
     return true;
 }
 
-Void BVHBuilder::min(const FVector3& a, const FVector3& b, const FVector3& c, FVector3& result)
+Void BVHBuilder::min(const FVector3& a, const FVector3& b, const FVector3& c, FVector3& result) const
 {
     result = glm::min(a, b);
     result = glm::min(result, c);
 }
 
-Void BVHBuilder::max(const FVector3& a, const FVector3& b, const FVector3& c, FVector3& result)
+Void BVHBuilder::max(const FVector3& a, const FVector3& b, const FVector3& c, FVector3& result) const
 {
     result = glm::max(a, b);
     result = glm::max(result, c);
 }
 
-Void BVHBuilder::pad(BVHNode& node)
+Void BVHBuilder::pad(BVHNode& node) const
 {
     const Float32 delta = 0.015625f; // 1 / 2^6
     FVector3 size = node.max - node.min;
@@ -199,7 +2124,20 @@ Void BVHBuilder::pad(BVHNode& node)
 
 }
 
+Float32 BVHBuilder::surface_area(const FVector3& min, const FVector3& max) const
+{
+    const FVector3 size = max - min;
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+FVector3 BVHBuilder::centroid(const FVector3& min, const FVector3& max) const
+{
+    return (min + max) * 0.5f;
+}
+
 Int32 BVHBuilder::rand_int(Int32 min, Int32 max)
 {
-    return rand() % (max - min) + min;
+    // Subtrees are split on many threads at once, each of them needs its own generator
+    thread_local std::minstd_rand generator(std::random_device{}());
+    return Int32(generator() % UInt32(max - min)) + min;
 }
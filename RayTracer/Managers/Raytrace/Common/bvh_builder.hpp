@@ -1,23 +1,250 @@
 #pragma once
+#include <atomic>
 #include "bvh_node.hpp"
+#include "wide_bvh_node.hpp"
+#include "compressed_bvh_node.hpp"
 
 struct Vertex;
 
+enum class EBVHBuildMode : UInt8
+{
+	Median = 0U,
+	BinnedSAH,
+	Linear,
+	SpatialSAH,
+	Count
+};
+
 class BVHBuilder
 {
 public:
-	Void create_tree(const DynamicArray<Vertex>& vertexes, const DynamicArray<UInt32>& indexes);
+	/** Indexes are reordered, so triangles of every leaf are stored contiguously, spatial splits can repeat triangles */
+	Void create_tree(const DynamicArray<Vertex>& vertexes, DynamicArray<UInt32>& indexes);
+	/** Loads tree saved by earlier build, scene is unknown, so its hash is taken from the file */
+	Bool load_cache(const String& path, DynamicArray<UInt32>& indexes);
+	[[nodiscard]]
+	Float32 calculate_sah_cost() const;
+	/** Count of triangle references in leaves divided by count of triangles, above 1 only after spatial splits */
+	[[nodiscard]]
+	Float32 get_duplication_factor() const;
+	/** Collapses built binary hierarchy, every wide node takes children with the largest area first */
+	template<Int32 Width>
+	Void create_wide_tree(DynamicArray<WideBVHNode<Width>>& wideHierarchy) const;
+	/** Depth of the deepest internal node of collapsed tree, its root is at depth 0, stack of traversal grows by Width - 1 per level */
+	template<Int32 Width>
+	[[nodiscard]]
+	Int32 get_wide_tree_depth(const DynamicArray<WideBVHNode<Width>>& wideHierarchy) const;
+	/** Quantizes BVH4, node ids are the same as in wide tree */
+	Void create_compressed_tree(const DynamicArray<BVH4Node>& wideHierarchy, DynamicArray<CompressedBVHNode>& compressedHierarchy) const;
+	/** Links for every direction octant, so rays visit children front to back without stack */
+	Void create_octant_links(DynamicArray<BVHOctantLinks>& octantLinks) const;
+	/** Builds tree over instance boxes, every leaf references one instance by primitiveId */
+	Void create_instance_tree(const DynamicArray<FVector3>& instancesMin, const DynamicArray<FVector3>& instancesMax);
+	/** Recomputes bounds over existing topology after positions changed, returns range [first, end) of changed nodes */
+	Pair<Int32, Int32> refit(const DynamicArray<Vertex>& vertexes, const DynamicArray<UInt32>& indexes, Int32 indexesOffset = 0);
+	/** Recomputes children bounds of wide tree, which was collapsed from current topology */
+	template<Int32 Width>
+	Void refit_wide_tree(const DynamicArray<Vertex>& vertexes, 
+						 const DynamicArray<UInt32>& indexes, 
+						 DynamicArray<WideBVHNode<Width>>& wideHierarchy,
+						 Int32 indexesOffset = 0) const;
+	/** Stores tree at nodesOffset of buffer shared by many trees, links and triangle offsets are shifted */
+	Void copy_tree(DynamicArray<BVHNode>& nodes, Int32 nodesOffset, Int32 indexesOffset) const;
+	Void copy_octant_links(const DynamicArray<BVHOctantLinks>& octantLinks, DynamicArray<BVHOctantLinks>& links, Int32 nodesOffset) const;
+	template<typename Node>
+	Void copy_wide_tree(const DynamicArray<Node>& wideHierarchy, DynamicArray<Node>& nodes, Int32 nodesOffset, Int32 indexesOffset) const;
 
 	DynamicArray<BVHNode> hierarchy;
 	Int32 rootId;
+	EBVHBuildMode buildMode = EBVHBuildMode::BinnedSAH;
+	Int32 maxLeafTrianglesCount = 4;
+	// Spatial splits can add at most that fraction of triangles count as duplicated references
+	Float32 spatialSplitBudget = 0.3f;
+	// Every pass finds optimal topology of small treelets, zero disables restructuring
+	Int32 restructurePassesCount = 3;
+	// Nodes of one subtree are stored together in blocks of that size, 64 nodes fill 4 KB page, 
+	// up to 1 keeps plain depth first order
+	Int32 layoutClusterSize = 0;
+	static constexpr const Char* CACHE_PATH = "Cache/";
+
 private:
-	Int32 create_hierarchy(const DynamicArray<Int32>& srcObjects, Int32 begin, Int32 end);
+	static constexpr Int32 SAH_BINS_COUNT = 16;
+	static constexpr Int32 SPATIAL_BINS_COUNT = 32;
+	// Spatial split is searched only if children of object split overlap more than that fraction of root area
+	static constexpr Float32 SPATIAL_SPLIT_OVERLAP = 1e-5f;
+	// All 2^7 subsets of treelet leaves are evaluated, cost grows as 3^n with leaves count
+	static constexpr Int32 TREELET_LEAVES_COUNT = 7;
+	static constexpr Int32 TREELET_SUBSETS_COUNT = 1 << TREELET_LEAVES_COUNT;
+	static constexpr Int32 TREELET_GRAIN_SIZE = 1024;
+	// Ranges smaller than that are built on the current thread
+	static constexpr Int32 PARALLEL_BUILD_THRESHOLD = 4096;
+	static constexpr Int32 PARALLEL_GRAIN_SIZE = 16384;
+	// Above that count 10 bits per axis is too coarse and too many triangles share the same code
+	static constexpr Int32 LONG_MORTON_CODE_THRESHOLD = 1 << 20;
+	static constexpr Int32 RADIX_BITS = 8;
+	static constexpr Int32 RADIX_BUCKETS_COUNT = 1 << RADIX_BITS;
+	static constexpr UInt32 CACHE_MAGIC = 0x43485642U; // "BVHC"
+	// Has to be increased after every change in node layout or in builders output
+	static constexpr UInt32 CACHE_VERSION = 4U;
+	static constexpr UInt64 FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+	static constexpr UInt64 FNV_PRIME = 0x100000001b3ULL;
+	static constexpr Int32 QUANTIZATION_LEVELS = 255;
+	static constexpr Float32 TRAVERSAL_COST = 1.0f;
+	static constexpr Float32 INTERSECTION_COST = 1.0f;
+
+	struct Bin
+	{
+		FVector3 min;
+		FVector3 max;
+		Int32 count;
+	};
+	using AxisBins = Array<Array<Bin, SAH_BINS_COUNT>, 3>;
+
+	/** Reference is counted in the bin where it starts and in the bin where it ends */
+	struct SpatialBin
+	{
+		FVector3 min;
+		FVector3 max;
+		Int32 entries;
+		Int32 exits;
+	};
+	using RadixHistogram = Array<Int32, RADIX_BUCKETS_COUNT>;
+
+	struct MortonPrimitive
+	{
+		UInt64 code;
+		Int32 id;
+	};
+
+	/** Bounds are kept next to id, so partitioning and binning walk memory linearly */
+	struct PrimitiveReference
+	{
+		FVector3 min;
+		Int32 id;
+		FVector3 max;
+	};
+
+	/** Cache file starts with header, then reordered indexes and nodes are stored */
+	struct CacheHeader
+	{
+		UInt32 magic;
+		UInt32 version;
+		UInt64 sceneHash;
+		UInt64 indexesCount;
+		Int32 nodesCount;
+		Int32 rootId;
+	};
+
+	/** Shared by all subtrees of spatial build, nodes are allocated from hierarchy sized for the whole budget */
+	struct SpatialBuildState
+	{
+		const DynamicArray<Vertex>& vertexes;
+		const DynamicArray<UInt32>& indexes;
+		std::atomic<Int32> nodesCount{ 0 };
+		std::atomic<Int32> referencesCount{ 0 };
+		Int32 maxReferencesCount = 0;
+		Float32 minOverlapArea = 0.0f;
+	};
+
+	/** Reused by every cluster of relayout, frontier is max heap of nodes by their surface area */
+	struct ClusterScratch
+	{
+		DynamicArray<Pair<Float32, Int32>> frontier;
+		DynamicArray<Int32> stack;
+		DynamicArray<Int32> childClusterRootIds;
+	};
+
+	Int32 leavesCount = 0;
+	Float32 duplicationFactor = 1.0f;
+
+	Int32 create_hierarchy(DynamicArray<PrimitiveReference>& references, Int32 begin, Int32 end);
+	Int32 create_linear_hierarchy(const DynamicArray<PrimitiveReference>& references);
+	Int32 create_spatial_hierarchy(const DynamicArray<Vertex>& vertexes, 
+								   const DynamicArray<UInt32>& indexes, 
+								   DynamicArray<PrimitiveReference>& references);
+	Int32 create_spatial_node(SpatialBuildState& state, DynamicArray<PrimitiveReference>& references);
+	Float32 find_spatial_split(const SpatialBuildState& state,
+							   const DynamicArray<PrimitiveReference>& references,
+							   const FVector3& nodeMin,
+							   const FVector3& nodeMax,
+							   Int32& bestAxis,
+							   Float32& bestPosition) const;
+	Bool split_spatial(SpatialBuildState& state,
+					   const DynamicArray<PrimitiveReference>& references,
+					   Int32 axis,
+					   Float32 position,
+					   DynamicArray<PrimitiveReference>& left,
+					   DynamicArray<PrimitiveReference>& right) const;
+	Bool clip_reference(const SpatialBuildState& state, 
+						const PrimitiveReference& reference, 
+						Int32 axis, 
+						Float32 slabMin, 
+						Float32 slabMax, 
+						FVector3& clippedMin, 
+						FVector3& clippedMax) const;
+	Int32 remove_duplicated_triangles(DynamicArray<UInt32>& indexes, Int32 firstId) const;
+	Void sort_morton_primitives(DynamicArray<MortonPrimitive>& primitives, Int32 bitsCount);
+	Int32 get_common_prefix(const DynamicArray<MortonPrimitive>& primitives, Int32 first, Int32 second) const;
+	Pair<Int32, Int32> update_internal_bounds(const DynamicArray<Int32>& leafIds);
+	Void restructure_treelets();
+	Void restructure_treelet(Int32 nodeId, DynamicArray<Float32>& costs);
+	Void relayout_hierarchy();
+	Void gather_cluster(Int32 clusterRootId, 
+						DynamicArray<UInt8>& isClustered, 
+						DynamicArray<Int32>& order, 
+						DynamicArray<Int32>& clusterRootIds,
+						ClusterScratch& scratch) const;
+	Int32 count_triangles(Int32 nodeId, DynamicArray<Int32>& trianglesCounts) const;
+	Int32 collapse_hierarchy(const DynamicArray<BVHNode>& binaryHierarchy,
+							 const DynamicArray<Int32>& trianglesCounts,
+							 Int32 nodeId,
+							 const DynamicArray<UInt32>& indexes,
+							 DynamicArray<UInt32>& reorderedIndexes);
+	Void gather_triangles(const DynamicArray<BVHNode>& binaryHierarchy,
+						  Int32 nodeId,
+						  const DynamicArray<UInt32>& indexes,
+						  DynamicArray<UInt32>& reorderedIndexes) const;
+	UInt64 expand_bits(UInt64 value) const;
+	Int32 count_leading_zeros(UInt64 value) const;
+	Int32 split_median(DynamicArray<PrimitiveReference>& references, Int32 begin, Int32 end);
+	Int32 split_sah(DynamicArray<PrimitiveReference>& references, Int32 begin, Int32 end);
+	Float32 find_best_split(const AxisBins& bins, Int32 binsCount, const FVector3& extent, Int32& bestAxis, Int32& bestSplit) const;
+	Void calculate_centroid_bounds(const DynamicArray<PrimitiveReference>& references, 
+								   Int32 begin, 
+								   Int32 end, 
+								   FVector3& centroidMin, 
+								   FVector3& centroidMax) const;
+	Void fill_bins(const DynamicArray<PrimitiveReference>& references,
+				   Int32 begin,
+				   Int32 end,
+				   const FVector3& centroidMin,
+				   const FVector3& scale,
+				   Int32 binsCount,
+				   AxisBins& bins) const;
+	FVector3 get_bins_scale(const FVector3& centroidMin, const FVector3& centroidMax, Int32 binsCount) const;
+	Int32 get_bin_id(Float32 center, Float32 centroidMin, Float32 scale, Int32 binsCount) const;
+	template<Int32 Width>
+	Int32 collapse_wide_node(Int32 nodeId, DynamicArray<WideBVHNode<Width>>& wideHierarchy) const;
+	template<Int32 Width>
+	Void set_wide_child(WideBVHNode<Width>& wideNode, Int32 slot, const BVHNode& child) const;
+	Void calculate_leaf_bounds(const DynamicArray<Vertex>& vertexes,
+							   const DynamicArray<UInt32>& indexes,
+							   Int32 firstId,
+							   Int32 count,
+							   FVector3& leafMin,
+							   FVector3& leafMax) const;
+	Void merge_ranges(const Pair<Int32, Int32>& range, Pair<Int32, Int32>& result) const;
+	Void compress_node(const BVH4Node& wideNode, CompressedBVHNode& node) const;
 	Void fill_stackless_data(Int32 nodeId, Int32 parentId);
-	Void save_tree(const String& path);
-	Bool load_tree(const String& path);
-	Void min(const FVector3& a, const FVector3& b, const FVector3& c, FVector3& result);
-	Void max(const FVector3& a, const FVector3& b, const FVector3& c, FVector3& result);
-	Void pad(BVHNode& node);
+	Void fill_octant_links(Int32 nodeId, Int32 skipId, Int32 octant, DynamicArray<BVHOctantLinks>& octantLinks) const;
+	UInt64 calculate_scene_hash(const DynamicArray<Vertex>& vertexes, const DynamicArray<UInt32>& indexes) const;
+	UInt64 hash_bytes(const Void* data, UInt64 size, UInt64 hash) const;
+	Void save_tree(const String& path, UInt64 sceneHash, const DynamicArray<UInt32>& indexes);
+	Bool load_tree(const String& path, UInt64 sceneHash, DynamicArray<UInt32>& indexes);
+	Void min(const FVector3& a, const FVector3& b, const FVector3& c, FVector3& result) const;
+	Void max(const FVector3& a, const FVector3& b, const FVector3& c, FVector3& result) const;
+	Void pad(BVHNode& node) const;
+	Float32 surface_area(const FVector3& min, const FVector3& max) const;
+	FVector3 centroid(const FVector3& min, const FVector3& max) const;
 	Int32 rand_int(Int32 min, Int32 max);
 };
-
@@ -10,4 +10,14 @@ struct BVHNode
 	Int32 nextId;
 	Int32 skipId;
 	Int32 primitiveId;
+	Int32 primitiveCount;
+};
+
+/** Stackless links of one node for rays with direction signs of octant, near child is always visited first */
+struct BVHOctantLinks
+{
+	static constexpr Int32 OCTANTS_COUNT = 8;
+
+	// Bit 0, 1 and 2 of octant are set for negative x, y and z of direction
+	Array<IVector2, OCTANTS_COUNT> links; // nextId, skipId
 };
\ No newline at end of file
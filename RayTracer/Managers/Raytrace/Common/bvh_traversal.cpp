@@ -0,0 +1,496 @@
+#include "bvh_traversal.hpp"
+
+#include "bvh_builder.hpp"
+#include "vertex.hpp"
+#include "Utilities/task_scheduler.hpp"
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <emmintrin.h>
+
+namespace
+{
+	/** Bounds of four children, named registers instead of array, because vector types lose alignment as template arguments */
+	struct alignas(16) GroupBounds
+	{
+		__m128 minX;
+		__m128 minY;
+		__m128 minZ;
+		__m128 maxX;
+		__m128 maxY;
+		__m128 maxZ;
+	};
+
+	/** Bounds of four children starting at group */
+	template<Int32 Width>
+	Void load_bounds(const WideBVHNode<Width>& node, Int32 group, GroupBounds& bounds)
+	{
+		bounds.minX = _mm_load_ps(&node.minX[group]);
+		bounds.minY = _mm_load_ps(&node.minY[group]);
+		bounds.minZ = _mm_load_ps(&node.minZ[group]);
+		bounds.maxX = _mm_load_ps(&node.maxX[group]);
+		bounds.maxY = _mm_load_ps(&node.maxY[group]);
+		bounds.maxZ = _mm_load_ps(&node.maxZ[group]);
+	}
+
+	__m128 dequantize(const CompressedBVHNode& node, const Array<UInt8, 4>& quantized, Int32 axis)
+	{
+		// Power of two is built right in exponent bits, same as in shader
+		const __m128 origin = _mm_set1_ps(node.origin[axis]);
+		const __m128 step = _mm_castsi128_ps(_mm_set1_epi32((Int32(node.exponents[axis]) + 127) << 23));
+		const __m128i zero = _mm_setzero_si128();
+		Int32 packed;
+		std::memcpy(&packed, quantized.data(), sizeof(packed));
+		const __m128i levels = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+		// Product is exact, because step is power of two, so decoded bound matches the one checked by builder
+		return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(levels), step));
+	}
+
+	/** Compressed node has four children only, so its single group is always the first one */
+	Void load_bounds(const CompressedBVHNode& node, Int32, GroupBounds& bounds)
+	{
+		bounds.minX = dequantize(node, node.minX, 0);
+		bounds.minY = dequantize(node, node.minY, 1);
+		bounds.minZ = dequantize(node, node.minZ, 2);
+		bounds.maxX = dequantize(node, node.maxX, 0);
+		bounds.maxY = dequantize(node, node.maxY, 1);
+		bounds.maxZ = dequantize(node, node.maxZ, 2);
+	}
+}
+
+BVHTraversal::BVHTraversal(const DynamicArray<Vertex>& vertexes, const DynamicArray<UInt32>& indexes)
+	: vertexes(vertexes)
+	, indexes(indexes)
+{
+}
+
+Bool BVHTraversal::intersect(const DynamicArray<BVHNode>& hierarchy, Int32 rootId, const Ray& ray, Hit& hit) const
+{
+	const FVector3 invDirection = get_inverse_direction(ray.direction);
+	hit.distance = ray.maxDistance;
+	Bool result = false;
+
+	Int32 nodeId = rootId;
+	while (nodeId != -1)
+	{
+		const BVHNode& node = hierarchy[nodeId];
+		hit.visitedNodesCount++;
+		if (!intersect_box(node.min, node.max, ray, invDirection, hit.distance))
+		{
+			nodeId = node.skipId;
+			continue;
+		}
+
+		if (node.primitiveCount > 0)
+		{
+			result |= intersect_leaf(node.primitiveId, node.primitiveCount, ray, hit);
+		}
+		nodeId = node.nextId;
+	}
+
+	return result;
+}
+
+Bool BVHTraversal::intersect(const DynamicArray<BVHNode>& hierarchy, 
+							 const DynamicArray<BVHOctantLinks>& octantLinks, 
+							 Int32 rootId, 
+							 const Ray& ray, 
+							 Hit& hit) const
+{
+	hit.distance = ray.maxDistance;
+	return intersect_subtree(hierarchy, octantLinks, rootId, -1, ray, hit);
+}
+
+Bool BVHTraversal::intersect_subtree(const DynamicArray<BVHNode>& hierarchy,
+									 const DynamicArray<BVHOctantLinks>& octantLinks,
+									 Int32 nodeId,
+									 Int32 stopId,
+									 const Ray& ray,
+									 Hit& hit) const
+{
+	const FVector3 invDirection = get_inverse_direction(ray.direction);
+	const Int32 octant = get_octant(ray.direction);
+	Bool result = false;
+
+	while (nodeId != stopId)
+	{
+		const BVHNode& node = hierarchy[nodeId];
+		const IVector2& link = octantLinks[nodeId].links[octant];
+		hit.visitedNodesCount++;
+		if (!intersect_box(node.min, node.max, ray, invDirection, hit.distance))
+		{
+			nodeId = link.y;
+			continue;
+		}
+
+		if (node.primitiveCount > 0)
+		{
+			result |= intersect_leaf(node.primitiveId, node.primitiveCount, ray, hit);
+		}
+		nodeId = link.x;
+	}
+
+	return result;
+}
+
+template<Int32 Width>
+Bool BVHTraversal::intersect(const DynamicArray<WideBVHNode<Width>>& hierarchy, const Ray& ray, Hit& hit) const
+{
+	return intersect_wide(hierarchy, ray, hit);
+}
+
+template Bool BVHTraversal::intersect<4>(const DynamicArray<BVH4Node>& hierarchy, const Ray& ray, Hit& hit) const;
+template Bool BVHTraversal::intersect<8>(const DynamicArray<BVH8Node>& hierarchy, const Ray& ray, Hit& hit) const;
+
+Bool BVHTraversal::intersect(const DynamicArray<CompressedBVHNode>& hierarchy, const Ray& ray, Hit& hit) const
+{
+	return intersect_wide(hierarchy, ray, hit);
+}
+
+template<typename Node>
+Bool BVHTraversal::intersect_wide(const DynamicArray<Node>& hierarchy, const Ray& ray, Hit& hit) const
+{
+	constexpr Int32 Width = Node::WIDTH;
+	static_assert(Width % 4 == 0, "Children are tested in groups of four");
+	const FVector3 invDirection = get_inverse_direction(ray.direction);
+	const __m128 originX = _mm_set1_ps(ray.origin.x);
+	const __m128 originY = _mm_set1_ps(ray.origin.y);
+	const __m128 originZ = _mm_set1_ps(ray.origin.z);
+	const __m128 invDirectionX = _mm_set1_ps(invDirection.x);
+	const __m128 invDirectionY = _mm_set1_ps(invDirection.y);
+	const __m128 invDirectionZ = _mm_set1_ps(invDirection.z);
+	const __m128 minDistance = _mm_set1_ps(ray.minDistance);
+	const __m128i emptyId = _mm_set1_epi32(-1);
+	hit.distance = ray.maxDistance;
+	Bool result = false;
+
+	Array<StackEntry, STACK_SIZE> stack;
+	Int32 stackSize = 0;
+	stack[stackSize++] = { 0, ray.minDistance };
+	while (stackSize > 0)
+	{
+		const StackEntry entry = stack[--stackSize];
+		if (entry.distance > hit.distance)
+		{
+			continue;
+		}
+
+		const Node& node = hierarchy[entry.nodeId];
+		hit.visitedNodesCount++;
+		const __m128 maxDistance = _mm_set1_ps(hit.distance);
+		alignas(16) Array<Float32, Width> entryDistances;
+		Int32 hitMask = 0;
+		for (Int32 group = 0; group < Width; group += 4)
+		{
+			GroupBounds bounds;
+			load_bounds(node, group, bounds);
+			const __m128 t0X = _mm_mul_ps(_mm_sub_ps(bounds.minX, originX), invDirectionX);
+			const __m128 t1X = _mm_mul_ps(_mm_sub_ps(bounds.maxX, originX), invDirectionX);
+			const __m128 t0Y = _mm_mul_ps(_mm_sub_ps(bounds.minY, originY), invDirectionY);
+			const __m128 t1Y = _mm_mul_ps(_mm_sub_ps(bounds.maxY, originY), invDirectionY);
+			const __m128 t0Z = _mm_mul_ps(_mm_sub_ps(bounds.minZ, originZ), invDirectionZ);
+			const __m128 t1Z = _mm_mul_ps(_mm_sub_ps(bounds.maxZ, originZ), invDirectionZ);
+
+			const __m128 entryDistance = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0X, t1X), _mm_min_ps(t0Y, t1Y)),
+													_mm_max_ps(_mm_min_ps(t0Z, t1Z), minDistance));
+			const __m128 exitDistance  = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0X, t1X), _mm_max_ps(t0Y, t1Y)),
+													_mm_min_ps(_mm_max_ps(t0Z, t1Z), maxDistance));
+			const __m128i childIds = _mm_load_si128(reinterpret_cast<const __m128i*>(&node.childIds[group]));
+			const __m128 isValid = _mm_castsi128_ps(_mm_cmpgt_epi32(childIds, emptyId));
+			hitMask |= _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(entryDistance, exitDistance), isValid)) << group;
+			_mm_store_ps(&entryDistances[group], entryDistance);
+		}
+
+		// Hit children are sorted from the nearest one
+		Array<Int32, Width> order;
+		Int32 hitCount = 0;
+		for (Int32 slot = 0; slot < Width; ++slot)
+		{
+			if ((hitMask & (1 << slot)) == 0)
+			{
+				continue;
+			}
+
+			Int32 i = hitCount++;
+			while (i > 0 && entryDistances[order[i - 1]] > entryDistances[slot])
+			{
+				order[i] = order[i - 1];
+				--i;
+			}
+			order[i] = slot;
+		}
+
+		// Leaves are tested right away, internal nodes are pushed from the farthest, so the nearest is popped first
+		for (Int32 i = 0; i < hitCount; ++i)
+		{
+			const Int32 slot = order[i];
+			if (node.primitiveCounts[slot] > 0 && entryDistances[slot] <= hit.distance)
+			{
+				result |= intersect_leaf(node.childIds[slot], node.primitiveCounts[slot], ray, hit);
+			}
+		}
+		for (Int32 i = hitCount - 1; i >= 0; --i)
+		{
+			const Int32 slot = order[i];
+			if (node.primitiveCounts[slot] > 0)
+			{
+				continue;
+			}
+			if (stackSize == STACK_SIZE)
+			{
+				// Callers check depth of tree by is_stack_enough, so only unchecked tree gets here
+				SPDLOG_ERROR("Stack of wide traversal overflowed, subtree of node {} is skipped", node.childIds[slot]);
+				continue;
+			}
+			stack[stackSize++] = { node.childIds[slot], entryDistances[slot] };
+		}
+	}
+
+	return result;
+}
+
+template<Int32 Width>
+Bool BVHTraversal::is_stack_enough(const BVHBuilder& bvh, const DynamicArray<WideBVHNode<Width>>& hierarchy) const
+{
+	const Int32 depth = bvh.get_wide_tree_depth(hierarchy);
+	if ((Width - 1) * depth + 1 > STACK_SIZE)
+	{
+		SPDLOG_ERROR("BVH{} of depth {} overflows traversal stack of {} entries", Width, depth, STACK_SIZE);
+		return false;
+	}
+	return true;
+}
+
+template Bool BVHTraversal::is_stack_enough<4>(const BVHBuilder& bvh, const DynamicArray<BVH4Node>& hierarchy) const;
+template Bool BVHTraversal::is_stack_enough<8>(const BVHBuilder& bvh, const DynamicArray<BVH8Node>& hierarchy) const;
+
+Void BVHTraversal::benchmark(const BVHBuilder& bvh, Int32 raysCount) const
+{
+	DynamicArray<BVH4Node> bvh4;
+	DynamicArray<BVH8Node> bvh8;
+	DynamicArray<CompressedBVHNode> compressed;
+	DynamicArray<BVHOctantLinks> octantLinks;
+	bvh.create_octant_links(octantLinks);
+	bvh.create_wide_tree(bvh4);
+	bvh.create_wide_tree(bvh8);
+	// Compressed tree has the same topology as BVH4
+	if (!is_stack_enough(bvh, bvh4) || !is_stack_enough(bvh, bvh8))
+	{
+		return;
+	}
+	bvh.create_compressed_tree(bvh4, compressed);
+
+	const DynamicArray<Ray> rays = generate_rays(raysCount);
+	DynamicArray<Hit> binaryHits(rays.size());
+	DynamicArray<Hit> orderedHits(rays.size());
+	DynamicArray<Hit> bvh4Hits(rays.size());
+	DynamicArray<Hit> bvh8Hits(rays.size());
+	DynamicArray<Hit> compressedHits(rays.size());
+
+	const Float32 binaryTime = trace_rays(rays, binaryHits, [&](const Ray& ray, Hit& hit)
+	{
+		return intersect(bvh.hierarchy, bvh.rootId, ray, hit);
+	});
+	const Float32 orderedTime = trace_rays(rays, orderedHits, [&](const Ray& ray, Hit& hit)
+	{
+		return intersect(bvh.hierarchy, octantLinks, bvh.rootId, ray, hit);
+	});
+	const Float32 bvh4Time = trace_rays(rays, bvh4Hits, [&](const Ray& ray, Hit& hit)
+	{
+		return intersect(bvh4, ray, hit);
+	});
+	const Float32 bvh8Time = trace_rays(rays, bvh8Hits, [&](const Ray& ray, Hit& hit)
+	{
+		return intersect(bvh8, ray, hit);
+	});
+	const Float32 compressedTime = trace_rays(rays, compressedHits, [&](const Ray& ray, Hit& hit)
+	{
+		return intersect(compressed, ray, hit);
+	});
+
+	Int32 mismatchesCount = 0;
+	for (UInt64 i = 0; i < rays.size(); ++i)
+	{
+		const Float32 tolerance = 1e-4f * glm::max(1.0f, binaryHits[i].distance);
+		if (glm::abs(binaryHits[i].distance - orderedHits[i].distance) > tolerance ||
+			glm::abs(binaryHits[i].distance - bvh4Hits[i].distance) > tolerance ||
+			glm::abs(binaryHits[i].distance - bvh8Hits[i].distance) > tolerance ||
+			glm::abs(binaryHits[i].distance - compressedHits[i].distance) > tolerance)
+		{
+			++mismatchesCount;
+		}
+	}
+
+	const Float32 megaRays = Float32(rays.size()) * 0.001f;
+	SPDLOG_INFO("BVH benchmark, {} rays on {} threads", rays.size(), TaskScheduler::get().get_threads_count());
+	SPDLOG_INFO("Binary: {:.2f} ms, {:.2f} Mrays/s", binaryTime, megaRays / binaryTime);
+	SPDLOG_INFO("Binary ordered by octant: {:.2f} ms, {:.2f} Mrays/s, speedup {:.2f}", 
+				orderedTime, 
+				megaRays / orderedTime, 
+				binaryTime / orderedTime);
+	SPDLOG_INFO("BVH4:   {:.2f} ms, {:.2f} Mrays/s, speedup {:.2f}", bvh4Time, megaRays / bvh4Time, binaryTime / bvh4Time);
+	SPDLOG_INFO("BVH8:   {:.2f} ms, {:.2f} Mrays/s, speedup {:.2f}", bvh8Time, megaRays / bvh8Time, binaryTime / bvh8Time);
+	SPDLOG_INFO("Compressed BVH4: {:.2f} ms, {:.2f} Mrays/s, speedup {:.2f}", compressedTime, megaRays / compressedTime, binaryTime / compressedTime);
+	SPDLOG_INFO("Memory, binary: {:.2f} MB, BVH4: {:.2f} MB, compressed BVH4: {:.2f} MB",
+				Float32(bvh.hierarchy.size() * sizeof(BVHNode)) / (1024.0f * 1024.0f),
+				Float32(bvh4.size() * sizeof(BVH4Node)) / (1024.0f * 1024.0f),
+				Float32(compressed.size() * sizeof(CompressedBVHNode)) / (1024.0f * 1024.0f));
+	SPDLOG_INFO("Average visited nodes per ray, binary: {:.1f}, ordered by octant: {:.1f}, BVH4: {:.1f}, BVH8: {:.1f}",
+				get_average_visits(binaryHits),
+				get_average_visits(orderedHits),
+				get_average_visits(bvh4Hits),
+				get_average_visits(bvh8Hits));
+	if (mismatchesCount > 0)
+	{
+		SPDLOG_WARN("Other traversals disagree with binary tree for {} rays", mismatchesCount);
+	}
+}
+
+Bool BVHTraversal::intersect_leaf(Int32 firstId, Int32 count, const Ray& ray, Hit& hit) const
+{
+	Bool result = false;
+	hit.testedTrianglesCount += count;
+	for (Int32 i = 0; i < count; ++i)
+	{
+		const Int32 triangleId = firstId + i * 3;
+		Float32 distance;
+		if (intersect_triangle(triangleId, ray, distance) && distance < hit.distance)
+		{
+			hit.distance = distance;
+			hit.triangleId = triangleId;
+			result = true;
+		}
+	}
+	return result;
+}
+
+Bool BVHTraversal::intersect_triangle(Int32 triangleId, const Ray& ray, Float32& distance) const
+{
+	// Moller-Trumbore, alpha testing is left to shaders, because textures live on GPU
+	const FVector3& a = vertexes[indexes[triangleId + 0]].position;
+	const FVector3& b = vertexes[indexes[triangleId + 1]].position;
+	const FVector3& c = vertexes[indexes[triangleId + 2]].position;
+	const FVector3 edge1 = b - a;
+	const FVector3 edge2 = c - a;
+	const FVector3 dirXe2 = glm::cross(ray.direction, edge2);
+	const Float32 det = glm::dot(edge1, dirXe2);
+	if (glm::abs(det) < 1e-12f)
+	{
+		return false;
+	}
+
+	const Float32 invDet = 1.0f / det;
+	const FVector3 s = ray.origin - a;
+	const Float32 u = invDet * glm::dot(s, dirXe2);
+	if (u < 0.0f || u > 1.0f)
+	{
+		return false;
+	}
+
+	const FVector3 sXe1 = glm::cross(s, edge1);
+	const Float32 v = invDet * glm::dot(ray.direction, sXe1);
+	if (v < 0.0f || u + v > 1.0f)
+	{
+		return false;
+	}
+
+	distance = invDet * glm::dot(edge2, sXe1);
+	return distance >= ray.minDistance && distance <= ray.maxDistance;
+}
+
+Bool BVHTraversal::intersect_box(const FVector3& min, const FVector3& max, const Ray& ray, const FVector3& invDirection, Float32 maxDistance) const
+{
+	const FVector3 t0 = (min - ray.origin) * invDirection;
+	const FVector3 t1 = (max - ray.origin) * invDirection;
+	const FVector3 tMin = glm::min(t0, t1);
+	const FVector3 tMax = glm::max(t0, t1);
+	const Float32 entryDistance = glm::max(glm::max(tMin.x, tMin.y), glm::max(tMin.z, ray.minDistance));
+	const Float32 exitDistance = glm::min(glm::min(tMax.x, tMax.y), glm::min(tMax.z, maxDistance));
+	return entryDistance <= exitDistance;
+}
+
+Int32 BVHTraversal::get_octant(const FVector3& direction)
+{
+	return (direction.x < 0.0f ? 1 : 0) | (direction.y < 0.0f ? 2 : 0) | (direction.z < 0.0f ? 4 : 0);
+}
+
+FVector3 BVHTraversal::get_inverse_direction(const FVector3& direction)
+{
+	// Zero components would give infinities and NaNs in box tests
+	FVector3 result;
+	for (Int32 axis = 0; axis < 3; ++axis)
+	{
+		const Float32 component = glm::abs(direction[axis]) < 1e-12f ? std::copysign(1e-12f, direction[axis]) : direction[axis];
+		result[axis] = 1.0f / component;
+	}
+	return result;
+}
+
+DynamicArray<BVHTraversal::Ray> BVHTraversal::generate_rays(Int32 raysCount) const
+{
+	// Rays start on random triangles in random directions, like bounces of path tracer
+	DynamicArray<Ray> rays(raysCount);
+	const UInt32 trianglesCount = UInt32(indexes.size() / 3);
+	if (trianglesCount == 0)
+	{
+		rays.clear();
+		return rays;
+	}
+
+	std::mt19937 generator(1234U);
+	std::uniform_real_distribution<Float32> distribution(0.0f, 1.0f);
+	for (Ray& ray : rays)
+	{
+		const UInt32 triangleId = UInt32(generator() % trianglesCount) * 3;
+		const FVector3& a = vertexes[indexes[triangleId + 0]].position;
+		const FVector3& b = vertexes[indexes[triangleId + 1]].position;
+		const FVector3& c = vertexes[indexes[triangleId + 2]].position;
+		const Float32 r1 = glm::sqrt(distribution(generator));
+		const Float32 r2 = distribution(generator);
+		ray.origin = a * (1.0f - r1) + b * (r1 * (1.0f - r2)) + c * (r1 * r2);
+
+		const Float32 z = distribution(generator) * 2.0f - 1.0f;
+		const Float32 phi = glm::radians(360.0f * distribution(generator));
+		const Float32 radius = glm::sqrt(glm::max(0.0f, 1.0f - z * z));
+		ray.direction = FVector3(radius * std::cos(phi), radius * std::sin(phi), z);
+		ray.minDistance = 0.001f;
+		ray.maxDistance = 5000.0f;
+	}
+	return rays;
+}
+
+Float32 BVHTraversal::trace_rays(const DynamicArray<Ray>& rays, DynamicArray<Hit>& hits, const std::function<Bool(const Ray&, Hit&)>& intersect) const
+{
+	const auto startTime = std::chrono::steady_clock::now();
+	TaskScheduler::get().parallel_for(0, Int32(rays.size()), BENCHMARK_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+	{
+		for (Int32 i = begin; i < end; ++i)
+		{
+			hits[i].triangleId = -1;
+			hits[i].visitedNodesCount = 0;
+			hits[i].testedTrianglesCount = 0;
+			intersect(rays[i], hits[i]);
+		}
+	});
+	return std::chrono::duration<Float32, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+Float32 BVHTraversal::get_average_visits(const DynamicArray<Hit>& hits) const
+{
+	UInt64 visitsCount = 0;
+	for (const Hit& hit : hits)
+	{
+		visitsCount += UInt64(hit.visitedNodesCount);
+	}
+	return hits.empty() ? 0.0f : Float32(visitsCount) / Float32(hits.size());
+}
+
+Float32 BVHTraversal::get_average_tests(const DynamicArray<Hit>& hits) const
+{
+	UInt64 testsCount = 0;
+	for (const Hit& hit : hits)
+	{
+		testsCount += UInt64(hit.testedTrianglesCount);
+	}
+	return hits.empty() ? 0.0f : Float32(testsCount) / Float32(hits.size());
+}
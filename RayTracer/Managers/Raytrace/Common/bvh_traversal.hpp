@@ -0,0 +1,92 @@
+#pragma once
+#include "bvh_node.hpp"
+#include "wide_bvh_node.hpp"
+#include "compressed_bvh_node.hpp"
+#include <functional>
+
+struct Vertex;
+class BVHBuilder;
+
+/** CPU traversal mirroring RayTrace.comp, used to validate and benchmark node formats */
+class BVHTraversal
+{
+public:
+	struct Ray
+	{
+		FVector3 origin;
+		FVector3 direction;
+		Float32 minDistance;
+		Float32 maxDistance;
+	};
+
+	struct Hit
+	{
+		Float32 distance;
+		// Offset of the first index of triangle, same as triangle id in shaders
+		Int32 triangleId;
+		Int32 visitedNodesCount;
+		Int32 testedTrianglesCount;
+	};
+
+	BVHTraversal(const DynamicArray<Vertex>& vertexes, const DynamicArray<UInt32>& indexes);
+
+	/** Stackless traversal of binary tree */
+	Bool intersect(const DynamicArray<BVHNode>& hierarchy, Int32 rootId, const Ray& ray, Hit& hit) const;
+	/** Stackless traversal of binary tree with links of ray direction octant, near children are visited first */
+	Bool intersect(const DynamicArray<BVHNode>& hierarchy, 
+				   const DynamicArray<BVHOctantLinks>& octantLinks, 
+				   Int32 rootId, 
+				   const Ray& ray, 
+				   Hit& hit) const;
+	/** Continues ordered traversal from nodeId until stopId, which is skip link of subtree root, distance of hit is kept */
+	Bool intersect_subtree(const DynamicArray<BVHNode>& hierarchy,
+						   const DynamicArray<BVHOctantLinks>& octantLinks,
+						   Int32 nodeId,
+						   Int32 stopId,
+						   const Ray& ray,
+						   Hit& hit) const;
+	/** Children of every node are tested with SSE, four at once */
+	template<Int32 Width>
+	Bool intersect(const DynamicArray<WideBVHNode<Width>>& hierarchy, const Ray& ray, Hit& hit) const;
+	/** Same as BVH4, but children bounds are dequantized first */
+	Bool intersect(const DynamicArray<CompressedBVHNode>& hierarchy, const Ray& ray, Hit& hit) const;
+	/** Wide traversal pushes up to Width - 1 internal children per level, so deeper trees would overflow its stack */
+	template<Int32 Width>
+	[[nodiscard]]
+	Bool is_stack_enough(const BVHBuilder& bvh, const DynamicArray<WideBVHNode<Width>>& hierarchy) const;
+	/** Traces the same incoherent rays through binary, BVH4, BVH8 and compressed trees on all threads and logs throughput */
+	Void benchmark(const BVHBuilder& bvh, Int32 raysCount) const;
+	/** Rays start on random triangles in random directions, the same set for given count */
+	DynamicArray<Ray> generate_rays(Int32 raysCount) const;
+	/** Returns time of tracing all rays on all threads in milliseconds, counters of hits are reset first */
+	Float32 trace_rays(const DynamicArray<Ray>& rays, DynamicArray<Hit>& hits, const std::function<Bool(const Ray&, Hit&)>& intersect) const;
+	[[nodiscard]]
+	Float32 get_average_visits(const DynamicArray<Hit>& hits) const;
+	[[nodiscard]]
+	Float32 get_average_tests(const DynamicArray<Hit>& hits) const;
+	/** Bit 0, 1 and 2 are set for negative x, y and z, same as in BVHOctantLinks */
+	[[nodiscard]]
+	static Int32 get_octant(const FVector3& direction);
+	/** Zero components are replaced by tiny values of the same sign, so box tests have no NaNs */
+	[[nodiscard]]
+	static FVector3 get_inverse_direction(const FVector3& direction);
+
+private:
+	static constexpr Int32 STACK_SIZE = 128;
+	static constexpr Int32 BENCHMARK_GRAIN_SIZE = 1024;
+
+	struct StackEntry
+	{
+		Int32 nodeId;
+		Float32 distance;
+	};
+
+	const DynamicArray<Vertex>& vertexes;
+	const DynamicArray<UInt32>& indexes;
+
+	template<typename Node>
+	Bool intersect_wide(const DynamicArray<Node>& hierarchy, const Ray& ray, Hit& hit) const;
+	Bool intersect_leaf(Int32 firstId, Int32 count, const Ray& ray, Hit& hit) const;
+	Bool intersect_triangle(Int32 triangleId, const Ray& ray, Float32& distance) const;
+	Bool intersect_box(const FVector3& min, const FVector3& max, const Ray& ray, const FVector3& invDirection, Float32 maxDistance) const;
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+/**
+ * Four wide node with children bounds quantized to 8 bits relative to node bounds.
+ * Child bound is decoded as origin + quantized * 2^exponent, which is conservative and exact in multiplication
+ */
+struct alignas(16) CompressedBVHNode
+{
+	static constexpr Int32 WIDTH = 4;
+
+	FVector3 origin;
+	// Exponent of quantization step for every axis, last one is unused
+	Array<Int8, 4> exponents;
+	// Same as in wide node: wide node id, offset of first index or -1 for empty slot
+	Array<Int32, WIDTH> childIds;
+	Array<UInt8, WIDTH> minX;
+	Array<UInt8, WIDTH> minY;
+	Array<UInt8, WIDTH> minZ;
+	Array<UInt8, WIDTH> maxX;
+	Array<UInt8, WIDTH> maxY;
+	Array<UInt8, WIDTH> maxZ;
+	Array<UInt8, WIDTH> primitiveCounts;
+	UInt32 padding;
+};
+
+static_assert(sizeof(CompressedBVHNode) == 64, "Layout has to match CompressedBVHNode in RayTrace.comp");
@@ -0,0 +1,1091 @@
+#include "cpu_raytracer.hpp"
+
+#include <chrono>
+
+#include "../../Resource/Common/handle.hpp"
+#include "../../Resource/Common/texture.hpp"
+#include "bvh_traversal.hpp"
+#include "vertex.hpp"
+#include "Utilities/task_scheduler.hpp"
+
+namespace
+{
+	constexpr Float32 PI = 3.1415926535897932384626433832795f;
+	constexpr Float32 ONE_OVER_PI = 1.0f / PI;
+	constexpr Float32 ONE_OVER_TWO_PI = 1.0f / (2.0f * PI);
+	constexpr Float32 INV_UINT_MAX = 1.0f / Float32(0xffffffffU);
+}
+
+CPURaytracer::CPURaytracer(const RaytraceScene& scene, const DynamicArray<Texture>& textures)
+	: scene(scene)
+	, textures(textures)
+{
+}
+
+Void CPURaytracer::setup(const View& view, const IVector2& imageSize)
+{
+	this->view = view;
+	this->imageSize = imageSize;
+	frameCount = 0;
+	statistics = Statistics();
+
+	const Float32 h = glm::tan(glm::radians(view.fov) * 0.5f);
+	FVector2 viewportSize;
+	viewportSize.y = 2.0f * h;
+	viewportSize.x = viewportSize.y * Float32(imageSize.x) / Float32(imageSize.y);
+
+	const FVector3 viewportU = viewportSize.x * view.right;
+	const FVector3 viewportV = viewportSize.y * view.up;
+	pixelDeltaU = viewportU / Float32(imageSize.x);
+	pixelDeltaV = viewportV / Float32(imageSize.y);
+	const FVector3 originPixel = view.position + view.forward + (pixelDeltaU - viewportU + pixelDeltaV - viewportV) * 0.5f;
+
+	const UInt64 pixelsCount = UInt64(imageSize.x) * UInt64(imageSize.y);
+	directions.resize(pixelsCount);
+	accumulation.assign(pixelsCount, FVector3(0.0f));
+	for (Int32 y = 0; y < imageSize.y; ++y)
+	{
+		for (Int32 x = 0; x < imageSize.x; ++x)
+		{
+			const FVector3 pixelPosition = originPixel + Float32(x) * pixelDeltaU + Float32(y) * pixelDeltaV;
+			directions[UInt64(y) * imageSize.x + x] = glm::normalize(pixelPosition - view.position);
+		}
+	}
+}
+
+Void CPURaytracer::trace_frame()
+{
+	const auto frameBegin = std::chrono::steady_clock::now();
+	statistics.raysCounts.resize(UInt64(maxBouncesCount) + 1ULL, 0ULL);
+	statistics.traceTimes.resize(UInt64(maxBouncesCount) + 1ULL, 0.0);
+	if (traceMode == ECPUTraceMode::Wavefront)
+	{
+		trace_wavefront();
+	} else {
+		// Every pixel has its own random state, so image doesn't depend on count of threads or order of tiles
+		const Int32 tilesCount = ((imageSize.x + TILE_SIZE - 1) / TILE_SIZE) * ((imageSize.y + TILE_SIZE - 1) / TILE_SIZE);
+		TaskScheduler::get().parallel_for(0, tilesCount, 1, [&](Int32 begin, Int32 end)
+		{
+			for (Int32 tileId = begin; tileId < end; ++tileId)
+			{
+				trace_tile(tileId);
+			}
+		});
+	}
+	statistics.totalTime += std::chrono::duration<Float64>(std::chrono::steady_clock::now() - frameBegin).count();
+	frameCount++;
+}
+
+Void CPURaytracer::resolve(Texture& texture) const
+{
+	texture.size = imageSize;
+	texture.channels = 4;
+	const UInt64 pixelsCount = UInt64(imageSize.x) * UInt64(imageSize.y);
+	texture.data = reinterpret_cast<UInt8*>(realloc(texture.data, pixelsCount * texture.channels));
+	if (texture.data == nullptr)
+	{
+		SPDLOG_ERROR("Failed to allocate texture memory");
+		return;
+	}
+
+	const Float32 invFrameCount = 1.0f / Float32(glm::max(frameCount, 1));
+	for (UInt64 i = 0; i < pixelsCount; ++i)
+	{
+		const FVector3 color = glm::clamp(glm::pow(accumulation[i] * invFrameCount, FVector3(1.0f / 2.2f)), 0.0f, 1.0f);
+		texture.data[i * 4 + 0] = UInt8(color.x * 255.0f);
+		texture.data[i * 4 + 1] = UInt8(color.y * 255.0f);
+		texture.data[i * 4 + 2] = UInt8(color.z * 255.0f);
+		texture.data[i * 4 + 3] = 255U;
+	}
+}
+
+Int32 CPURaytracer::get_frame_count() const
+{
+	return frameCount;
+}
+
+const CPURaytracer::Statistics& CPURaytracer::get_statistics() const
+{
+	return statistics;
+}
+
+Void CPURaytracer::trace_tile(Int32 tileId)
+{
+	const Int32 tilesPerRow = (imageSize.x + TILE_SIZE - 1) / TILE_SIZE;
+	const Int32 beginX = (tileId % tilesPerRow) * TILE_SIZE;
+	const Int32 beginY = (tileId / tilesPerRow) * TILE_SIZE;
+	const Int32 endX = glm::min(beginX + TILE_SIZE, imageSize.x);
+	const Int32 endY = glm::min(beginY + TILE_SIZE, imageSize.y);
+	DynamicArray<UInt64> raysCounts(statistics.raysCounts.size(), 0ULL);
+	for (Int32 y = beginY; y < endY; ++y)
+	{
+		for (Int32 x = beginX; x < endX; ++x)
+		{
+			const Int32 pixelId = x + y * imageSize.x;
+			PathState path = create_path(pixelId);
+			accumulation[pixelId] += trace_path(path, raysCounts);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(statisticsMutex);
+	for (UInt64 i = 0; i < raysCounts.size(); ++i)
+	{
+		statistics.raysCounts[i] += raysCounts[i];
+	}
+}
+
+FVector3 CPURaytracer::trace_path(PathState& path, DynamicArray<UInt64>& raysCounts) const
+{
+	for (Int32 bounce = 0; bounce < maxBouncesCount + 1; ++bounce)
+	{
+		apply_russian_roulette(bounce, path);
+		if (path.color == FVector3(0.0f))
+		{
+			break;
+		}
+
+		raysCounts[bounce]++;
+		HitInfo info;
+		const Bool isHit = hit(path.ray, view.viewBounds.y + 1.0f, info);
+		if (!shade(get_shading_type(info, isHit), info, bounce, path))
+		{
+			break;
+		}
+	}
+	return path.radiance + path.color;
+}
+
+CPURaytracer::PathState CPURaytracer::create_path(Int32 pixelId) const
+{
+	PathState path;
+	path.pixelId = pixelId;
+	path.color = FVector3(1.0f);
+	path.radiance = FVector3(0.0f);
+	path.cosinePdf = -1.0f;
+	path.lightId = -1;
+	path.normal = FVector3(0.0f);
+	path.random.state = (UInt32(pixelId) * UInt32(frameCount + 1)) ^ (seed * 0x9e3779b9U);
+
+	path.ray.origin = view.position;
+	const Float32 invSectorsCount = 1.0f / Float32(SECTORS_COUNT);
+	const IVector2 gridOffset(frameCount % SECTORS_COUNT, (frameCount / SECTORS_COUNT) % SECTORS_COUNT);
+	const Float32 offsetX = path.random.next();
+	const Float32 offsetY = path.random.next();
+	const FVector2 offset = (FVector2(offsetX, offsetY) + FVector2(gridOffset)) * invSectorsCount - 0.5f;
+	const FVector3 randomOffset = (offset.x * pixelDeltaU) + (offset.y * pixelDeltaV);
+	path.ray.direction = glm::normalize(directions[pixelId] + randomOffset);
+	return path;
+}
+
+Void CPURaytracer::apply_russian_roulette(Int32 bounce, PathState& path) const
+{
+	if (rouletteBouncesCount == RaytraceScene::NO_ROULETTE || bounce <= rouletteBouncesCount || path.color == FVector3(0.0f))
+	{
+		return;
+	}
+
+	const Float32 survivalProbability = glm::min(glm::max(path.color.x, glm::max(path.color.y, path.color.z)), 1.0f);
+	if (path.random.next() >= survivalProbability)
+	{
+		path.color = FVector3(0.0f);
+		return;
+	}
+	path.color /= survivalProbability;
+}
+
+Void CPURaytracer::trace_wavefront()
+{
+	// Batches bound memory of path states, rays of one batch are traced together bounce after bounce
+	const Int32 pixelsCount = imageSize.x * imageSize.y;
+	for (Int32 firstPixelId = 0; firstPixelId < pixelsCount; firstPixelId += WAVEFRONT_BATCH_SIZE)
+	{
+		trace_batch(firstPixelId, glm::min(WAVEFRONT_BATCH_SIZE, pixelsCount - firstPixelId));
+	}
+}
+
+Void CPURaytracer::trace_batch(Int32 firstPixelId, Int32 pixelsCount)
+{
+	TaskScheduler& taskScheduler = TaskScheduler::get();
+	paths.resize(pixelsCount);
+	taskScheduler.parallel_for(0, pixelsCount, WAVEFRONT_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+	{
+		for (Int32 i = begin; i < end; ++i)
+		{
+			paths[i] = create_path(firstPixelId + i);
+		}
+	});
+
+	for (Int32 bounce = 0; bounce < maxBouncesCount + 1; ++bounce)
+	{
+		if (rouletteBouncesCount != RaytraceScene::NO_ROULETTE && bounce > rouletteBouncesCount)
+		{
+			taskScheduler.parallel_for(0, Int32(paths.size()), WAVEFRONT_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+			{
+				for (Int32 i = begin; i < end; ++i)
+				{
+					apply_russian_roulette(bounce, paths[i]);
+				}
+			});
+		}
+
+		for (const PathState& path : paths)
+		{
+			if (path.color == FVector3(0.0f))
+			{
+				accumulation[path.pixelId] += path.radiance;
+			}
+		}
+		paths.erase(std::remove_if(paths.begin(), paths.end(), [](const PathState& path)
+		{
+			return path.color == FVector3(0.0f);
+		}), paths.end());
+		if (paths.empty())
+		{
+			break;
+		}
+
+		if (bounce > 0)
+		{
+			sort_paths();
+		}
+
+		const Int32 pathsCount = Int32(paths.size());
+		hits.resize(pathsCount);
+		shadingTypes.resize(pathsCount);
+		const auto traceBegin = std::chrono::steady_clock::now();
+		taskScheduler.parallel_for(0, pathsCount, WAVEFRONT_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+		{
+			for (Int32 i = begin; i < end; ++i)
+			{
+				shadingTypes[i] = get_shading_type(hits[i], hit(paths[i].ray, view.viewBounds.y + 1.0f, hits[i]));
+			}
+		});
+		statistics.traceTimes[bounce] += std::chrono::duration<Float64>(std::chrono::steady_clock::now() - traceBegin).count();
+		statistics.raysCounts[bounce] += UInt64(pathsCount);
+
+		shade_paths(bounce);
+	}
+
+	for (const PathState& path : paths)
+	{
+		accumulation[path.pixelId] += path.radiance + path.color;
+	}
+}
+
+Void CPURaytracer::sort_paths()
+{
+	// Rays starting in the same cell and going into the same octant visit the same nodes, so neighbouring rays share cache
+	const BVHNode& root = scene.topLevelTree.hierarchy[scene.topLevelTree.rootId];
+	const FVector3 cellScale = Float32(SORT_CELLS_COUNT) / glm::max(root.max - root.min, FVector3(EPSILON));
+	const Int32 pathsCount = Int32(paths.size());
+	sortKeys.resize(pathsCount);
+	binOffsets.assign(SORT_KEYS_COUNT + 1, 0);
+	for (Int32 i = 0; i < pathsCount; ++i)
+	{
+		const Ray& ray = paths[i].ray;
+		const IVector3 cell = glm::clamp(IVector3((ray.origin - root.min) * cellScale), IVector3(0), IVector3(SORT_CELLS_COUNT - 1));
+		const Int32 key = ((cell.x * SORT_CELLS_COUNT + cell.y) * SORT_CELLS_COUNT + cell.z) * 8 + BVHTraversal::get_octant(ray.direction);
+		sortKeys[i] = key;
+		binOffsets[key + 1]++;
+	}
+	for (Int32 i = 0; i < SORT_KEYS_COUNT; ++i)
+	{
+		binOffsets[i + 1] += binOffsets[i];
+	}
+
+	sortedPaths.resize(pathsCount);
+	for (Int32 i = 0; i < pathsCount; ++i)
+	{
+		sortedPaths[binOffsets[sortKeys[i]]++] = paths[i];
+	}
+	std::swap(paths, sortedPaths);
+}
+
+Void CPURaytracer::shade_paths(Int32 bounce)
+{
+	const Int32 pathsCount = Int32(paths.size());
+	Array<Int32, UInt64(EShadingType::Count) + 1ULL> typeOffsets = {};
+	for (Int32 i = 0; i < pathsCount; ++i)
+	{
+		typeOffsets[UInt64(shadingTypes[i]) + 1ULL]++;
+	}
+	for (UInt64 i = 0; i < UInt64(EShadingType::Count); ++i)
+	{
+		typeOffsets[i + 1] += typeOffsets[i];
+	}
+
+	shadingOrder.resize(pathsCount);
+	Array<Int32, UInt64(EShadingType::Count)> nextIds;
+	std::copy_n(typeOffsets.begin(), nextIds.size(), nextIds.begin());
+	for (Int32 i = 0; i < pathsCount; ++i)
+	{
+		shadingOrder[nextIds[UInt64(shadingTypes[i])]++] = i;
+	}
+
+	TaskScheduler& taskScheduler = TaskScheduler::get();
+	for (UInt64 typeId = 0; typeId < UInt64(EShadingType::Count); ++typeId)
+	{
+		const EShadingType type = EShadingType(typeId);
+		taskScheduler.parallel_for(typeOffsets[typeId], typeOffsets[typeId + 1], WAVEFRONT_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+		{
+			for (Int32 i = begin; i < end; ++i)
+			{
+				shade(type, hits[shadingOrder[i]], bounce, paths[shadingOrder[i]]);
+			}
+		});
+	}
+}
+
+CPURaytracer::EShadingType CPURaytracer::get_shading_type(const HitInfo& info, Bool isHit) const
+{
+	if (!isHit)
+	{
+		return EShadingType::Miss;
+	}
+
+	const GPUMaterial& material = scene.materials[info.materialId];
+	const FVector3 emission = FVector3(get_color_from_texture(material.emission, info.uv));
+	if (glm::any(glm::greaterThan(emission, FVector3(0.0f))))
+	{
+		return EShadingType::Emission;
+	}
+	if (material.indexOfRefraction != 0.0f)
+	{
+		return EShadingType::Dielectric;
+	}
+	return get_color_from_texture(material.metalness, info.uv).z > 0.0f ? EShadingType::Metallic : EShadingType::Lambertian;
+}
+
+Bool CPURaytracer::shade(EShadingType type, const HitInfo& info, Int32 bounce, PathState& path) const
+{
+	Float32 emissionWeight = 1.0f;
+	if (path.cosinePdf >= 0.0f)
+	{
+		const Int32 lightId = get_light_id(info, type != EShadingType::Miss);
+		if (lightSampling == ELightSampling::Mixture)
+		{
+			// Weights of emission are explained in main() of RayTrace.comp
+			if (path.lightId != -1 && path.lightId != lightId)
+			{
+				path.color = FVector3(0.0f);
+				return false;
+			}
+			path.color *= path.cosinePdf / get_pdf_value(path.cosinePdf, path.ray, path.normal, info, lightId);
+		} else {
+			if (lightId != -1)
+			{
+				emissionWeight = get_mis_weight(path.cosinePdf, get_lights_pdf(path.ray, path.normal, info, lightId) * (1.0f - scene.environmentProbability));
+			}
+			if (type == EShadingType::Miss && scene.environmentProbability > 0.0f)
+			{
+				emissionWeight = get_mis_weight(path.cosinePdf, get_environment_pdf(path.ray.direction) * scene.environmentProbability);
+			}
+		}
+		path.cosinePdf = -1.0f;
+	}
+
+	if (type == EShadingType::Miss)
+	{
+		path.radiance += path.color * FVector3(get_color_from_texture(environmentMapId, sample_sphere(path.ray.direction))) * emissionWeight;
+		path.color = FVector3(0.0f);
+		return false;
+	}
+
+	const GPUMaterial& material = scene.materials[info.materialId];
+	if (type == EShadingType::Emission)
+	{
+		path.radiance += path.color * calculate_emission_material(info, FVector3(get_color_from_texture(material.emission, info.uv))) * emissionWeight;
+		path.color = FVector3(0.0f);
+		return false;
+	}
+
+	const FVector3 albedo = FVector3(get_color_from_texture(material.albedo, info.uv));
+	const FVector3 textureNormal = FVector3(get_color_from_texture(material.normal, info.uv));
+	const FVector3 normal = calculate_surface_normal(info.triangleId, info.instanceId, info.normal, textureNormal);
+	if (type == EShadingType::Dielectric)
+	{
+		path.color *= calculate_dielectric_material(path.ray, info, normal, albedo, material.indexOfRefraction, path.random);
+		return true;
+	}
+	if (type == EShadingType::Metallic)
+	{
+		const Float32 metalness = get_color_from_texture(material.metalness, info.uv).z;
+		path.color *= calculate_metallic_material(path.ray, info, normal, albedo, metalness, path.random);
+		return true;
+	}
+	if (lightSampling != ELightSampling::Mixture && bounce < maxBouncesCount)
+	{
+		path.radiance += path.color * sample_direct_light(info, normal, albedo, path.random);
+	}
+	path.color *= calculate_lambertian_material(path.ray, info, normal, albedo, path.cosinePdf, path.lightId, path.random);
+	path.normal = normal;
+	return true;
+}
+
+Bool CPURaytracer::hit(const Ray& ray, Float32 maxDistance, HitInfo& info) const
+{
+	const DynamicArray<BVHNode>& topLevelNodes = scene.topLevelTree.hierarchy;
+	Bool result = false;
+	TriangleHit closest;
+
+	closest.distance = maxDistance;
+	Int32 nodeId = scene.topLevelTree.rootId;
+	while (nodeId != -1)
+	{
+		const BVHNode& node = topLevelNodes[nodeId];
+		Float32 distanceSquared;
+		if (!aabb_intersect(node.min, node.max, ray, distanceSquared) || distanceSquared > closest.distance * closest.distance)
+		{
+			nodeId = node.skipId;
+			continue;
+		}
+
+		if (node.primitiveCount > 0)
+		{
+			const GPUInstance& instance = scene.instances[node.primitiveId];
+			Ray objectRay;
+			objectRay.origin = FVector3(instance.worldToObject * FVector4(ray.origin, 1.0f));
+			objectRay.direction = FMatrix3(instance.worldToObject) * ray.direction;
+			if (hit_instance(objectRay, instance, closest))
+			{
+				closest.instanceId = node.primitiveId;
+				result = true;
+			}
+		}
+		nodeId = node.nextId;
+	}
+
+	if (result)
+	{
+		const GPUInstance& instance = scene.instances[closest.instanceId];
+		Ray objectRay;
+		objectRay.origin = FVector3(instance.worldToObject * FVector4(ray.origin, 1.0f));
+		objectRay.direction = FMatrix3(instance.worldToObject) * ray.direction;
+		info = get_hit_info(objectRay, closest);
+		info.point = ray.origin + ray.direction * info.distance;
+		info.normal = glm::normalize(glm::transpose(FMatrix3(instance.worldToObject)) * info.normal);
+	}
+	return result;
+}
+
+Bool CPURaytracer::hit_instance(const Ray& ray, const GPUInstance& instance, TriangleHit& closest) const
+{
+	// Binary tree ordered by octant finds the same hits as wide formats, which are only faster on GPU
+	Bool result = false;
+	const Float32 directionLengthSquared = glm::dot(ray.direction, ray.direction);
+	const Int32 octant = (ray.direction.x < 0.0f ? 1 : 0) | (ray.direction.y < 0.0f ? 2 : 0) | (ray.direction.z < 0.0f ? 4 : 0);
+	Int32 nodeId = instance.rootId;
+	while (nodeId != -1)
+	{
+		const BVHNode& node = scene.bottomLevelNodes[nodeId];
+		const IVector2& link = scene.octantLinks[nodeId].links[octant];
+		Float32 distanceSquared;
+		if (!aabb_intersect(node.min, node.max, ray, distanceSquared) ||
+			distanceSquared > closest.distance * closest.distance * directionLengthSquared)
+		{
+			nodeId = link.y;
+			continue;
+		}
+
+		for (Int32 i = 0; i < node.primitiveCount; ++i)
+		{
+			if (triangle_intersect(node.primitiveId + i * 3, ray, closest))
+			{
+				result = true;
+			}
+		}
+		nodeId = link.x;
+	}
+	return result;
+}
+
+Bool CPURaytracer::triangle_intersect(Int32 triangleId, const Ray& ray, TriangleHit& closest) const
+{
+	const PackedTriangle& triangle = scene.packedTriangles[triangleId / 3];
+	if (triangle.opacityId == RaytraceScene::TRANSPARENT_TRIANGLE)
+	{
+		return false;
+	}
+
+	const FVector3& edge1 = triangle.edge1;
+	const FVector3& edge2 = triangle.edge2;
+	const FVector3 dirXe2 = glm::cross(ray.direction, edge2);
+	const Float32 det = glm::dot(edge1, dirXe2);
+	if (glm::abs(det) < EPSILON)
+	{
+		return false;
+	}
+
+	const Float32 invDet = 1.0f / det;
+	const FVector3 s = ray.origin - triangle.vertex;
+	const Float32 u = invDet * glm::dot(s, dirXe2);
+	if (u < 0.0f || u > 1.0f)
+	{
+		return false;
+	}
+
+	const FVector3 sXe1 = glm::cross(s, edge1);
+	const Float32 v = invDet * glm::dot(ray.direction, sXe1);
+	if (v < 0.0f || (u + v) > 1.0f)
+	{
+		return false;
+	}
+
+	const Float32 distance = invDet * glm::dot(edge2, sXe1);
+	if (distance < view.viewBounds.x || distance > view.viewBounds.y || distance >= closest.distance)
+	{
+		return false;
+	}
+
+	const EOpacity opacity = triangle.opacityId == RaytraceScene::OPAQUE_TRIANGLE ? EOpacity::Opaque : get_micro_triangle_opacity(triangle.opacityId, FVector2(u, v));
+	if (opacity == EOpacity::Transparent)
+	{
+		return false;
+	}
+	if (opacity == EOpacity::Mixed)
+	{
+		const Float32 w = 1.0f - u - v;
+		const FVector2 uv = (scene.vertexes[scene.indexes[triangleId + 0]].uv * w)
+						  + (scene.vertexes[scene.indexes[triangleId + 1]].uv * u)
+						  + (scene.vertexes[scene.indexes[triangleId + 2]].uv * v);
+		if (get_color_from_texture(scene.materials[triangle.materialId].albedo, uv).w < RaytraceScene::MIN_ALPHA)
+		{
+			return false;
+		}
+	}
+
+	closest.barycentrics = FVector2(u, v);
+	closest.distance = distance;
+	closest.triangleId = triangleId;
+	return true;
+}
+
+CPURaytracer::HitInfo CPURaytracer::get_hit_info(const Ray& ray, const TriangleHit& closest) const
+{
+	const Vertex& v1 = scene.vertexes[scene.indexes[closest.triangleId + 0]];
+	const Vertex& v2 = scene.vertexes[scene.indexes[closest.triangleId + 1]];
+	const Vertex& v3 = scene.vertexes[scene.indexes[closest.triangleId + 2]];
+	const Float32 u = closest.barycentrics.x;
+	const Float32 v = closest.barycentrics.y;
+	const Float32 w = 1.0f - u - v;
+
+	HitInfo info;
+	info.materialId = scene.packedTriangles[closest.triangleId / 3].materialId;
+	info.uv = (v1.uv * w) + (v2.uv * u) + (v3.uv * v);
+	info.distance = closest.distance;
+	info.point = ray.origin + ray.direction * closest.distance;
+	info.normal = glm::normalize((v1.normal * w) + (v2.normal * u) + (v3.normal * v));
+	info.frontFace = glm::dot(info.normal, ray.direction) < 0.0f;
+	if (!info.frontFace)
+	{
+		info.normal = -info.normal;
+	}
+	info.triangleId = closest.triangleId;
+	info.instanceId = closest.instanceId;
+	return info;
+}
+
+EOpacity CPURaytracer::get_micro_triangle_opacity(Int32 micromapId, const FVector2& barycentrics) const
+{
+	constexpr Int32 subdivision = RaytraceScene::MICROMAP_SUBDIVISION;
+	const FVector2 position = barycentrics * Float32(subdivision);
+	Int32 column = glm::min(Int32(position.x), subdivision - 1);
+	const Int32 row = glm::min(Int32(position.y), subdivision - 1);
+	Int32 inverted = 0;
+	if (column + row >= subdivision - 1)
+	{
+		column = subdivision - 1 - row;
+	} else {
+		inverted = (position.x - Float32(column)) + (position.y - Float32(row)) > 1.0f ? 1 : 0;
+	}
+
+	const Int32 microTriangleId = row * (2 * subdivision - row) + column * 2 + inverted;
+	const UInt32 states = scene.opacityMicromaps[micromapId].states[microTriangleId / 16];
+	return EOpacity((states >> ((microTriangleId % 16) * 2)) & 3U);
+}
+
+Bool CPURaytracer::aabb_intersect(const FVector3& min, const FVector3& max, const Ray& ray, Float32& distanceSquared) const
+{
+	const FVector3 invDirection = FVector3(1.0f) / (ray.direction + EPSILON);
+	const FVector3 tBottom = invDirection * (min - ray.origin);
+	const FVector3 tTop = invDirection * (max - ray.origin);
+	const FVector3 tMin = glm::min(tTop, tBottom);
+	const FVector3 tMax = glm::max(tTop, tBottom);
+	const Float32 t0 = glm::max(glm::max(tMin.x, tMin.y), tMin.z);
+	const Float32 t1 = glm::min(glm::min(tMax.x, tMax.y), tMax.z);
+	const FVector3 d = glm::max(FVector3(0.0f), glm::max(min - ray.origin, ray.origin - max));
+	distanceSquared = glm::dot(d, d);
+	return t1 > glm::max(t0, 0.0f);
+}
+
+FVector3 CPURaytracer::calculate_emission_material(const HitInfo& info, const FVector3& emission) const
+{
+	return info.frontFace ? emission * EMISSION_STRENGTH : FVector3(0.0f);
+}
+
+FVector3 CPURaytracer::calculate_dielectric_material(Ray& ray,
+													 const HitInfo& info,
+													 const FVector3& normal,
+													 const FVector3& albedo,
+													 Float32 indexOfRefraction,
+													 Random& random) const
+{
+	const Float32 refractionRatio = info.frontFace ? (1.0f / indexOfRefraction) : indexOfRefraction;
+	const Float32 cosTheta = glm::dot(-ray.direction, normal);
+	const Float32 sinTheta = glm::sqrt(glm::max(0.0f, 1.0f - cosTheta * cosTheta));
+	const Bool cannotRefract = refractionRatio * sinTheta > 1.0f;
+
+	ray.origin = info.point;
+	if (cannotRefract || fresnel_function(cosTheta, refractionRatio) >= random.next())
+	{
+		ray.direction = glm::reflect(ray.direction, normal);
+	} else {
+		ray.direction = glm::refract(ray.direction, normal, refractionRatio);
+	}
+	return albedo;
+}
+
+FVector3 CPURaytracer::calculate_metallic_material(Ray& ray,
+												   const HitInfo& info,
+												   const FVector3& normal,
+												   const FVector3& albedo,
+												   Float32 metalness,
+												   Random& random) const
+{
+	ray.origin = info.point;
+	const FVector3 reflectedRay = glm::reflect(ray.direction, normal);
+	const FVector3 randomRay = rand_in_unit_hemisphere(normal, random);
+	ray.direction = glm::normalize(reflectedRay + randomRay * (1.0f - metalness));
+	return albedo;
+}
+
+FVector3 CPURaytracer::calculate_lambertian_material(Ray& ray,
+													 const HitInfo& info,
+													 const FVector3& normal,
+													 const FVector3& albedo,
+													 Float32& cosinePdf,
+													 Int32& lightId,
+													 Random& random) const
+{
+	ray.origin = info.point;
+	if (lightSampling == ELightSampling::Mixture)
+	{
+		const FVector3 direction = get_pdf_direction(ray.origin, normal, lightId, random);
+		if (direction == FVector3(0.0f))
+		{
+			cosinePdf = -1.0f;
+			return FVector3(0.0f);
+		}
+		ray.direction = glm::normalize(direction);
+	} else {
+		lightId = -1;
+		ray.direction = get_cosine_direction(normal, random);
+	}
+	cosinePdf = get_cosine_pdf(normal, ray.direction);
+	return albedo;
+}
+
+FVector3 CPURaytracer::calculate_surface_normal(Int32 triangleId, Int32 instanceId, const FVector3& faceNormal, const FVector3& textureNormal) const
+{
+	if (textureNormal == FVector3(0.0f))
+	{
+		return faceNormal;
+	}
+
+	const Vertex& v1 = scene.vertexes[scene.indexes[triangleId + 0]];
+	const Vertex& v2 = scene.vertexes[scene.indexes[triangleId + 1]];
+	const Vertex& v3 = scene.vertexes[scene.indexes[triangleId + 2]];
+	const FMatrix3 objectToWorld = FMatrix3(scene.instances[instanceId].objectToWorld);
+	const FVector3 deltaPosition1 = objectToWorld * (v2.position - v1.position);
+	const FVector3 deltaPosition2 = objectToWorld * (v3.position - v1.position);
+	const FVector2 deltaUV1 = v2.uv - v1.uv;
+	const FVector2 deltaUV2 = v3.uv - v1.uv;
+
+	const Float32 denominator = deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x;
+	if (glm::abs(denominator) <= EPSILON)
+	{
+		return faceNormal;
+	}
+
+	const Float32 r = 1.0f / denominator;
+	const FVector3 tangent = (deltaPosition1 * deltaUV2.y - deltaPosition2 * deltaUV1.y) * r;
+	const FVector3 bitangent = (deltaPosition2 * deltaUV1.x - deltaPosition1 * deltaUV2.x) * r;
+	const FVector3 textureInNormalSpace = glm::normalize(textureNormal * 2.0f - 1.0f);
+	const FMatrix3 tbn(glm::normalize(tangent), glm::normalize(bitangent), faceNormal);
+	return glm::normalize(tbn * textureInNormalSpace);
+}
+
+Float32 CPURaytracer::fresnel_function(Float32 vDotH, Float32 refractionRatio) const
+{
+	Float32 r0 = (1.0f - refractionRatio) / (1.0f + refractionRatio);
+	r0 = r0 * r0;
+	return r0 + (1.0f - r0) * glm::pow(1.0f - vDotH, 5.0f);
+}
+
+FVector4 CPURaytracer::get_color_from_texture(Int32 textureId, const FVector2& uv) const
+{
+	if (textureId == -1)
+	{
+		return FVector4(0.0f, 0.0f, 0.0f, 1.0f);
+	}
+
+	// Bilinear filter of the first mip level, shaders sample it as well, because compute stage has no derivatives
+	const Texture& texture = textures[textureId];
+	const Bool isHDR = texture.type == ETextureType::HDR;
+	const FVector2 position = uv * FVector2(texture.size) - 0.5f;
+	const FVector2 corner = glm::floor(position);
+	const FVector2 weight = position - corner;
+	Array<FVector4, 4> texels;
+	for (Int32 i = 0; i < 4; ++i)
+	{
+		IVector2 texel = IVector2(corner) + IVector2(i & 1, i >> 1);
+		if (isHDR)
+		{
+			texel = glm::clamp(texel, IVector2(0), texture.size - 1);
+		} else {
+			texel = ((texel % texture.size) + texture.size) % texture.size;
+		}
+
+		const UInt64 texelId = (UInt64(texel.y) * UInt64(texture.size.x) + UInt64(texel.x)) * 4;
+		if (isHDR)
+		{
+			const Float32* data = reinterpret_cast<const Float32*>(texture.data);
+			texels[i] = FVector4(data[texelId], data[texelId + 1], data[texelId + 2], data[texelId + 3]);
+		} else {
+			texels[i] = FVector4(texture.data[texelId], texture.data[texelId + 1], texture.data[texelId + 2], texture.data[texelId + 3]) / 255.0f;
+		}
+	}
+	return glm::mix(glm::mix(texels[0], texels[1], weight.x), glm::mix(texels[2], texels[3], weight.x), weight.y);
+}
+
+FVector2 CPURaytracer::sample_sphere(const FVector3& direction) const
+{
+	FVector2 uv;
+	uv.x = 0.5f + (std::atan2(-direction.z, direction.x) * ONE_OVER_TWO_PI);
+	uv.y = std::acos(direction.y) * ONE_OVER_PI;
+	return uv;
+}
+
+FVector3 CPURaytracer::rand_in_unit_sphere(Random& random) const
+{
+	FVector3 randomVector;
+	randomVector.x = random.next(-1.0f, 1.0f);
+	randomVector.y = random.next(-1.0f, 1.0f);
+	randomVector.z = random.next(-1.0f, 1.0f);
+	return glm::normalize(randomVector);
+}
+
+FVector3 CPURaytracer::rand_in_unit_hemisphere(const FVector3& normal, Random& random) const
+{
+	const FVector3 randomVector = rand_in_unit_sphere(random);
+	return glm::dot(randomVector, normal) > 0.0f ? randomVector : -randomVector;
+}
+
+FVector3 CPURaytracer::random_cosine_direction(Random& random) const
+{
+	const Float32 r1 = random.next();
+	const Float32 r2 = random.next();
+	const Float32 phi = 2.0f * PI * r1;
+	return FVector3(std::cos(phi) * glm::sqrt(r2), std::sin(phi) * glm::sqrt(r2), glm::sqrt(1.0f - r2));
+}
+
+Float32 CPURaytracer::get_cosine_pdf(const FVector3& normal, const FVector3& direction) const
+{
+	return glm::max(0.0f, glm::dot(normal, direction) * ONE_OVER_PI);
+}
+
+FVector3 CPURaytracer::get_cosine_direction(const FVector3& normal, Random& random) const
+{
+	const FVector3 a = glm::abs(normal.x) > 0.9f ? FVector3(0.0f, 1.0f, 0.0f) : FVector3(1.0f, 0.0f, 0.0f);
+	const FVector3 v = glm::normalize(glm::cross(normal, a));
+	const FVector3 u = glm::cross(normal, v);
+	const FVector3 localDirection = random_cosine_direction(random);
+	return glm::normalize((localDirection.x * u) + (localDirection.y * v) + (localDirection.z * normal));
+}
+
+Void CPURaytracer::get_world_points(const EmissionTriangle& light, Array<FVector3, 3>& points) const
+{
+	const FMatrix4& objectToWorld = scene.instances[light.instanceId].objectToWorld;
+	for (Int32 i = 0; i < 3; ++i)
+	{
+		points[i] = FVector3(objectToWorld * FVector4(scene.vertexes[scene.indexes[light.triangleId + i]].position, 1.0f));
+	}
+}
+
+FVector3 CPURaytracer::get_random_in_triangle(const EmissionTriangle& light, Random& random) const
+{
+	Array<FVector3, 3> points;
+	get_world_points(light, points);
+
+	const Float32 r1 = glm::sqrt(random.next());
+	const Float32 r2 = random.next();
+	const Float32 alpha = 1.0f - r1;
+	const Float32 beta = r1 * (1.0f - r2);
+	const Float32 gamma = r1 * r2;
+	return (points[0] * alpha) + (points[1] * beta) + (points[2] * gamma);
+}
+
+Int32 CPURaytracer::get_light_id(const HitInfo& info, Bool isHit) const
+{
+	const Int32 lightId = isHit ? scene.packedTriangles[info.triangleId / 3].lightId : -1;
+	return lightId == -1 ? -1 : scene.instances[info.instanceId].lightsOffset + lightId;
+}
+
+Float32 CPURaytracer::get_lights_pdf(const Ray& ray, const FVector3& normal, const HitInfo& info, Int32 lightId) const
+{
+	if (lightId == -1)
+	{
+		return EPSILON;
+	}
+
+	const Float32 probability = lightSelection == ELightSelection::LightTree ? get_light_tree_pdf(ray.origin, normal, lightId) : scene.emissionTriangles[lightId].probability;
+	return get_light_pdf(probability, ray, info, lightId);
+}
+
+Float32 CPURaytracer::get_light_pdf(Float32 probability, const Ray& ray, const HitInfo& info, Int32 lightId) const
+{
+	const EmissionTriangle& light = scene.emissionTriangles[lightId];
+	const Float32 cosine = glm::abs(glm::dot(ray.direction, info.normal));
+	return probability * (info.distance * info.distance) / (cosine * light.area) + EPSILON;
+}
+
+FVector3 CPURaytracer::get_light_path(const FVector3& origin, const FVector3& normal, Int32& lightId, Float32& probability, Random& random) const
+{
+	if (scene.emissionTriangles.empty())
+	{
+		lightId = -1;
+		probability = 0.0f;
+		return FVector3(0.0f);
+	}
+
+	if (lightSelection == ELightSelection::LightTree)
+	{
+		lightId = sample_light_tree(origin, normal, probability, random);
+		if (lightId == -1)
+		{
+			return FVector3(0.0f);
+		}
+	} else {
+		const Int32 lightsCount = Int32(scene.emissionTriangles.size());
+		const Int32 entryId = glm::min(Int32(random.next() * Float32(lightsCount)), lightsCount - 1);
+		const EmissionTriangle& entry = scene.emissionTriangles[entryId];
+		lightId = random.next() < entry.aliasProbability ? entryId : entry.aliasId;
+		probability = scene.emissionTriangles[lightId].probability;
+	}
+	return get_random_in_triangle(scene.emissionTriangles[lightId], random) - origin;
+}
+
+Float32 CPURaytracer::get_light_importance(const LightTreeNode& node, const FVector3& point, const FVector3& normal) const
+{
+	const FVector3 center = (node.min + node.max) * 0.5f;
+	const Float32 radiusSquared = glm::dot(node.max - center, node.max - center);
+	FVector3 toLight = center - point;
+	const Float32 distanceSquared = glm::dot(toLight, toLight);
+	if (distanceSquared <= radiusSquared)
+	{
+		return node.power / glm::max(radiusSquared, EPSILON);
+	}
+
+	toLight /= std::sqrt(distanceSquared);
+	const Float32 boundsAngle = std::asin(std::sqrt(radiusSquared / distanceSquared));
+	const Float32 emissionAngle = glm::max(0.0f, std::acos(glm::clamp(glm::dot(node.axis, -toLight), -1.0f, 1.0f)) - node.normalAngle - boundsAngle);
+	const Float32 incidentAngle = glm::max(0.0f, std::acos(glm::clamp(glm::dot(normal, toLight), -1.0f, 1.0f)) - boundsAngle);
+	if (emissionAngle >= 0.5f * PI || incidentAngle >= 0.5f * PI)
+	{
+		return 0.0f;
+	}
+	return node.power * std::cos(emissionAngle) * std::cos(incidentAngle) / distanceSquared;
+}
+
+Int32 CPURaytracer::sample_light_tree(const FVector3& point, const FVector3& normal, Float32& probability, Random& random) const
+{
+	const DynamicArray<LightTreeNode>& nodes = scene.lightTree.nodes;
+	probability = 0.0f;
+	if (scene.emissionTriangles.empty())
+	{
+		return -1;
+	}
+
+	// Same walk as sample_light_tree() of RayTrace.comp
+	Float32 pdf = 1.0f;
+	Int32 nodeId = 0;
+	while (nodes[nodeId].lightId == -1)
+	{
+		const LightTreeNode& node = nodes[nodeId];
+		const Float32 leftImportance = get_light_importance(nodes[node.leftId], point, normal);
+		const Float32 rightImportance = get_light_importance(nodes[node.rightId], point, normal);
+		const Float32 importanceSum = leftImportance + rightImportance;
+		if (importanceSum <= 0.0f)
+		{
+			return -1;
+		}
+		const Bool isLeft = random.next() * importanceSum < leftImportance;
+		nodeId = isLeft ? node.leftId : node.rightId;
+		pdf *= (isLeft ? leftImportance : rightImportance) / importanceSum;
+	}
+	probability = pdf;
+	return nodes[nodeId].lightId;
+}
+
+Float32 CPURaytracer::get_light_tree_pdf(const FVector3& point, const FVector3& normal, Int32 lightId) const
+{
+	const DynamicArray<LightTreeNode>& nodes = scene.lightTree.nodes;
+	Float32 pdf = 1.0f;
+	Int32 nodeId = scene.emissionTriangles[lightId].nodeId;
+	Int32 parentId = nodes[nodeId].parentId;
+	while (parentId != -1)
+	{
+		const LightTreeNode& parent = nodes[parentId];
+		const Float32 leftImportance = get_light_importance(nodes[parent.leftId], point, normal);
+		const Float32 rightImportance = get_light_importance(nodes[parent.rightId], point, normal);
+		const Float32 importanceSum = leftImportance + rightImportance;
+		if (importanceSum <= 0.0f)
+		{
+			return 0.0f;
+		}
+		pdf *= (nodeId == parent.leftId ? leftImportance : rightImportance) / importanceSum;
+		nodeId = parentId;
+		parentId = parent.parentId;
+	}
+	return pdf;
+}
+
+FVector3 CPURaytracer::get_pdf_direction(const FVector3& origin, const FVector3& normal, Int32& lightId, Random& random) const
+{
+	if (random.next() > 0.5f || scene.emissionTriangles.empty())
+	{
+		lightId = -1;
+		return get_cosine_direction(normal, random);
+	}
+	Float32 probability;
+	return get_light_path(origin, normal, lightId, probability, random);
+}
+
+Float32 CPURaytracer::get_pdf_value(Float32 cosinePdf, const Ray& ray, const FVector3& normal, const HitInfo& info, Int32 lightId) const
+{
+	if (scene.emissionTriangles.empty())
+	{
+		return cosinePdf;
+	}
+	return (get_lights_pdf(ray, normal, info, lightId) + cosinePdf) * 0.5f;
+}
+
+FVector3 CPURaytracer::sample_direct_light(const HitInfo& info, const FVector3& normal, const FVector3& albedo, Random& random) const
+{
+	const Float32 environmentProbability = scene.environmentProbability;
+	if (environmentProbability > 0.0f && random.next() < environmentProbability)
+	{
+		return sample_direct_environment(info, normal, albedo, environmentProbability, random);
+	}
+
+	if (scene.emissionTriangles.empty())
+	{
+		return FVector3(0.0f);
+	}
+
+	Int32 lightId;
+	Float32 probability;
+	Ray shadowRay;
+	shadowRay.origin = info.point;
+	const FVector3 lightPath = get_light_path(info.point, normal, lightId, probability, random);
+	if (lightId == -1)
+	{
+		return FVector3(0.0f);
+	}
+	const Float32 distance = glm::length(lightPath);
+	shadowRay.direction = lightPath / distance;
+	const Float32 cosine = glm::dot(normal, shadowRay.direction);
+
+	HitInfo lightInfo;
+	if (cosine <= 0.0f || !hit(shadowRay, distance * SHADOW_RAY_MARGIN, lightInfo) || get_light_id(lightInfo, true) != lightId)
+	{
+		return FVector3(0.0f);
+	}
+
+	const FVector3 emission = FVector3(get_color_from_texture(scene.materials[lightInfo.materialId].emission, lightInfo.uv));
+	const Float32 lightPdf = get_light_pdf(probability, shadowRay, lightInfo, lightId) * (1.0f - environmentProbability);
+	const Float32 cosinePdf = cosine * ONE_OVER_PI;
+	return albedo * cosinePdf * calculate_emission_material(lightInfo, emission) * get_mis_weight(lightPdf, cosinePdf) / lightPdf;
+}
+
+FVector3 CPURaytracer::sample_direct_environment(const HitInfo& info, const FVector3& normal, const FVector3& albedo, Float32 environmentProbability, Random& random) const
+{
+	Ray shadowRay;
+	shadowRay.origin = info.point;
+	Float32 environmentPdf;
+	shadowRay.direction = get_environment_direction(environmentPdf, random);
+	const Float32 cosine = glm::dot(normal, shadowRay.direction);
+
+	HitInfo occluderInfo;
+	if (environmentPdf <= 0.0f || cosine <= 0.0f || hit(shadowRay, view.viewBounds.y + 1.0f, occluderInfo))
+	{
+		return FVector3(0.0f);
+	}
+
+	const FVector3 background = FVector3(get_color_from_texture(environmentMapId, sample_sphere(shadowRay.direction)));
+	const Float32 lightPdf = environmentPdf * environmentProbability;
+	const Float32 cosinePdf = cosine * ONE_OVER_PI;
+	return albedo * cosinePdf * background * get_mis_weight(lightPdf, cosinePdf) / lightPdf;
+}
+
+FVector3 CPURaytracer::get_environment_direction(Float32& pdf, Random& random) const
+{
+	const Int32 texelsCount = Int32(scene.environmentTexels.size());
+	const Int32 entryId = glm::min(Int32(random.next() * Float32(texelsCount)), texelsCount - 1);
+	const EnvironmentTexel& entry = scene.environmentTexels[entryId];
+	const Int32 texelId = random.next() < entry.aliasProbability ? entryId : entry.aliasId;
+
+	const IVector2 size = textures[environmentMapId].size;
+	const Float32 offsetX = random.next();
+	const Float32 offsetY = random.next();
+	const FVector2 uv = (FVector2(Float32(texelId % size.x), Float32(texelId / size.x)) + FVector2(offsetX, offsetY)) / FVector2(size);
+	const Float32 theta = uv.y * PI;
+	const Float32 phi = (uv.x - 0.5f) * 2.0f * PI;
+	const Float32 sinTheta = std::sin(theta);
+	pdf = get_environment_texel_pdf(texelId, sinTheta);
+	return FVector3(sinTheta * std::cos(phi), std::cos(theta), -sinTheta * std::sin(phi));
+}
+
+Float32 CPURaytracer::get_environment_pdf(const FVector3& direction) const
+{
+	const IVector2 size = textures[environmentMapId].size;
+	const IVector2 texel = glm::clamp(IVector2(sample_sphere(direction) * FVector2(size)), IVector2(0), size - 1);
+	const Float32 sinTheta = std::sqrt(glm::max(0.0f, 1.0f - direction.y * direction.y));
+	return get_environment_texel_pdf(texel.y * size.x + texel.x, sinTheta);
+}
+
+Float32 CPURaytracer::get_environment_texel_pdf(Int32 texelId, Float32 sinTheta) const
+{
+	if (sinTheta <= 0.0f)
+	{
+		return 0.0f;
+	}
+	const IVector2 size = textures[environmentMapId].size;
+	return scene.environmentTexels[texelId].probability * Float32(size.x * size.y) / (2.0f * PI * PI * sinTheta);
+}
+
+Float32 CPURaytracer::get_mis_weight(Float32 pdf, Float32 otherPdf) const
+{
+	Float32 ratio = otherPdf / pdf;
+	if (lightSampling == ELightSampling::PowerHeuristic)
+	{
+		ratio *= ratio;
+	}
+	return 1.0f / (1.0f + ratio);
+}
+
+Float32 CPURaytracer::Random::next()
+{
+	// Bob Jenkins' One-At-A-Time hash, same as rand() of shader
+	state += (state << 10U);
+	state ^= (state >> 6U);
+	state += (state << 3U);
+	state ^= (state >> 11U);
+	state += (state << 15U);
+	return Float32(state) * INV_UINT_MAX;
+}
+
+Float32 CPURaytracer::Random::next(Float32 min, Float32 max)
+{
+	return min + (max - min) * next();
+}
@@ -0,0 +1,216 @@
+#pragma once
+#include <mutex>
+
+#include "raytrace_scene.hpp"
+
+struct Texture;
+
+/** Path mode traces whole path of every pixel at once, wavefront mode traces batches of rays bounce by bounce */
+enum class ECPUTraceMode : UInt8
+{
+	Path = 0U,
+	Wavefront,
+	Count
+};
+
+/** Reference path tracer mirroring RayGeneration.comp and RayTrace.comp, tiles of image are traced on all threads */
+class CPURaytracer
+{
+public:
+	/** Camera vectors, the same ones Camera passes to ray generation */
+	struct View
+	{
+		FVector3 position;
+		FVector3 forward;
+		FVector3 right;
+		FVector3 up;
+		Float32 fov;
+		FVector2 viewBounds;
+	};
+
+	/** Sums over all traced frames, first bounce has camera rays */
+	struct Statistics
+	{
+		DynamicArray<UInt64> raysCounts;
+		// Seconds of intersection stage of every bounce, measured only in wavefront mode
+		DynamicArray<Float64> traceTimes;
+		Float64 totalTime = 0.0;
+	};
+
+	CPURaytracer(const RaytraceScene& scene, const DynamicArray<Texture>& textures);
+
+	/** Generates primary ray of every pixel and clears accumulated samples */
+	Void setup(const View& view, const IVector2& imageSize);
+	/** Adds one sample to every pixel, image depends only on seed and count of traced frames */
+	Void trace_frame();
+	/** Writes average of samples with the same gamma as saved screen image, data of texture is reallocated */
+	Void resolve(Texture& texture) const;
+
+	[[nodiscard]]
+	Int32 get_frame_count() const;
+	[[nodiscard]]
+	const Statistics& get_statistics() const;
+
+	ECPUTraceMode traceMode = ECPUTraceMode::Path;
+	Int32 maxBouncesCount = 6;
+	// Bounces traced before russian roulette, off by default
+	Int32 rouletteBouncesCount = RaytraceScene::NO_ROULETTE;
+	ELightSampling lightSampling = ELightSampling::PowerHeuristic;
+	ELightSelection lightSelection = ELightSelection::LightTree;
+	Int32 environmentMapId = -1;
+	// Zero gives the same random numbers as shader
+	UInt32 seed = 0U;
+
+private:
+	static constexpr Int32 TILE_SIZE = 16;
+	static constexpr Int32 SECTORS_COUNT = 64;
+	static constexpr Float32 EPSILON = 0.00000095367431640625f; // 2 ^ (-20)
+	static constexpr Float32 EMISSION_STRENGTH = 15.0f;
+	static constexpr Float32 SHADOW_RAY_MARGIN = 1.001f;
+	static constexpr Int32 WAVEFRONT_BATCH_SIZE = 1 << 18;
+	static constexpr Int32 WAVEFRONT_GRAIN_SIZE = 1024;
+	static constexpr Int32 SORT_CELLS_COUNT = 16;
+	static constexpr Int32 SORT_KEYS_COUNT = SORT_CELLS_COUNT * SORT_CELLS_COUNT * SORT_CELLS_COUNT * 8;
+
+	/** Closest hit decides which shading stage continues path */
+	enum class EShadingType : UInt8
+	{
+		Miss = 0U,
+		Emission,
+		Dielectric,
+		Metallic,
+		Lambertian,
+		Count
+	};
+
+	struct Ray
+	{
+		FVector3 origin;
+		FVector3 direction;
+	};
+
+	struct HitInfo
+	{
+		FVector3 point;
+		FVector3 normal;
+		FVector2 uv;
+		Float32 distance;
+		Int32 materialId;
+		Int32 triangleId;
+		Int32 instanceId;
+		Bool frontFace;
+	};
+
+	/** Closest candidate of traversal, attributes of hit are computed only for the final one */
+	struct TriangleHit
+	{
+		FVector2 barycentrics;
+		Float32 distance;
+		Int32 triangleId;
+		Int32 instanceId;
+	};
+
+	/** State of random generator of one pixel, the same hash as in shader */
+	struct Random
+	{
+		UInt32 state;
+
+		Float32 next();
+		Float32 next(Float32 min, Float32 max);
+	};
+
+	/** Locals of main() in RayTrace.comp, path is finished when its color is zero */
+	struct PathState
+	{
+		Ray ray;
+		FVector3 color;
+		FVector3 radiance;
+		Float32 cosinePdf;
+		Int32 lightId;
+		FVector3 normal;
+		Random random;
+		Int32 pixelId;
+	};
+
+	const RaytraceScene& scene;
+	const DynamicArray<Texture>& textures;
+	DynamicArray<FVector3> directions;
+	DynamicArray<FVector3> accumulation;
+	View view;
+	IVector2 imageSize = { 0, 0 };
+	FVector3 pixelDeltaU, pixelDeltaV;
+	Int32 frameCount = 0;
+	Statistics statistics;
+	std::mutex statisticsMutex;
+
+	DynamicArray<PathState> paths;
+	DynamicArray<PathState> sortedPaths;
+	DynamicArray<HitInfo> hits;
+	DynamicArray<EShadingType> shadingTypes;
+	DynamicArray<Int32> sortKeys;
+	DynamicArray<Int32> binOffsets;
+	DynamicArray<Int32> shadingOrder;
+
+	Void trace_tile(Int32 tileId);
+	FVector3 trace_path(PathState& path, DynamicArray<UInt64>& raysCounts) const;
+	PathState create_path(Int32 pixelId) const;
+	/** Zeroes color of terminated path, survivor's color is divided by its probability */
+	Void apply_russian_roulette(Int32 bounce, PathState& path) const;
+
+	Void trace_wavefront();
+	Void trace_batch(Int32 firstPixelId, Int32 pixelsCount);
+	Void sort_paths();
+	Void shade_paths(Int32 bounce);
+
+	EShadingType get_shading_type(const HitInfo& info, Bool isHit) const;
+	/** Returns false when path ends, its color is zero and radiance is final then */
+	Bool shade(EShadingType type, const HitInfo& info, Int32 bounce, PathState& path) const;
+
+	/** Closest hit before max distance */
+	Bool hit(const Ray& ray, Float32 maxDistance, HitInfo& info) const;
+	Bool hit_instance(const Ray& ray, const GPUInstance& instance, TriangleHit& closest) const;
+	/** Replaces closest hit only with closer one, which passes alpha test */
+	Bool triangle_intersect(Int32 triangleId, const Ray& ray, TriangleHit& closest) const;
+	HitInfo get_hit_info(const Ray& ray, const TriangleHit& closest) const;
+	EOpacity get_micro_triangle_opacity(Int32 micromapId, const FVector2& barycentrics) const;
+	Bool aabb_intersect(const FVector3& min, const FVector3& max, const Ray& ray, Float32& distanceSquared) const;
+
+	FVector3 calculate_emission_material(const HitInfo& info, const FVector3& emission) const;
+	FVector3 calculate_dielectric_material(Ray& ray, const HitInfo& info, const FVector3& normal, const FVector3& albedo, Float32 indexOfRefraction, Random& random) const;
+	FVector3 calculate_metallic_material(Ray& ray, const HitInfo& info, const FVector3& normal, const FVector3& albedo, Float32 metalness, Random& random) const;
+	FVector3 calculate_lambertian_material(Ray& ray, const HitInfo& info, const FVector3& normal, const FVector3& albedo, Float32& cosinePdf, Int32& lightId, Random& random) const;
+	FVector3 calculate_surface_normal(Int32 triangleId, Int32 instanceId, const FVector3& faceNormal, const FVector3& textureNormal) const;
+	Float32 fresnel_function(Float32 vDotH, Float32 refractionRatio) const;
+
+	FVector4 get_color_from_texture(Int32 textureId, const FVector2& uv) const;
+	FVector2 sample_sphere(const FVector3& direction) const;
+	FVector3 rand_in_unit_sphere(Random& random) const;
+	FVector3 rand_in_unit_hemisphere(const FVector3& normal, Random& random) const;
+	FVector3 random_cosine_direction(Random& random) const;
+
+	Float32 get_cosine_pdf(const FVector3& normal, const FVector3& direction) const;
+	FVector3 get_cosine_direction(const FVector3& normal, Random& random) const;
+	Void get_world_points(const EmissionTriangle& light, Array<FVector3, 3>& points) const;
+	FVector3 get_random_in_triangle(const EmissionTriangle& light, Random& random) const;
+	/** Light of emissive triangle which was hit, otherwise -1 */
+	Int32 get_light_id(const HitInfo& info, Bool isHit) const;
+	Float32 get_lights_pdf(const Ray& ray, const FVector3& normal, const HitInfo& info, Int32 lightId) const;
+	/** Probability of choosing light is converted to solid angle of its triangle */
+	Float32 get_light_pdf(Float32 probability, const Ray& ray, const HitInfo& info, Int32 lightId) const;
+	/** Returns zero path and -1 light, when light tree finds no light which could reach origin */
+	FVector3 get_light_path(const FVector3& origin, const FVector3& normal, Int32& lightId, Float32& probability, Random& random) const;
+	/** Upper bound of light reaching point from cluster of lights, orientation bounds are reduced by bounding sphere of cluster */
+	Float32 get_light_importance(const LightTreeNode& node, const FVector3& point, const FVector3& normal) const;
+	Int32 sample_light_tree(const FVector3& point, const FVector3& normal, Float32& probability, Random& random) const;
+	Float32 get_light_tree_pdf(const FVector3& point, const FVector3& normal, Int32 lightId) const;
+	FVector3 get_pdf_direction(const FVector3& origin, const FVector3& normal, Int32& lightId, Random& random) const;
+	Float32 get_pdf_value(Float32 cosinePdf, const Ray& ray, const FVector3& normal, const HitInfo& info, Int32 lightId) const;
+	/** Next event estimation, light reached by shadow ray weighted against cosine sampling of the same direction */
+	FVector3 sample_direct_light(const HitInfo& info, const FVector3& normal, const FVector3& albedo, Random& random) const;
+	FVector3 sample_direct_environment(const HitInfo& info, const FVector3& normal, const FVector3& albedo, Float32 environmentProbability, Random& random) const;
+	FVector3 get_environment_direction(Float32& pdf, Random& random) const;
+	/** Solid angle pdf of environment sampling in direction of miss */
+	Float32 get_environment_pdf(const FVector3& direction) const;
+	Float32 get_environment_texel_pdf(Int32 texelId, Float32 sinTheta) const;
+	Float32 get_mis_weight(Float32 pdf, Float32 otherPdf) const;
+};
@@ -0,0 +1,229 @@
+#include "light_tree.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+namespace
+{
+	constexpr Float32 PI = LightTree::WHOLE_SPHERE_ANGLE;
+	constexpr Float32 HALF_PI = 0.5f * PI;
+}
+
+Void LightTree::create_tree(const DynamicArray<LightBounds>& lights)
+{
+	nodes.clear();
+	leafIds.assign(lights.size(), -1);
+	if (lights.empty())
+	{
+		// Storage buffer can't be empty, root without power isn't traversed, when scene has no lights
+		nodes.push_back({ FVector3(0.0f), 0.0f, FVector3(0.0f), -1.0f, FVector3(0.0f), -1, -1, -1, -1, 0 });
+		return;
+	}
+
+	nodes.reserve(2 * lights.size() - 1);
+	DynamicArray<Int32> lightIds(lights.size());
+	std::iota(lightIds.begin(), lightIds.end(), 0);
+	create_node(lights, lightIds, 0, Int32(lights.size()), -1);
+}
+
+Int32 LightTree::create_node(const DynamicArray<LightBounds>& lights, DynamicArray<Int32>& lightIds, Int32 begin, Int32 end, Int32 parentId)
+{
+	const Int32 nodeId = Int32(nodes.size());
+	LightTreeNode node;
+	node.min = FVector3(Limits<Float32>::max());
+	node.max = FVector3(-Limits<Float32>::max());
+	node.power = 0.0f;
+	node.axis = FVector3(0.0f);
+	node.normalAngle = -1.0f;
+	node.parentId = parentId;
+	node.leftId = -1;
+	node.rightId = -1;
+	node.lightId = -1;
+	node.padding = 0;
+
+	FVector3 centroidMin = FVector3(Limits<Float32>::max());
+	FVector3 centroidMax = FVector3(-Limits<Float32>::max());
+	for (Int32 i = begin; i < end; ++i)
+	{
+		const LightBounds& light = lights[lightIds[i]];
+		node.min = glm::min(node.min, light.min);
+		node.max = glm::max(node.max, light.max);
+		node.power += light.power;
+		merge_cones(node.axis, node.normalAngle, light.axis, light.normalAngle);
+
+		const FVector3 centroid = 0.5f * (light.min + light.max);
+		centroidMin = glm::min(centroidMin, centroid);
+		centroidMax = glm::max(centroidMax, centroid);
+	}
+
+	if (end - begin == 1)
+	{
+		node.lightId = lightIds[begin];
+		leafIds[node.lightId] = nodeId;
+		nodes.push_back(node);
+		return nodeId;
+	}
+	nodes.push_back(node);
+
+	const FVector3 extent = node.max - node.min;
+	const Float32 maxExtent = glm::max(extent.x, glm::max(extent.y, extent.z));
+	const FVector3 centroidExtent = centroidMax - centroidMin;
+
+	Float32 bestCost = Limits<Float32>::max();
+	Int32 bestAxis = -1;
+	Int32 bestBin = -1;
+	for (Int32 axis = 0; axis < 3; ++axis)
+	{
+		if (centroidExtent[axis] <= 0.0f)
+		{
+			continue;
+		}
+
+		Array<Bin, BINS_COUNT> bins;
+		for (Bin& bin : bins)
+		{
+			bin.min = FVector3(Limits<Float32>::max());
+			bin.max = FVector3(-Limits<Float32>::max());
+			bin.axis = FVector3(0.0f);
+			bin.normalAngle = -1.0f;
+			bin.power = 0.0f;
+			bin.count = 0;
+		}
+
+		const Float32 scale = Float32(BINS_COUNT) / centroidExtent[axis];
+		for (Int32 i = begin; i < end; ++i)
+		{
+			const LightBounds& light = lights[lightIds[i]];
+			const Float32 centroid = 0.5f * (light.min[axis] + light.max[axis]);
+			Bin& bin = bins[glm::min(Int32((centroid - centroidMin[axis]) * scale), BINS_COUNT - 1)];
+			bin.min = glm::min(bin.min, light.min);
+			bin.max = glm::max(bin.max, light.max);
+			bin.power += light.power;
+			merge_cones(bin.axis, bin.normalAngle, light.axis, light.normalAngle);
+			++bin.count;
+		}
+
+		// Costs of lights right of every split, summed from the last bin
+		Array<Float32, BINS_COUNT - 1> rightCosts;
+		Bin right = bins[BINS_COUNT - 1];
+		for (Int32 i = BINS_COUNT - 2; i >= 0; --i)
+		{
+			rightCosts[i] = right.count > 0 ? right.power * get_surface_area(right.min, right.max) * get_orientation_measure(right.normalAngle) : Limits<Float32>::max();
+			right.min = glm::min(right.min, bins[i].min);
+			right.max = glm::max(right.max, bins[i].max);
+			right.power += bins[i].power;
+			merge_cones(right.axis, right.normalAngle, bins[i].axis, bins[i].normalAngle);
+			right.count += bins[i].count;
+		}
+
+		// Thin boxes are split across their longest side
+		const Float32 regularization = extent[axis] > 0.0f ? maxExtent / extent[axis] : 1.0f;
+		Bin left = bins[0];
+		for (Int32 i = 0; i < BINS_COUNT - 1; ++i)
+		{
+			if (left.count > 0 && rightCosts[i] < Limits<Float32>::max())
+			{
+				const Float32 leftCost = left.power * get_surface_area(left.min, left.max) * get_orientation_measure(left.normalAngle);
+				const Float32 cost = regularization * (leftCost + rightCosts[i]);
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = i;
+				}
+			}
+			left.min = glm::min(left.min, bins[i + 1].min);
+			left.max = glm::max(left.max, bins[i + 1].max);
+			left.power += bins[i + 1].power;
+			merge_cones(left.axis, left.normalAngle, bins[i + 1].axis, bins[i + 1].normalAngle);
+			left.count += bins[i + 1].count;
+		}
+	}
+
+	Int32 middle = begin;
+	if (bestAxis != -1)
+	{
+		const Float32 scale = Float32(BINS_COUNT) / centroidExtent[bestAxis];
+		middle = Int32(std::partition(lightIds.begin() + begin, lightIds.begin() + end, [&](Int32 lightId)
+		{
+			const LightBounds& light = lights[lightId];
+			const Float32 centroid = 0.5f * (light.min[bestAxis] + light.max[bestAxis]);
+			return glm::min(Int32((centroid - centroidMin[bestAxis]) * scale), BINS_COUNT - 1) <= bestBin;
+		}) - lightIds.begin());
+	}
+
+	// Lights with the same centroid are halved by count
+	if (middle == begin || middle == end)
+	{
+		middle = begin + (end - begin) / 2;
+	}
+
+	const Int32 leftId = create_node(lights, lightIds, begin, middle, nodeId);
+	const Int32 rightId = create_node(lights, lightIds, middle, end, nodeId);
+	nodes[nodeId].leftId = leftId;
+	nodes[nodeId].rightId = rightId;
+	return nodeId;
+}
+
+Void LightTree::merge_cones(FVector3& axis, Float32& normalAngle, const FVector3& otherAxis, Float32 otherNormalAngle)
+{
+	if (otherNormalAngle < 0.0f)
+	{
+		return;
+	}
+
+	if (normalAngle < 0.0f)
+	{
+		axis = otherAxis;
+		normalAngle = otherNormalAngle;
+		return;
+	}
+
+	FVector3 wideAxis = axis;
+	Float32 wideAngle = normalAngle;
+	FVector3 narrowAxis = otherAxis;
+	Float32 narrowAngle = otherNormalAngle;
+	if (narrowAngle > wideAngle)
+	{
+		std::swap(wideAxis, narrowAxis);
+		std::swap(wideAngle, narrowAngle);
+	}
+
+	const Float32 cosine = glm::clamp(glm::dot(wideAxis, narrowAxis), -1.0f, 1.0f);
+	const Float32 axesAngle = std::acos(cosine);
+	if (glm::min(axesAngle + narrowAngle, PI) <= wideAngle)
+	{
+		axis = wideAxis;
+		normalAngle = wideAngle;
+		return;
+	}
+
+	const Float32 angle = 0.5f * (wideAngle + axesAngle + narrowAngle);
+	const FVector3 orthogonal = narrowAxis - wideAxis * cosine;
+	const Float32 orthogonalLength = glm::length(orthogonal);
+	if (angle >= PI || orthogonalLength < 1e-6f)
+	{
+		axis = wideAxis;
+		normalAngle = PI;
+		return;
+	}
+
+	// Axis of wider cone is rotated towards narrower one, until both fit in
+	const Float32 rotation = angle - wideAngle;
+	axis = glm::normalize(wideAxis * std::cos(rotation) + (orthogonal / orthogonalLength) * std::sin(rotation));
+	normalAngle = angle;
+}
+
+Float32 LightTree::get_orientation_measure(Float32 normalAngle)
+{
+	const Float32 emissionAngle = glm::min(normalAngle + HALF_PI, PI);
+	const Float32 cosine = std::cos(normalAngle);
+	const Float32 sine = std::sin(normalAngle);
+	return 2.0f * PI * (1.0f - cosine) + HALF_PI * (2.0f * emissionAngle * sine - std::cos(normalAngle - 2.0f * emissionAngle) - 2.0f * normalAngle * sine + cosine);
+}
+
+Float32 LightTree::get_surface_area(const FVector3& min, const FVector3& max)
+{
+	const FVector3 extent = max - min;
+	return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+/** Cluster of lights bounded by box and by cone of their normals, leaf holds one light */
+struct LightTreeNode
+{
+	FVector3 min;
+	// Sum of powers of lights in cluster
+	Float32 power;
+	FVector3 max;
+	// Normals of lights are within that angle around axis, one sided lights emit up to right angle further
+	Float32 normalAngle;
+	FVector3 axis;
+	Int32 parentId;
+	Int32 leftId;
+	Int32 rightId;
+	// Light of leaf, otherwise -1
+	Int32 lightId;
+	Int32 padding;
+};
+
+/** Bounds of one light in world space, input of build */
+struct LightBounds
+{
+	FVector3 min;
+	FVector3 max;
+	FVector3 axis;
+	Float32 normalAngle;
+	Float32 power;
+};
+
+/** Binary tree over lights for sampling them by importance to shading point, root is the first node, it is the only one without lights */
+class LightTree
+{
+public:
+	// Normal angle of cone, which holds every direction
+	static constexpr Float32 WHOLE_SPHERE_ANGLE = 3.1415926535897932384626433832795f;
+
+	/** Every split minimizes surface area orientation heuristic of children */
+	Void create_tree(const DynamicArray<LightBounds>& lights);
+
+	DynamicArray<LightTreeNode> nodes;
+	// Leaf of every light, probability of light is product of branch probabilities from it up to root
+	DynamicArray<Int32> leafIds;
+
+private:
+	static constexpr Int32 BINS_COUNT = 12;
+
+	struct Bin
+	{
+		FVector3 min;
+		FVector3 max;
+		FVector3 axis;
+		Float32 normalAngle;
+		Float32 power;
+		Int32 count;
+	};
+
+	Int32 create_node(const DynamicArray<LightBounds>& lights, DynamicArray<Int32>& lightIds, Int32 begin, Int32 end, Int32 parentId);
+	/** Cone of both cones, empty cone has negative angle */
+	static Void merge_cones(FVector3& axis, Float32& normalAngle, const FVector3& otherAxis, Float32 otherNormalAngle);
+	/** Solid angle of emission weighted by cosine, integrated over normals in cone */
+	[[nodiscard]]
+	static Float32 get_orientation_measure(Float32 normalAngle);
+	[[nodiscard]]
+	static Float32 get_surface_area(const FVector3& min, const FVector3& max);
+};
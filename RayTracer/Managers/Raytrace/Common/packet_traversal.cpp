@@ -0,0 +1,573 @@
+#include "packet_traversal.hpp"
+
+#include "bvh_builder.hpp"
+#include "vertex.hpp"
+#include "Utilities/task_scheduler.hpp"
+#include <bitset>
+#include <chrono>
+#include <immintrin.h>
+#include <magic_enum.hpp>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+// MSVC accepts intrinsics of every instruction set, other compilers only of the ones enabled for translation unit
+#if defined(_MSC_VER) || defined(__AVX2__)
+#define PACKET_TRAVERSAL_AVX2
+#endif
+#if defined(_MSC_VER) || defined(__AVX512F__)
+#define PACKET_TRAVERSAL_AVX512
+#endif
+
+namespace
+{
+	/** Operations on all lanes of one register, so traversal is written once for every instruction set */
+	struct SSELanes
+	{
+		static constexpr Int32 WIDTH = 4;
+		using Float = __m128;
+		using Mask = __m128;
+
+		static Float load(const Float32* data) { return _mm_load_ps(data); }
+		static Void store(Float32* data, Float value) { _mm_store_ps(data, value); }
+		static Float set(Float32 value) { return _mm_set1_ps(value); }
+		static Float add(Float a, Float b) { return _mm_add_ps(a, b); }
+		static Float sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+		static Float mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+		static Float div(Float a, Float b) { return _mm_div_ps(a, b); }
+		static Float min(Float a, Float b) { return _mm_min_ps(a, b); }
+		static Float max(Float a, Float b) { return _mm_max_ps(a, b); }
+		static Float abs(Float a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+		static Mask less_equal(Float a, Float b) { return _mm_cmple_ps(a, b); }
+		static Mask less(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+		static Mask both(Mask a, Mask b) { return _mm_and_ps(a, b); }
+		static Float select(Mask mask, Float a, Float b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+		static Int32 get_bits(Mask mask) { return _mm_movemask_ps(mask); }
+	};
+
+#ifdef PACKET_TRAVERSAL_AVX2
+	struct AVX2Lanes
+	{
+		static constexpr Int32 WIDTH = 8;
+		using Float = __m256;
+		using Mask = __m256;
+
+		static Float load(const Float32* data) { return _mm256_load_ps(data); }
+		static Void store(Float32* data, Float value) { _mm256_store_ps(data, value); }
+		static Float set(Float32 value) { return _mm256_set1_ps(value); }
+		static Float add(Float a, Float b) { return _mm256_add_ps(a, b); }
+		static Float sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+		static Float mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+		static Float div(Float a, Float b) { return _mm256_div_ps(a, b); }
+		static Float min(Float a, Float b) { return _mm256_min_ps(a, b); }
+		static Float max(Float a, Float b) { return _mm256_max_ps(a, b); }
+		static Float abs(Float a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+		static Mask less_equal(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+		static Mask less(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+		static Mask both(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+		static Float select(Mask mask, Float a, Float b) { return _mm256_blendv_ps(b, a, mask); }
+		static Int32 get_bits(Mask mask) { return _mm256_movemask_ps(mask); }
+	};
+#endif
+
+#ifdef PACKET_TRAVERSAL_AVX512
+	struct AVX512Lanes
+	{
+		static constexpr Int32 WIDTH = 16;
+		using Float = __m512;
+		using Mask = __mmask16;
+
+		static Float load(const Float32* data) { return _mm512_load_ps(data); }
+		static Void store(Float32* data, Float value) { _mm512_store_ps(data, value); }
+		static Float set(Float32 value) { return _mm512_set1_ps(value); }
+		static Float add(Float a, Float b) { return _mm512_add_ps(a, b); }
+		static Float sub(Float a, Float b) { return _mm512_sub_ps(a, b); }
+		static Float mul(Float a, Float b) { return _mm512_mul_ps(a, b); }
+		static Float div(Float a, Float b) { return _mm512_div_ps(a, b); }
+		static Float min(Float a, Float b) { return _mm512_min_ps(a, b); }
+		static Float max(Float a, Float b) { return _mm512_max_ps(a, b); }
+		static Float abs(Float a) { return _mm512_abs_ps(a); }
+		static Mask less_equal(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+		static Mask less(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+		static Mask both(Mask a, Mask b) { return Mask(a & b); }
+		static Float select(Mask mask, Float a, Float b) { return _mm512_mask_blend_ps(mask, b, a); }
+		static Int32 get_bits(Mask mask) { return Int32(mask); }
+	};
+#endif
+
+	/** Rays of packet in structure of arrays, aligned for the widest registers */
+	template<Int32 Width>
+	struct PacketData
+	{
+		alignas(64) Array<Float32, Width> originX;
+		alignas(64) Array<Float32, Width> originY;
+		alignas(64) Array<Float32, Width> originZ;
+		alignas(64) Array<Float32, Width> directionX;
+		alignas(64) Array<Float32, Width> directionY;
+		alignas(64) Array<Float32, Width> directionZ;
+		alignas(64) Array<Float32, Width> invDirectionX;
+		alignas(64) Array<Float32, Width> invDirectionY;
+		alignas(64) Array<Float32, Width> invDirectionZ;
+		alignas(64) Array<Float32, Width> minDistance;
+		alignas(64) Array<Float32, Width> maxDistance;
+		alignas(64) Array<Float32, Width> hitDistance;
+	};
+
+	Void get_cpuid(UInt32 leaf, Array<UInt32, 4>& registers)
+	{
+#ifdef _MSC_VER
+		Array<Int32, 4> values;
+		__cpuidex(values.data(), Int32(leaf), 0);
+		for (Int32 i = 0; i < 4; ++i)
+		{
+			registers[i] = UInt32(values[i]);
+		}
+#else
+		__cpuid_count(leaf, 0, registers[0], registers[1], registers[2], registers[3]);
+#endif
+	}
+
+	/** Register states, which system saves on context switch */
+	UInt64 get_enabled_states()
+	{
+#ifdef _MSC_VER
+		return _xgetbv(0);
+#else
+		UInt32 low, high;
+		__asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+		return (UInt64(high) << 32U) | UInt64(low);
+#endif
+	}
+
+	ESIMDLevel detect_level()
+	{
+		Array<UInt32, 4> registers;
+		get_cpuid(0U, registers);
+		if (registers[0] < 7U)
+		{
+			return ESIMDLevel::SSE;
+		}
+
+		get_cpuid(1U, registers);
+		const Bool hasXSave = (registers[2] & (1U << 27U)) != 0U;
+		const Bool hasAVX = (registers[2] & (1U << 28U)) != 0U;
+		if (!hasXSave || !hasAVX)
+		{
+			return ESIMDLevel::SSE;
+		}
+
+		// AVX needs saved SSE and AVX states, AVX-512 also needs opmask and upper halves of ZMM registers
+		const UInt64 states = get_enabled_states();
+		get_cpuid(7U, registers);
+		// Flags are read only by levels compiled in, other compilers may build without AVX2 or AVX-512
+		[[maybe_unused]] const Bool hasAVX2 = (registers[1] & (1U << 5U)) != 0U && (states & 0x6U) == 0x6U;
+		[[maybe_unused]] const Bool hasAVX512 = (registers[1] & (1U << 16U)) != 0U && (states & 0xe6U) == 0xe6U;
+#ifdef PACKET_TRAVERSAL_AVX512
+		if (hasAVX512 && hasAVX2)
+		{
+			return ESIMDLevel::AVX512;
+		}
+#endif
+#ifdef PACKET_TRAVERSAL_AVX2
+		if (hasAVX2)
+		{
+			return ESIMDLevel::AVX2;
+		}
+#endif
+		return ESIMDLevel::SSE;
+	}
+
+	Int32 count_bits(Int32 bits)
+	{
+		return Int32(std::bitset<32>(UInt32(bits)).count());
+	}
+}
+
+PacketTraversal::PacketTraversal(const DynamicArray<Vertex>& vertexes, const DynamicArray<UInt32>& indexes)
+	: simdLevel(get_supported_level())
+	, vertexes(vertexes)
+	, indexes(indexes)
+	, singleRay(vertexes, indexes)
+{
+}
+
+Void PacketTraversal::intersect(const DynamicArray<BVHNode>& hierarchy,
+								const DynamicArray<BVHOctantLinks>& octantLinks,
+								Int32 rootId,
+								const Ray* rays,
+								Hit* hits,
+								Int32 raysCount) const
+{
+	intersect(simdLevel, hierarchy, octantLinks, rootId, rays, hits, raysCount);
+}
+
+Void PacketTraversal::benchmark(const BVHBuilder& bvh) const
+{
+	DynamicArray<BVHOctantLinks> octantLinks;
+	bvh.create_octant_links(octantLinks);
+	const BVHNode& root = bvh.hierarchy[bvh.rootId];
+
+	SPDLOG_INFO("Packet benchmark on {} threads, supported level: {}",
+				TaskScheduler::get().get_threads_count(),
+				magic_enum::enum_name(get_supported_level()));
+	log_benchmark("Camera rays", bvh, octantLinks, generate_camera_rays(root.min, root.max, BENCHMARK_IMAGE_SIZE));
+	log_benchmark("Incoherent rays", bvh, octantLinks, singleRay.generate_rays(BENCHMARK_IMAGE_SIZE.x * BENCHMARK_IMAGE_SIZE.y));
+}
+
+DynamicArray<PacketTraversal::Ray> PacketTraversal::generate_camera_rays(const FVector3& min, const FVector3& max, const IVector2& imageSize) const
+{
+	const FVector3 extent = max - min;
+	const FVector3 forward = extent.x >= extent.z ? FVector3(1.0f, 0.0f, 0.0f) : FVector3(0.0f, 0.0f, 1.0f);
+	const FVector3 right = glm::normalize(glm::cross(forward, FVector3(0.0f, 1.0f, 0.0f)));
+	const FVector3 up = glm::normalize(glm::cross(right, forward));
+	// Same field of view as default camera
+	const Float32 halfHeight = glm::tan(glm::radians(70.0f) * 0.5f);
+	const Float32 halfWidth = halfHeight * Float32(imageSize.x) / Float32(imageSize.y);
+
+	DynamicArray<Ray> rays;
+	rays.reserve(UInt64(imageSize.x) * UInt64(imageSize.y));
+	for (Int32 tileY = 0; tileY < imageSize.y; tileY += 4)
+	{
+		for (Int32 tileX = 0; tileX < imageSize.x; tileX += 4)
+		{
+			for (Int32 y = tileY; y < glm::min(tileY + 4, imageSize.y); ++y)
+			{
+				for (Int32 x = tileX; x < glm::min(tileX + 4, imageSize.x); ++x)
+				{
+					const Float32 u = ((Float32(x) + 0.5f) / Float32(imageSize.x)) * 2.0f - 1.0f;
+					const Float32 v = ((Float32(y) + 0.5f) / Float32(imageSize.y)) * 2.0f - 1.0f;
+					Ray& ray = rays.emplace_back();
+					ray.origin = (min + max) * 0.5f;
+					ray.direction = glm::normalize(forward + right * (u * halfWidth) + up * (v * halfHeight));
+					ray.minDistance = 0.001f;
+					ray.maxDistance = 5000.0f;
+				}
+			}
+		}
+	}
+	return rays;
+}
+
+ESIMDLevel PacketTraversal::get_supported_level()
+{
+	static const ESIMDLevel level = detect_level();
+	return level;
+}
+
+Int32 PacketTraversal::get_packet_size(ESIMDLevel level)
+{
+	return 4 << Int32(level);
+}
+
+Void PacketTraversal::intersect(ESIMDLevel level,
+								const DynamicArray<BVHNode>& hierarchy,
+								const DynamicArray<BVHOctantLinks>& octantLinks,
+								Int32 rootId,
+								const Ray* rays,
+								Hit* hits,
+								Int32 raysCount) const
+{
+	level = ESIMDLevel(glm::min(UInt8(level), UInt8(get_supported_level())));
+#ifdef PACKET_TRAVERSAL_AVX512
+	if (level == ESIMDLevel::AVX512)
+	{
+		intersect_packets<AVX512Lanes>(hierarchy, octantLinks, rootId, rays, hits, raysCount);
+		return;
+	}
+#endif
+#ifdef PACKET_TRAVERSAL_AVX2
+	if (level == ESIMDLevel::AVX2)
+	{
+		intersect_packets<AVX2Lanes>(hierarchy, octantLinks, rootId, rays, hits, raysCount);
+		return;
+	}
+#endif
+	intersect_packets<SSELanes>(hierarchy, octantLinks, rootId, rays, hits, raysCount);
+}
+
+template<typename Lanes>
+Void PacketTraversal::intersect_packets(const DynamicArray<BVHNode>& hierarchy,
+										const DynamicArray<BVHOctantLinks>& octantLinks,
+										Int32 rootId,
+										const Ray* rays,
+										Hit* hits,
+										Int32 raysCount) const
+{
+	for (Int32 first = 0; first < raysCount; first += Lanes::WIDTH)
+	{
+		intersect_packet<Lanes>(hierarchy, octantLinks, rootId, rays + first, hits + first, glm::min(Lanes::WIDTH, raysCount - first));
+	}
+}
+
+template<typename Lanes>
+Void PacketTraversal::intersect_packet(const DynamicArray<BVHNode>& hierarchy,
+									   const DynamicArray<BVHOctantLinks>& octantLinks,
+									   Int32 rootId,
+									   const Ray* rays,
+									   Hit* hits,
+									   Int32 raysCount) const
+{
+	using Float = typename Lanes::Float;
+	using Mask = typename Lanes::Mask;
+	constexpr Int32 Width = Lanes::WIDTH;
+
+	for (Int32 i = 0; i < raysCount; ++i)
+	{
+		hits[i].distance = rays[i].maxDistance;
+		hits[i].triangleId = -1;
+		hits[i].visitedNodesCount = 0;
+		hits[i].testedTrianglesCount = 0;
+	}
+
+	// Children are visited in the same order by all rays, which is near to far only for rays of one octant
+	const Int32 octant = BVHTraversal::get_octant(rays[0].direction);
+	for (Int32 i = 1; i < raysCount; ++i)
+	{
+		if (BVHTraversal::get_octant(rays[i].direction) != octant)
+		{
+			for (Int32 j = 0; j < raysCount; ++j)
+			{
+				singleRay.intersect(hierarchy, octantLinks, rootId, rays[j], hits[j]);
+			}
+			return;
+		}
+	}
+
+	// Unused lanes get empty range of distances, so they never hit anything
+	PacketData<Width> packet;
+	for (Int32 i = 0; i < Width; ++i)
+	{
+		const Ray& ray = rays[glm::min(i, raysCount - 1)];
+		const FVector3 invDirection = BVHTraversal::get_inverse_direction(ray.direction);
+		packet.originX[i] = ray.origin.x;
+		packet.originY[i] = ray.origin.y;
+		packet.originZ[i] = ray.origin.z;
+		packet.directionX[i] = ray.direction.x;
+		packet.directionY[i] = ray.direction.y;
+		packet.directionZ[i] = ray.direction.z;
+		packet.invDirectionX[i] = invDirection.x;
+		packet.invDirectionY[i] = invDirection.y;
+		packet.invDirectionZ[i] = invDirection.z;
+		packet.minDistance[i] = i < raysCount ? ray.minDistance : 1.0f;
+		packet.maxDistance[i] = i < raysCount ? ray.maxDistance : 0.0f;
+		packet.hitDistance[i] = packet.maxDistance[i];
+	}
+
+	const Float originX = Lanes::load(packet.originX.data());
+	const Float originY = Lanes::load(packet.originY.data());
+	const Float originZ = Lanes::load(packet.originZ.data());
+	const Float invDirectionX = Lanes::load(packet.invDirectionX.data());
+	const Float invDirectionY = Lanes::load(packet.invDirectionY.data());
+	const Float invDirectionZ = Lanes::load(packet.invDirectionZ.data());
+	const Float minDistance = Lanes::load(packet.minDistance.data());
+	const Int32 maxSingleRaysCount = glm::max(1, Int32(Float32(Width) * minActiveRatio));
+	Int32 visitedNodesCount = 0;
+
+	Int32 nodeId = rootId;
+	while (nodeId != -1)
+	{
+		const BVHNode& node = hierarchy[nodeId];
+		const IVector2& link = octantLinks[nodeId].links[octant];
+		visitedNodesCount++;
+
+		const Float hitDistance = Lanes::load(packet.hitDistance.data());
+		const Float t0X = Lanes::mul(Lanes::sub(Lanes::set(node.min.x), originX), invDirectionX);
+		const Float t1X = Lanes::mul(Lanes::sub(Lanes::set(node.max.x), originX), invDirectionX);
+		const Float t0Y = Lanes::mul(Lanes::sub(Lanes::set(node.min.y), originY), invDirectionY);
+		const Float t1Y = Lanes::mul(Lanes::sub(Lanes::set(node.max.y), originY), invDirectionY);
+		const Float t0Z = Lanes::mul(Lanes::sub(Lanes::set(node.min.z), originZ), invDirectionZ);
+		const Float t1Z = Lanes::mul(Lanes::sub(Lanes::set(node.max.z), originZ), invDirectionZ);
+		const Float entryDistance = Lanes::max(Lanes::max(Lanes::min(t0X, t1X), Lanes::min(t0Y, t1Y)),
+											   Lanes::max(Lanes::min(t0Z, t1Z), minDistance));
+		const Float exitDistance = Lanes::min(Lanes::min(Lanes::max(t0X, t1X), Lanes::max(t0Y, t1Y)),
+											  Lanes::min(Lanes::max(t0Z, t1Z), hitDistance));
+		const Mask activeMask = Lanes::less_equal(entryDistance, exitDistance);
+		const Int32 activeBits = Lanes::get_bits(activeMask);
+		if (activeBits == 0)
+		{
+			nodeId = link.y;
+			continue;
+		}
+
+		if (node.primitiveCount > 0)
+		{
+			intersect_leaf<Lanes>(node, activeMask, packet, hits);
+		} else {
+			if (count_bits(activeBits) <= maxSingleRaysCount)
+			{
+				// Packet diverged, so remaining rays finish the subtree on their own and packet skips it
+				for (Int32 i = 0; i < Width; ++i)
+				{
+					if ((activeBits & (1 << i)) == 0)
+					{
+						continue;
+					}
+
+					hits[i].distance = packet.hitDistance[i];
+					singleRay.intersect_subtree(hierarchy, octantLinks, nodeId, link.y, rays[i], hits[i]);
+					packet.hitDistance[i] = hits[i].distance;
+				}
+				nodeId = link.y;
+				continue;
+			}
+		}
+		nodeId = link.x;
+	}
+
+	for (Int32 i = 0; i < raysCount; ++i)
+	{
+		hits[i].distance = packet.hitDistance[i];
+		hits[i].visitedNodesCount += visitedNodesCount;
+	}
+}
+
+template<typename Lanes, typename Packet>
+Void PacketTraversal::intersect_leaf(const BVHNode& node, typename Lanes::Mask activeMask, Packet& packet, Hit* hits) const
+{
+	using Float = typename Lanes::Float;
+	using Mask = typename Lanes::Mask;
+	constexpr Int32 Width = Lanes::WIDTH;
+
+	const Float originX = Lanes::load(packet.originX.data());
+	const Float originY = Lanes::load(packet.originY.data());
+	const Float originZ = Lanes::load(packet.originZ.data());
+	const Float directionX = Lanes::load(packet.directionX.data());
+	const Float directionY = Lanes::load(packet.directionY.data());
+	const Float directionZ = Lanes::load(packet.directionZ.data());
+	const Float minDistance = Lanes::load(packet.minDistance.data());
+	const Float maxDistance = Lanes::load(packet.maxDistance.data());
+	const Float zero = Lanes::set(0.0f);
+	const Float one = Lanes::set(1.0f);
+	Float hitDistance = Lanes::load(packet.hitDistance.data());
+
+	const Int32 activeBits = Lanes::get_bits(activeMask);
+	for (Int32 i = 0; i < Width; ++i)
+	{
+		if ((activeBits & (1 << i)) != 0)
+		{
+			hits[i].testedTrianglesCount += node.primitiveCount;
+		}
+	}
+
+	// Moller-Trumbore with the same order of operations as single ray, so both find the same distances
+	for (Int32 i = 0; i < node.primitiveCount; ++i)
+	{
+		const Int32 triangleId = node.primitiveId + i * 3;
+		const FVector3& a = vertexes[indexes[triangleId + 0]].position;
+		const FVector3& b = vertexes[indexes[triangleId + 1]].position;
+		const FVector3& c = vertexes[indexes[triangleId + 2]].position;
+		const FVector3 edge1 = b - a;
+		const FVector3 edge2 = c - a;
+		const Float edge1X = Lanes::set(edge1.x);
+		const Float edge1Y = Lanes::set(edge1.y);
+		const Float edge1Z = Lanes::set(edge1.z);
+		const Float edge2X = Lanes::set(edge2.x);
+		const Float edge2Y = Lanes::set(edge2.y);
+		const Float edge2Z = Lanes::set(edge2.z);
+
+		const Float dirXe2X = Lanes::sub(Lanes::mul(directionY, edge2Z), Lanes::mul(edge2Y, directionZ));
+		const Float dirXe2Y = Lanes::sub(Lanes::mul(directionZ, edge2X), Lanes::mul(edge2Z, directionX));
+		const Float dirXe2Z = Lanes::sub(Lanes::mul(directionX, edge2Y), Lanes::mul(edge2X, directionY));
+		const Float det = Lanes::add(Lanes::add(Lanes::mul(edge1X, dirXe2X), Lanes::mul(edge1Y, dirXe2Y)), Lanes::mul(edge1Z, dirXe2Z));
+		Mask valid = Lanes::both(activeMask, Lanes::less_equal(Lanes::set(1e-12f), Lanes::abs(det)));
+
+		const Float invDet = Lanes::div(one, det);
+		const Float sX = Lanes::sub(originX, Lanes::set(a.x));
+		const Float sY = Lanes::sub(originY, Lanes::set(a.y));
+		const Float sZ = Lanes::sub(originZ, Lanes::set(a.z));
+		const Float u = Lanes::mul(invDet, Lanes::add(Lanes::add(Lanes::mul(sX, dirXe2X), Lanes::mul(sY, dirXe2Y)), Lanes::mul(sZ, dirXe2Z)));
+		valid = Lanes::both(valid, Lanes::both(Lanes::less_equal(zero, u), Lanes::less_equal(u, one)));
+
+		const Float sXe1X = Lanes::sub(Lanes::mul(sY, edge1Z), Lanes::mul(edge1Y, sZ));
+		const Float sXe1Y = Lanes::sub(Lanes::mul(sZ, edge1X), Lanes::mul(edge1Z, sX));
+		const Float sXe1Z = Lanes::sub(Lanes::mul(sX, edge1Y), Lanes::mul(edge1X, sY));
+		const Float v = Lanes::mul(invDet, Lanes::add(Lanes::add(Lanes::mul(directionX, sXe1X), Lanes::mul(directionY, sXe1Y)), Lanes::mul(directionZ, sXe1Z)));
+		valid = Lanes::both(valid, Lanes::both(Lanes::less_equal(zero, v), Lanes::less_equal(Lanes::add(u, v), one)));
+
+		const Float distance = Lanes::mul(invDet, Lanes::add(Lanes::add(Lanes::mul(edge2X, sXe1X), Lanes::mul(edge2Y, sXe1Y)), Lanes::mul(edge2Z, sXe1Z)));
+		valid = Lanes::both(valid, Lanes::both(Lanes::less_equal(minDistance, distance), Lanes::less_equal(distance, maxDistance)));
+		valid = Lanes::both(valid, Lanes::less(distance, hitDistance));
+
+		const Int32 hitBits = Lanes::get_bits(valid);
+		if (hitBits == 0)
+		{
+			continue;
+		}
+
+		hitDistance = Lanes::select(valid, distance, hitDistance);
+		for (Int32 lane = 0; lane < Width; ++lane)
+		{
+			if ((hitBits & (1 << lane)) != 0)
+			{
+				hits[lane].triangleId = triangleId;
+			}
+		}
+	}
+
+	Lanes::store(packet.hitDistance.data(), hitDistance);
+}
+
+Float32 PacketTraversal::trace_packets(ESIMDLevel level,
+									   const BVHBuilder& bvh,
+									   const DynamicArray<BVHOctantLinks>& octantLinks,
+									   const DynamicArray<Ray>& rays,
+									   DynamicArray<Hit>& hits) const
+{
+	// Grain is multiple of the widest packet, so packets are the same as in single call
+	const auto startTime = std::chrono::steady_clock::now();
+	TaskScheduler::get().parallel_for(0, Int32(rays.size()), BENCHMARK_GRAIN_SIZE, [&](Int32 begin, Int32 end)
+	{
+		intersect(level, bvh.hierarchy, octantLinks, bvh.rootId, rays.data() + begin, hits.data() + begin, end - begin);
+	});
+	return std::chrono::duration<Float32, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+Void PacketTraversal::log_benchmark(const String& name,
+									const BVHBuilder& bvh,
+									const DynamicArray<BVHOctantLinks>& octantLinks,
+									const DynamicArray<Ray>& rays) const
+{
+	DynamicArray<Hit> singleHits(rays.size());
+	const Float32 singleTime = singleRay.trace_rays(rays, singleHits, [&](const Ray& ray, Hit& hit)
+	{
+		return singleRay.intersect(bvh.hierarchy, octantLinks, bvh.rootId, ray, hit);
+	});
+
+	const Float32 megaRays = Float32(rays.size()) * 0.001f;
+	SPDLOG_INFO("{}, {} rays, single: {:.2f} ms, {:.2f} Mrays/s, {:.1f} box tests per ray",
+				name,
+				rays.size(),
+				singleTime,
+				megaRays / singleTime,
+				singleRay.get_average_visits(singleHits));
+	for (Int32 level = 0; level <= Int32(get_supported_level()); ++level)
+	{
+		DynamicArray<Hit> hits(rays.size());
+		const Float32 time = trace_packets(ESIMDLevel(level), bvh, octantLinks, rays, hits);
+
+		Int32 mismatchesCount = 0;
+		for (UInt64 i = 0; i < rays.size(); ++i)
+		{
+			const Float32 tolerance = 1e-4f * glm::max(1.0f, singleHits[i].distance);
+			if (glm::abs(singleHits[i].distance - hits[i].distance) > tolerance)
+			{
+				++mismatchesCount;
+			}
+		}
+
+		SPDLOG_INFO("  {} packets of {}: {:.2f} ms, {:.2f} Mrays/s, speedup {:.2f}, {:.1f} box tests per ray",
+					magic_enum::enum_name(ESIMDLevel(level)),
+					get_packet_size(ESIMDLevel(level)),
+					time,
+					megaRays / time,
+					singleTime / time,
+					singleRay.get_average_visits(hits));
+		if (mismatchesCount > 0)
+		{
+			SPDLOG_WARN("  Packets disagree with single rays for {} rays", mismatchesCount);
+		}
+	}
+}
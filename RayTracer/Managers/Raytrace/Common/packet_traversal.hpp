@@ -0,0 +1,90 @@
+#pragma once
+#include "bvh_traversal.hpp"
+
+class BVHBuilder;
+
+/** Instruction sets of packet traversal, packets have 4, 8 and 16 rays */
+enum class ESIMDLevel : UInt8
+{
+	SSE = 0U,
+	AVX2,
+	AVX512,
+	Count
+};
+
+/** Traversal of binary tree with packets of coherent rays, every box and triangle is tested against all rays of packet at once */
+class PacketTraversal
+{
+public:
+	using Ray = BVHTraversal::Ray;
+	using Hit = BVHTraversal::Hit;
+
+	PacketTraversal(const DynamicArray<Vertex>& vertexes, const DynamicArray<UInt32>& indexes);
+
+	/** Consecutive rays form packets, hits are the same as of single ray traversal ordered by octant */
+	Void intersect(const DynamicArray<BVHNode>& hierarchy,
+				   const DynamicArray<BVHOctantLinks>& octantLinks,
+				   Int32 rootId,
+				   const Ray* rays,
+				   Hit* hits,
+				   Int32 raysCount) const;
+	/** Traces camera rays and incoherent rays with every supported level and logs throughput next to single rays */
+	Void benchmark(const BVHBuilder& bvh) const;
+	/** Camera in center of bounds looks along the longest horizontal axis, every 16 rays cover tile of 4x4 pixels */
+	[[nodiscard]]
+	DynamicArray<Ray> generate_camera_rays(const FVector3& min, const FVector3& max, const IVector2& imageSize) const;
+
+	/** The highest level supported by processor and enabled by system */
+	[[nodiscard]]
+	static ESIMDLevel get_supported_level();
+	[[nodiscard]]
+	static Int32 get_packet_size(ESIMDLevel level);
+
+	// Levels above supported one fall back to it
+	ESIMDLevel simdLevel;
+	// Subtree is traversed by every ray on its own, when at most that fraction of packet reaches it
+	Float32 minActiveRatio = 0.25f;
+
+private:
+	static constexpr IVector2 BENCHMARK_IMAGE_SIZE = { 1024, 1024 };
+	static constexpr Int32 BENCHMARK_GRAIN_SIZE = 1024;
+
+	const DynamicArray<Vertex>& vertexes;
+	const DynamicArray<UInt32>& indexes;
+	BVHTraversal singleRay;
+
+	Void intersect(ESIMDLevel level,
+				   const DynamicArray<BVHNode>& hierarchy,
+				   const DynamicArray<BVHOctantLinks>& octantLinks,
+				   Int32 rootId,
+				   const Ray* rays,
+				   Hit* hits,
+				   Int32 raysCount) const;
+	template<typename Lanes>
+	Void intersect_packets(const DynamicArray<BVHNode>& hierarchy,
+						   const DynamicArray<BVHOctantLinks>& octantLinks,
+						   Int32 rootId,
+						   const Ray* rays,
+						   Hit* hits,
+						   Int32 raysCount) const;
+	/** At most width of lanes rays, packet is traced ray by ray when directions of rays differ in signs */
+	template<typename Lanes>
+	Void intersect_packet(const DynamicArray<BVHNode>& hierarchy,
+						  const DynamicArray<BVHOctantLinks>& octantLinks,
+						  Int32 rootId,
+						  const Ray* rays,
+						  Hit* hits,
+						  Int32 raysCount) const;
+	template<typename Lanes, typename Packet>
+	Void intersect_leaf(const BVHNode& node, typename Lanes::Mask activeMask, Packet& packet, Hit* hits) const;
+	/** Returns time of tracing all rays on all threads in milliseconds */
+	Float32 trace_packets(ESIMDLevel level,
+						  const BVHBuilder& bvh,
+						  const DynamicArray<BVHOctantLinks>& octantLinks,
+						  const DynamicArray<Ray>& rays,
+						  DynamicArray<Hit>& hits) const;
+	Void log_benchmark(const String& name,
+					   const BVHBuilder& bvh,
+					   const DynamicArray<BVHOctantLinks>& octantLinks,
+					   const DynamicArray<Ray>& rays) const;
+};
@@ -0,0 +1,836 @@
+#include "raytrace_scene.hpp"
+
+#include "../../Resource/resource_manager.hpp"
+#include "../../Resource/Common/handle.hpp"
+#include "../../Resource/Common/model.hpp"
+#include "../../Resource/Common/instance.hpp"
+#include "../../Resource/Common/material.hpp"
+#include "../../Resource/Common/mesh.hpp"
+#include "vertex.hpp"
+#include "bvh_traversal.hpp"
+#include "packet_traversal.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+	/** Empty ranges are skipped, so merged range covers only changed elements */
+	Void merge_range(Pair<Int32, Int32>& range, const Pair<Int32, Int32>& other)
+	{
+		if (other.first >= other.second)
+		{
+			return;
+		}
+		if (range.first >= range.second)
+		{
+			range = other;
+			return;
+		}
+		range.first	 = glm::min(range.first, other.first);
+		range.second = glm::max(range.second, other.second);
+	}
+}
+
+Void RaytraceScene::create()
+{
+	SResourceManager& resourceManager = SResourceManager::get();
+	materials.reserve(resourceManager.get_materials().size());
+	for (const Material& material : resourceManager.get_materials())
+	{
+		GPUMaterial& gpuMaterial = materials.emplace_back();
+		gpuMaterial.albedo	  = material.textures[UInt64(ETextureType::Albedo)].id;
+		gpuMaterial.normal	  = material.textures[UInt64(ETextureType::Normal)].id;
+
+		if (material.textures[UInt64(ETextureType::RM)].id == Handle<Texture>::sNone.id)
+		{
+			gpuMaterial.roughness = material.textures[UInt64(ETextureType::Roughness)].id;
+			gpuMaterial.metalness = material.textures[UInt64(ETextureType::Metalness)].id;
+		} else {
+			gpuMaterial.roughness = material.textures[UInt64(ETextureType::RM)].id;
+			gpuMaterial.metalness = material.textures[UInt64(ETextureType::RM)].id;
+		}
+
+		gpuMaterial.emission  = material.textures[UInt64(ETextureType::Emission)].id;
+		gpuMaterial.indexOfRefraction  = material.indexOfRefraction;
+	}
+
+	const DynamicArray<Model>& models = resourceManager.get_models();
+	bottomLevelTrees.reserve(models.size());
+	for (const Model& model : models)
+	{
+		// Every model has its own tree in object space, which is shared by all of its instances
+		DynamicArray<Vertex> modelVertexes;
+		DynamicArray<UInt32> modelIndexes;
+		get_model_geometry(model, modelVertexes, modelIndexes);
+
+		BottomLevelTree& tree = bottomLevelTrees.emplace_back();
+		tree.vertexesOffset	 = Int32(vertexes.size());
+		tree.vertexesCount	 = 0;
+		tree.indexesOffset	 = Int32(indexes.size());
+		tree.indexesCount	 = 0;
+		tree.nodesOffset	 = Int32(bottomLevelNodes.size());
+		tree.wideNodesOffset = Int32(wideHierarchy.size());
+		if (modelIndexes.empty())
+		{
+			continue;
+		}
+
+		// Triangles are reordered and long ones are referenced by several leaves, so model is appended to scene afterwards
+		tree.bvh.buildMode = EBVHBuildMode::SpatialSAH;
+		tree.bvh.create_tree(modelVertexes, modelIndexes);
+		tree.indexesCount = Int32(modelIndexes.size());
+		tree.bvh.create_wide_tree(tree.wideHierarchy);
+		wideTreeDepth = glm::max(wideTreeDepth, tree.bvh.get_wide_tree_depth(tree.wideHierarchy));
+		DynamicArray<CompressedBVHNode> modelCompressedHierarchy;
+		tree.bvh.create_compressed_tree(tree.wideHierarchy, modelCompressedHierarchy);
+		DynamicArray<BVHOctantLinks> modelOctantLinks;
+		tree.bvh.create_octant_links(modelOctantLinks);
+		tree.bvh.copy_tree(bottomLevelNodes, tree.nodesOffset, tree.indexesOffset);
+		tree.bvh.copy_octant_links(modelOctantLinks, octantLinks, tree.nodesOffset);
+		tree.bvh.copy_wide_tree(tree.wideHierarchy, wideHierarchy, tree.wideNodesOffset, tree.indexesOffset);
+		tree.bvh.copy_wide_tree(modelCompressedHierarchy, compressedHierarchy, tree.wideNodesOffset, tree.indexesOffset);
+
+		const UInt32 vertexesOffset = UInt32(vertexes.size());
+		tree.vertexesCount = Int32(modelVertexes.size());
+		vertexes.insert(vertexes.end(), modelVertexes.begin(), modelVertexes.end());
+		for (const UInt32 index : modelIndexes)
+		{
+			indexes.emplace_back(index + vertexesOffset);
+		}
+
+		// Light has to be sampled once, even if spatial splits put it into several leaves
+		for (const Int32 triangleId : get_unique_triangles(tree.indexesOffset, tree.indexesCount))
+		{
+			if (materials[vertexes[indexes[triangleId]].materialId].emission != Handle<Texture>::sNone.id)
+			{
+				tree.emissionTriangleIds.push_back(triangleId);
+			}
+		}
+	}
+	trianglesCount = Int32(indexes.size() / 3);
+	create_packed_triangles();
+	create_opacity_micromaps(resourceManager.get_textures());
+
+	const DynamicArray<Instance>& sceneInstances = resourceManager.get_instances();
+	instances.reserve(sceneInstances.size());
+	for (const Instance& sceneInstance : sceneInstances)
+	{
+		const BottomLevelTree& tree = bottomLevelTrees[sceneInstance.model.id];
+		if (tree.indexesCount == 0)
+		{
+			continue;
+		}
+
+		GPUInstance& instance = instances.emplace_back();
+		instance.objectToWorld = sceneInstance.transform;
+		instance.worldToObject = glm::inverse(sceneInstance.transform);
+		instance.rootId		   = tree.nodesOffset + tree.bvh.rootId;
+		instance.wideRootId	   = tree.wideNodesOffset;
+		instance.modelId	   = sceneInstance.model.id;
+		instance.lightsOffset  = 0;
+	}
+	create_top_level_tree();
+	SPDLOG_INFO("Scene has {} instances of {} models, triangle references: {}", instances.size(), models.size(), trianglesCount);
+	create_lights(resourceManager.get_textures());
+	// Storage buffer can't be empty, its only texel isn't sampled for black environment
+	environmentTexels.assign(1, { 0.0f, 1.0f, 0 });
+	environmentProbability = 0.0f;
+	// Environment map is the last loaded texture, same as in raytrace manager
+	if (!resourceManager.get_textures().empty())
+	{
+		create_environment_alias_table(resourceManager.get_textures().back());
+	}
+}
+
+Void RaytraceScene::get_model_geometry(const Model& model, DynamicArray<Vertex>& vertexes, DynamicArray<UInt32>& indexes)
+{
+	SResourceManager& resourceManager = SResourceManager::get();
+	vertexes.clear();
+	indexes.clear();
+	for (UInt64 i = 0; i < model.meshes.size(); ++i)
+	{
+		const Mesh& mesh = resourceManager.get_mesh_by_handle(model.meshes[i]);
+		const UInt32 vertexesOffset = UInt32(vertexes.size());
+		for (UInt64 j = 0; j < mesh.positions.size(); ++j)
+		{
+			Vertex& vertex = vertexes.emplace_back();
+			vertex.position   = mesh.positions[j];
+			vertex.normal	  = mesh.normals[j];
+			vertex.uv		  = mesh.uvs[j];
+			vertex.materialId = model.materials[i].id;
+		}
+		for (const UInt32 index : mesh.indexes)
+		{
+			indexes.emplace_back(index + vertexesOffset);
+		}
+	}
+}
+
+RefitRanges RaytraceScene::refit()
+{
+	RefitRanges ranges;
+	for (BottomLevelTree& tree : bottomLevelTrees)
+	{
+		refit_tree(tree, ranges);
+	}
+	update_refitted_scene(ranges);
+	return ranges;
+}
+
+RefitRanges RaytraceScene::set_model_positions(Int32 modelId, const DynamicArray<FVector3>& positions)
+{
+	if (modelId < 0 || modelId >= Int32(bottomLevelTrees.size()))
+	{
+		SPDLOG_ERROR("Invalid model id: {}", modelId);
+		return {};
+	}
+
+	BottomLevelTree& tree = bottomLevelTrees[modelId];
+	if (Int32(positions.size()) != tree.vertexesCount)
+	{
+		SPDLOG_ERROR("Model {} has {} vertexes, but {} positions were given", modelId, tree.vertexesCount, positions.size());
+		return {};
+	}
+
+	for (Int32 i = 0; i < tree.vertexesCount; ++i)
+	{
+		vertexes[tree.vertexesOffset + i].position = positions[i];
+	}
+	RefitRanges ranges;
+	refit_tree(tree, ranges);
+	update_refitted_scene(ranges);
+	return ranges;
+}
+
+Void RaytraceScene::refit_tree(BottomLevelTree& tree, RefitRanges& ranges)
+{
+	if (tree.indexesCount == 0)
+	{
+		return;
+	}
+
+	// Vertex can move within box of its leaf, then no node changes, but its triangles and lights still do
+	merge_range(ranges.vertexes, { tree.vertexesOffset, tree.vertexesOffset + tree.vertexesCount });
+	const Pair<Int32, Int32> trianglesRange = { tree.indexesOffset / 3, (tree.indexesOffset + tree.indexesCount) / 3 };
+	pack_triangles(trianglesRange.first, trianglesRange.second);
+	merge_range(ranges.packedTriangles, trianglesRange);
+	ranges.haveLightsChanged |= !tree.emissionTriangleIds.empty();
+
+	const Pair<Int32, Int32> treeRange = tree.bvh.refit(vertexes, indexes, tree.indexesOffset);
+	if (treeRange.first == treeRange.second)
+	{
+		return;
+	}
+
+	// Topology is the same, so octant links stay valid, only order of some children may be less accurate
+	tree.bvh.refit_wide_tree(vertexes, indexes, tree.wideHierarchy, tree.indexesOffset);
+	DynamicArray<CompressedBVHNode> modelCompressedHierarchy;
+	tree.bvh.create_compressed_tree(tree.wideHierarchy, modelCompressedHierarchy);
+	tree.bvh.copy_tree(bottomLevelNodes, tree.nodesOffset, tree.indexesOffset);
+	tree.bvh.copy_wide_tree(tree.wideHierarchy, wideHierarchy, tree.wideNodesOffset, tree.indexesOffset);
+	tree.bvh.copy_wide_tree(modelCompressedHierarchy, compressedHierarchy, tree.wideNodesOffset, tree.indexesOffset);
+	merge_range(ranges.nodes, { tree.nodesOffset + treeRange.first, tree.nodesOffset + treeRange.second });
+	merge_range(ranges.wideNodes, { tree.wideNodesOffset, tree.wideNodesOffset + Int32(tree.wideHierarchy.size()) });
+	// Bounds of instances are taken from roots, which change with any of their descendants
+	ranges.hasTopLevelTreeChanged = true;
+}
+
+Void RaytraceScene::update_refitted_scene(const RefitRanges& ranges)
+{
+	if (ranges.hasTopLevelTreeChanged)
+	{
+		create_top_level_tree();
+	}
+	if (ranges.haveLightsChanged)
+	{
+		create_light_alias_table();
+		create_light_tree();
+	}
+}
+
+Void RaytraceScene::set_instance_transform(Int32 instanceId, const FMatrix4& transform)
+{
+	GPUInstance& instance = instances[instanceId];
+	instance.objectToWorld = transform;
+	instance.worldToObject = glm::inverse(transform);
+	create_top_level_tree();
+	create_light_alias_table();
+	create_light_tree();
+}
+
+Void RaytraceScene::benchmark_bvh() const
+{
+	// Trees of models are measured on their own, the largest one is the most representative
+	const BottomLevelTree* largestTree = nullptr;
+	for (const BottomLevelTree& tree : bottomLevelTrees)
+	{
+		if (largestTree == nullptr || tree.indexesCount > largestTree->indexesCount)
+		{
+			largestTree = &tree;
+		}
+	}
+	if (largestTree == nullptr || largestTree->indexesCount == 0)
+	{
+		return;
+	}
+
+	SPDLOG_INFO("Benchmark of the largest model, triangle references: {}", largestTree->indexesCount / 3);
+	const DynamicArray<UInt32> modelIndexes(indexes.begin() + largestTree->indexesOffset,
+											indexes.begin() + largestTree->indexesOffset + largestTree->indexesCount);
+	const BVHTraversal traversal(vertexes, modelIndexes);
+	traversal.benchmark(largestTree->bvh, BENCHMARK_RAYS_COUNT);
+	PacketTraversal(vertexes, modelIndexes).benchmark(largestTree->bvh);
+
+	// Both builders get the same unique triangles, so spatial splits are compared with object splits only
+	DynamicArray<UInt32> objectIndexes;
+	for (const Int32 triangleId : get_unique_triangles(largestTree->indexesOffset, largestTree->indexesCount))
+	{
+		objectIndexes.insert(objectIndexes.end(), indexes.begin() + triangleId, indexes.begin() + triangleId + 3);
+	}
+	DynamicArray<UInt32> spatialIndexes = objectIndexes;
+	BVHBuilder objectTree, spatialTree;
+	objectTree.buildMode = EBVHBuildMode::BinnedSAH;
+	spatialTree.buildMode = EBVHBuildMode::SpatialSAH;
+	objectTree.create_tree(vertexes, objectIndexes);
+	spatialTree.create_tree(vertexes, spatialIndexes);
+	const Float32 objectCost = objectTree.calculate_sah_cost();
+	const Float32 spatialCost = spatialTree.calculate_sah_cost();
+	SPDLOG_INFO("SAH cost, object splits: {:.2f}, spatial splits: {:.2f} ({:.1f}% lower), duplication factor: {:.3f}",
+				objectCost,
+				spatialCost,
+				objectCost > 0.0f ? 100.0f * (objectCost - spatialCost) / objectCost : 0.0f,
+				spatialTree.get_duplication_factor());
+}
+
+Bool RaytraceScene::is_wide_stack_enough() const
+{
+	return 3 * wideTreeDepth + 1 <= WIDE_STACK_SIZE;
+}
+
+DynamicArray<Int32> RaytraceScene::get_unique_triangles(Int32 indexesOffset, Int32 indexesCount) const
+{
+	// Triangle is identified by its indexes, copies made by spatial splits have the same ones
+	DynamicArray<Pair<Array<UInt32, 3>, Int32>> triangles;
+	triangles.reserve(indexesCount / 3);
+	for (Int32 triangleId = indexesOffset; triangleId < indexesOffset + indexesCount; triangleId += 3)
+	{
+		triangles.push_back({ { indexes[triangleId], indexes[triangleId + 1], indexes[triangleId + 2] }, triangleId });
+	}
+	std::sort(triangles.begin(), triangles.end());
+
+	DynamicArray<Int32> triangleIds;
+	triangleIds.reserve(triangles.size());
+	for (UInt64 i = 0; i < triangles.size(); ++i)
+	{
+		if (i == 0 || triangles[i].first != triangles[i - 1].first)
+		{
+			triangleIds.push_back(triangles[i].second);
+		}
+	}
+	std::sort(triangleIds.begin(), triangleIds.end());
+	return triangleIds;
+}
+
+Void RaytraceScene::create_packed_triangles()
+{
+	packedTriangles.resize(indexes.size() / 3);
+	pack_triangles(0, Int32(packedTriangles.size()));
+}
+
+Void RaytraceScene::pack_triangles(Int32 first, Int32 end)
+{
+	// Edges are the same differences intersection computed from vertexes, so hits don't change
+	// Opacity and lights don't depend on positions, so refit keeps them
+	for (Int32 i = first; i < end; ++i)
+	{
+		const Vertex& v1 = vertexes[indexes[i * 3 + 0]];
+		const Vertex& v2 = vertexes[indexes[i * 3 + 1]];
+		const Vertex& v3 = vertexes[indexes[i * 3 + 2]];
+		PackedTriangle& triangle = packedTriangles[i];
+		triangle.vertex		= v1.position;
+		triangle.materialId = v1.materialId;
+		triangle.edge1		= v2.position - v1.position;
+		triangle.edge2		= v3.position - v1.position;
+	}
+}
+
+Void RaytraceScene::create_lights(const DynamicArray<Texture>& textures)
+{
+	emittedPowers.assign(materials.size(), 0.0f);
+	for (UInt64 i = 0; i < materials.size(); ++i)
+	{
+		if (materials[i].emission != Handle<Texture>::sNone.id)
+		{
+			emittedPowers[i] = get_emitted_power(textures[materials[i].emission]);
+		}
+	}
+
+	// Spatial splits copy triangle into several leaves, every copy has to find the same light when it is hit
+	for (PackedTriangle& triangle : packedTriangles)
+	{
+		triangle.lightId = -1;
+	}
+	for (const BottomLevelTree& tree : bottomLevelTrees)
+	{
+		std::map<Array<UInt32, 3>, Int32> lightIds;
+		for (Int32 lightId = 0; lightId < Int32(tree.emissionTriangleIds.size()); ++lightId)
+		{
+			const Int32 triangleId = tree.emissionTriangleIds[lightId];
+			lightIds[{ indexes[triangleId], indexes[triangleId + 1], indexes[triangleId + 2] }] = lightId;
+		}
+		if (lightIds.empty())
+		{
+			continue;
+		}
+
+		for (Int32 triangleId = tree.indexesOffset; triangleId < tree.indexesOffset + tree.indexesCount; triangleId += 3)
+		{
+			const auto light = lightIds.find({ indexes[triangleId], indexes[triangleId + 1], indexes[triangleId + 2] });
+			if (light != lightIds.end())
+			{
+				packedTriangles[triangleId / 3].lightId = light->second;
+			}
+		}
+	}
+
+	// Emissive triangle of model is light source in every instance of it
+	emissionTriangles.clear();
+	for (Int32 instanceId = 0; instanceId < Int32(instances.size()); ++instanceId)
+	{
+		instances[instanceId].lightsOffset = Int32(emissionTriangles.size());
+		for (const Int32 triangleId : bottomLevelTrees[instances[instanceId].modelId].emissionTriangleIds)
+		{
+			emissionTriangles.push_back({ triangleId, instanceId });
+		}
+	}
+	create_light_alias_table();
+	create_light_tree();
+	SPDLOG_INFO("Scene has {} lights", emissionTriangles.size());
+}
+
+Void RaytraceScene::create_light_alias_table()
+{
+	const Int32 lightsCount = Int32(emissionTriangles.size());
+	DynamicArray<Float64> weights(lightsCount);
+	Float64 weightsSum = 0.0;
+	for (Int32 lightId = 0; lightId < lightsCount; ++lightId)
+	{
+		EmissionTriangle& light = emissionTriangles[lightId];
+		const FMatrix4& objectToWorld = instances[light.instanceId].objectToWorld;
+		Array<FVector3, 3> points;
+		for (Int32 i = 0; i < 3; ++i)
+		{
+			points[i] = FVector3(objectToWorld * FVector4(vertexes[indexes[light.triangleId + i]].position, 1.0f));
+		}
+		light.area = 0.5f * glm::length(glm::cross(points[1] - points[0], points[2] - points[0]));
+		weights[lightId] = Float64(light.area) * Float64(emittedPowers[vertexes[indexes[light.triangleId]].materialId]);
+		weightsSum += weights[lightId];
+	}
+
+	// Black lights are never sampled, unless all of them are black, then every one is equally likely
+	if (weightsSum <= 0.0)
+	{
+		weights.assign(lightsCount, 1.0);
+		weightsSum = Float64(lightsCount);
+	}
+
+	DynamicArray<Float32> aliasProbabilities;
+	DynamicArray<Int32> aliasIds;
+	create_alias_table(weights, weightsSum, aliasProbabilities, aliasIds);
+	for (Int32 lightId = 0; lightId < lightsCount; ++lightId)
+	{
+		emissionTriangles[lightId].probability = Float32(weights[lightId] / weightsSum);
+		emissionTriangles[lightId].aliasProbability = aliasProbabilities[lightId];
+		emissionTriangles[lightId].aliasId = aliasIds[lightId];
+	}
+}
+
+Void RaytraceScene::create_environment_alias_table(const Texture& texture)
+{
+	if (texture.data == nullptr || texture.type != ETextureType::HDR)
+	{
+		return;
+	}
+
+	// Texels are spread over sphere by equirectangular mapping, so their solid angles shrink with sine towards poles
+	constexpr Float64 PI = 3.1415926535897932384626433832795;
+	const Float32* data = reinterpret_cast<const Float32*>(texture.data);
+	const FVector3 luminanceWeights(0.2126f, 0.7152f, 0.0722f);
+	const Int32 texelsCount = texture.size.x * texture.size.y;
+	DynamicArray<Float64> weights(texelsCount);
+	Float64 weightsSum = 0.0;
+	for (Int32 y = 0; y < texture.size.y; ++y)
+	{
+		const Float64 sine = std::sin((Float64(y) + 0.5) / Float64(texture.size.y) * PI);
+		for (Int32 x = 0; x < texture.size.x; ++x)
+		{
+			const Int32 texelId = y * texture.size.x + x;
+			const FVector3 color = FVector3(data[texelId * 4], data[texelId * 4 + 1], data[texelId * 4 + 2]);
+			weights[texelId] = Float64(glm::max(glm::dot(color, luminanceWeights), 0.0f)) * sine;
+			weightsSum += weights[texelId];
+		}
+	}
+
+	// Black environment isn't sampled at all
+	if (weightsSum <= 0.0)
+	{
+		return;
+	}
+
+	DynamicArray<Float32> aliasProbabilities;
+	DynamicArray<Int32> aliasIds;
+	create_alias_table(weights, weightsSum, aliasProbabilities, aliasIds);
+	environmentTexels.resize(texelsCount);
+	environmentProbability = emissionTriangles.empty() ? 1.0f : ENVIRONMENT_PROBABILITY;
+	for (Int32 texelId = 0; texelId < texelsCount; ++texelId)
+	{
+		environmentTexels[texelId].probability = Float32(weights[texelId] / weightsSum);
+		environmentTexels[texelId].aliasProbability = aliasProbabilities[texelId];
+		environmentTexels[texelId].aliasId = aliasIds[texelId];
+	}
+	SPDLOG_INFO("Environment map {} is sampled by luminance of {} texels", texture.name, texelsCount);
+}
+
+Void RaytraceScene::create_alias_table(const DynamicArray<Float64>& weights, Float64 weightsSum, DynamicArray<Float32>& aliasProbabilities, DynamicArray<Int32>& aliasIds)
+{
+	// Vose's method, every entry of table is split between its outcome and one heavier outcome
+	const Int32 entriesCount = Int32(weights.size());
+	aliasProbabilities.resize(entriesCount);
+	aliasIds.resize(entriesCount);
+	DynamicArray<Float64> scaledWeights(entriesCount);
+	DynamicArray<Int32> entryIds[2];
+	for (Int32 entryId = 0; entryId < entriesCount; ++entryId)
+	{
+		scaledWeights[entryId] = weights[entryId] * Float64(entriesCount) / weightsSum;
+		entryIds[scaledWeights[entryId] < 1.0 ? 0 : 1].push_back(entryId);
+	}
+	while (!entryIds[0].empty() && !entryIds[1].empty())
+	{
+		const Int32 smallId = entryIds[0].back();
+		const Int32 largeId = entryIds[1].back();
+		entryIds[0].pop_back();
+		aliasProbabilities[smallId] = Float32(scaledWeights[smallId]);
+		aliasIds[smallId] = largeId;
+		scaledWeights[largeId] -= 1.0 - scaledWeights[smallId];
+		if (scaledWeights[largeId] < 1.0)
+		{
+			entryIds[1].pop_back();
+			entryIds[0].push_back(largeId);
+		}
+	}
+
+	// Remaining entries are full up to rounding errors
+	for (const DynamicArray<Int32>& remainingIds : entryIds)
+	{
+		for (const Int32 entryId : remainingIds)
+		{
+			aliasProbabilities[entryId] = 1.0f;
+			aliasIds[entryId] = entryId;
+		}
+	}
+}
+
+Void RaytraceScene::create_light_tree()
+{
+	DynamicArray<LightBounds> lights(emissionTriangles.size());
+	for (UInt64 lightId = 0; lightId < emissionTriangles.size(); ++lightId)
+	{
+		const EmissionTriangle& light = emissionTriangles[lightId];
+		const GPUInstance& instance = instances[light.instanceId];
+		const FMatrix3 normalToWorld = glm::transpose(FMatrix3(instance.worldToObject));
+		LightBounds& bounds = lights[lightId];
+		bounds.min = FVector3(Limits<Float32>::max());
+		bounds.max = FVector3(-Limits<Float32>::max());
+		Array<FVector3, 3> normals;
+		FVector3 normalsSum = FVector3(0.0f);
+		for (Int32 i = 0; i < 3; ++i)
+		{
+			const Vertex& vertex = vertexes[indexes[light.triangleId + i]];
+			const FVector3 point = FVector3(instance.objectToWorld * FVector4(vertex.position, 1.0f));
+			bounds.min = glm::min(bounds.min, point);
+			bounds.max = glm::max(bounds.max, point);
+			normals[i] = glm::normalize(normalToWorld * vertex.normal);
+			normalsSum += normals[i];
+		}
+
+		// Front face follows interpolated normal, so cone holds normals of all vertexes
+		bounds.axis = FVector3(0.0f, 1.0f, 0.0f);
+		bounds.normalAngle = LightTree::WHOLE_SPHERE_ANGLE;
+		if (glm::length(normalsSum) > 1e-3f)
+		{
+			bounds.axis = glm::normalize(normalsSum);
+			bounds.normalAngle = 0.0f;
+			for (const FVector3& normal : normals)
+			{
+				bounds.normalAngle = glm::max(bounds.normalAngle, std::acos(glm::clamp(glm::dot(bounds.axis, normal), -1.0f, 1.0f)));
+			}
+		}
+		bounds.power = light.probability;
+	}
+
+	lightTree.create_tree(lights);
+	for (UInt64 lightId = 0; lightId < emissionTriangles.size(); ++lightId)
+	{
+		emissionTriangles[lightId].nodeId = lightTree.leafIds[lightId];
+	}
+}
+
+Float32 RaytraceScene::get_emitted_power(const Texture& texture) const
+{
+	if (texture.data == nullptr)
+	{
+		return 1.0f;
+	}
+
+	// Texels have four channels, HDR ones are floats
+	const Bool isHDR = texture.type == ETextureType::HDR;
+	const FVector3 luminanceWeights(0.2126f, 0.7152f, 0.0722f);
+	const UInt64 texelsCount = UInt64(texture.size.x) * UInt64(texture.size.y);
+	Float64 luminanceSum = 0.0;
+	for (UInt64 i = 0; i < texelsCount; ++i)
+	{
+		FVector3 color;
+		if (isHDR)
+		{
+			const Float32* data = reinterpret_cast<const Float32*>(texture.data);
+			color = FVector3(data[i * 4], data[i * 4 + 1], data[i * 4 + 2]);
+		} else {
+			color = FVector3(texture.data[i * 4], texture.data[i * 4 + 1], texture.data[i * 4 + 2]) / 255.0f;
+		}
+		luminanceSum += Float64(glm::dot(color, luminanceWeights));
+	}
+	return texelsCount > 0 ? Float32(luminanceSum / Float64(texelsCount)) : 1.0f;
+}
+
+Void RaytraceScene::create_opacity_micromaps(const DynamicArray<Texture>& textures)
+{
+	// Triangles are grouped by albedo, so only one table of texture is kept at once
+	std::map<Int32, DynamicArray<Int32>> mixedTriangles;
+	for (Int32 i = 0; i < Int32(packedTriangles.size()); ++i)
+	{
+		packedTriangles[i].opacityId = OPAQUE_TRIANGLE;
+		const Int32 materialId = packedTriangles[i].materialId;
+		if (materials[materialId].albedo != Handle<Texture>::sNone.id)
+		{
+			mixedTriangles[materials[materialId].albedo].push_back(i);
+		}
+	}
+
+	opacityMicromaps.clear();
+	Array<Int32, UInt64(EOpacity::Count)> trianglesCounts = {};
+	for (const auto& [textureId, triangleIds] : mixedTriangles)
+	{
+		OpacityTable table;
+		EOpacity textureOpacity = EOpacity::Mixed;
+		if (create_opacity_table(textures[textureId], table))
+		{
+			textureOpacity = get_opacity(table, FVector2(0.0f), FVector2(1.0f));
+		}
+		for (GPUMaterial& material : materials)
+		{
+			if (material.albedo == textureId)
+			{
+				material.opacity = Int32(textureOpacity);
+			}
+		}
+
+		for (const Int32 triangleId : triangleIds)
+		{
+			PackedTriangle& triangle = packedTriangles[triangleId];
+			OpacityMicromap micromap = {};
+			EOpacity opacity = textureOpacity;
+			if (textureOpacity == EOpacity::Mixed && !table.notOpaqueCounts.empty())
+			{
+				opacity = get_triangle_opacity(table, triangleId * 3, micromap);
+			}
+			trianglesCounts[UInt64(opacity)]++;
+
+			if (opacity == EOpacity::Transparent)
+			{
+				triangle.opacityId = TRANSPARENT_TRIANGLE;
+				continue;
+			}
+			if (opacity == EOpacity::Mixed)
+			{
+				// Texture without table can't be classified, so every micro triangle of it is mixed
+				if (table.notOpaqueCounts.empty())
+				{
+					micromap.states.fill(0xAAAAAAAAU);
+				}
+				triangle.opacityId = Int32(opacityMicromaps.size());
+				opacityMicromaps.push_back(micromap);
+			}
+		}
+	}
+	trianglesCounts[UInt64(EOpacity::Opaque)] += Int32(packedTriangles.size()) - trianglesCounts[0] - trianglesCounts[1] - trianglesCounts[2];
+	SPDLOG_INFO("Opacity of triangles, opaque: {}, transparent: {}, with micromaps: {}",
+				trianglesCounts[UInt64(EOpacity::Opaque)],
+				trianglesCounts[UInt64(EOpacity::Transparent)],
+				trianglesCounts[UInt64(EOpacity::Mixed)]);
+
+	// Storage buffer can't be empty
+	if (opacityMicromaps.empty())
+	{
+		opacityMicromaps.emplace_back();
+	}
+}
+
+Bool RaytraceScene::create_opacity_table(const Texture& texture, OpacityTable& table) const
+{
+	if (texture.data == nullptr || texture.channels != 4 || texture.type == ETextureType::HDR)
+	{
+		return false;
+	}
+
+	// Filtering mixes texels, so ones one level away from cutoff can't cross it
+	const UInt8 minOpaqueAlpha = UInt8(glm::ceil(MIN_ALPHA * 255.0f)) + 1U;
+	const UInt8 maxTransparentAlpha = UInt8(glm::floor(MIN_ALPHA * 255.0f)) - 1U;
+	table.size = texture.size;
+	const UInt64 rowSize = UInt64(table.size.x) + 1ULL;
+	table.notOpaqueCounts.assign(rowSize * (UInt64(table.size.y) + 1ULL), 0U);
+	table.notTransparentCounts.assign(table.notOpaqueCounts.size(), 0U);
+	for (Int32 y = 0; y < table.size.y; ++y)
+	{
+		UInt32 notOpaqueCount = 0U;
+		UInt32 notTransparentCount = 0U;
+		for (Int32 x = 0; x < table.size.x; ++x)
+		{
+			const UInt8 alpha = texture.data[(UInt64(y) * UInt64(table.size.x) + UInt64(x)) * 4ULL + 3ULL];
+			notOpaqueCount += alpha < minOpaqueAlpha ? 1U : 0U;
+			notTransparentCount += alpha > maxTransparentAlpha ? 1U : 0U;
+			const UInt64 id = (UInt64(y) + 1ULL) * rowSize + UInt64(x) + 1ULL;
+			table.notOpaqueCounts[id] = table.notOpaqueCounts[id - rowSize] + notOpaqueCount;
+			table.notTransparentCounts[id] = table.notTransparentCounts[id - rowSize] + notTransparentCount;
+		}
+	}
+	return true;
+}
+
+EOpacity RaytraceScene::get_opacity(const OpacityTable& table, const FVector2& uvMin, const FVector2& uvMax) const
+{
+	if (!std::isfinite(uvMin.x) || !std::isfinite(uvMin.y) || !std::isfinite(uvMax.x) || !std::isfinite(uvMax.y))
+	{
+		return EOpacity::Mixed;
+	}
+
+	// Texture repeats, so range of texels wraps into at most two ranges on every axis
+	Array<Array<IVector2, 2>, 2> ranges;
+	Array<Int32, 2> rangesCounts;
+	for (Int32 axis = 0; axis < 2; ++axis)
+	{
+		const Int32 size = table.size[axis];
+		const Int64 first = Int64(std::floor(Float64(uvMin[axis]) * Float64(size) - 0.5)) - 1LL;
+		const Int64 last = Int64(std::floor(Float64(uvMax[axis]) * Float64(size) - 0.5)) + 2LL;
+		if (last - first + 1LL >= Int64(size))
+		{
+			ranges[axis][0] = { 0, size - 1 };
+			rangesCounts[axis] = 1;
+			continue;
+		}
+
+		const Int32 begin = Int32(((first % size) + size) % size);
+		const Int32 length = Int32(last - first + 1LL);
+		if (begin + length <= size)
+		{
+			ranges[axis][0] = { begin, begin + length - 1 };
+			rangesCounts[axis] = 1;
+		} else {
+			ranges[axis][0] = { begin, size - 1 };
+			ranges[axis][1] = { 0, begin + length - 1 - size };
+			rangesCounts[axis] = 2;
+		}
+	}
+
+	const UInt64 rowSize = UInt64(table.size.x) + 1ULL;
+	UInt32 notOpaqueCount = 0U;
+	UInt32 notTransparentCount = 0U;
+	for (Int32 i = 0; i < rangesCounts[0]; ++i)
+	{
+		for (Int32 j = 0; j < rangesCounts[1]; ++j)
+		{
+			const IVector2& rangeX = ranges[0][i];
+			const IVector2& rangeY = ranges[1][j];
+			const UInt64 minCorner = UInt64(rangeY.x) * rowSize + UInt64(rangeX.x);
+			const UInt64 maxCorner = (UInt64(rangeY.y) + 1ULL) * rowSize + UInt64(rangeX.y) + 1ULL;
+			const UInt64 minXCorner = (UInt64(rangeY.y) + 1ULL) * rowSize + UInt64(rangeX.x);
+			const UInt64 minYCorner = UInt64(rangeY.x) * rowSize + UInt64(rangeX.y) + 1ULL;
+			notOpaqueCount += table.notOpaqueCounts[maxCorner] - table.notOpaqueCounts[minXCorner]
+							- table.notOpaqueCounts[minYCorner] + table.notOpaqueCounts[minCorner];
+			notTransparentCount += table.notTransparentCounts[maxCorner] - table.notTransparentCounts[minXCorner]
+								 - table.notTransparentCounts[minYCorner] + table.notTransparentCounts[minCorner];
+		}
+	}
+
+	if (notOpaqueCount == 0U)
+	{
+		return EOpacity::Opaque;
+	}
+	return notTransparentCount == 0U ? EOpacity::Transparent : EOpacity::Mixed;
+}
+
+EOpacity RaytraceScene::get_triangle_opacity(const OpacityTable& table, Int32 triangleId, OpacityMicromap& micromap) const
+{
+	// Rows go along second barycentric, every row has upright micro triangles and inverted ones between them
+	const Array<FVector2, 3> uvs = { vertexes[indexes[triangleId]].uv, vertexes[indexes[triangleId + 1]].uv, vertexes[indexes[triangleId + 2]].uv };
+	const Float32 step = 1.0f / Float32(MICROMAP_SUBDIVISION);
+	Array<Int32, UInt64(EOpacity::Count)> counts = {};
+	Int32 microTriangleId = 0;
+	for (Int32 row = 0; row < MICROMAP_SUBDIVISION; ++row)
+	{
+		for (Int32 column = 0; column < MICROMAP_SUBDIVISION - row; ++column)
+		{
+			for (Int32 inverted = 0; inverted < (column + row < MICROMAP_SUBDIVISION - 1 ? 2 : 1); ++inverted)
+			{
+				const Array<FVector2, 3> barycentrics = { FVector2(Float32(column + inverted), Float32(row)) * step,
+														  FVector2(Float32(column), Float32(row + 1)) * step,
+														  FVector2(Float32(column + 1), Float32(row + inverted)) * step };
+				FVector2 uvMin(std::numeric_limits<Float32>::max());
+				FVector2 uvMax(-std::numeric_limits<Float32>::max());
+				for (const FVector2& barycentric : barycentrics)
+				{
+					const FVector2 uv = uvs[0] * (1.0f - barycentric.x - barycentric.y) + uvs[1] * barycentric.x + uvs[2] * barycentric.y;
+					uvMin = glm::min(uvMin, uv);
+					uvMax = glm::max(uvMax, uv);
+				}
+
+				const EOpacity opacity = get_opacity(table, uvMin, uvMax);
+				micromap.states[microTriangleId / 16] |= UInt32(opacity) << ((microTriangleId % 16) * 2);
+				counts[UInt64(opacity)]++;
+				microTriangleId++;
+			}
+		}
+	}
+
+	if (counts[UInt64(EOpacity::Opaque)] == MICRO_TRIANGLES_COUNT)
+	{
+		return EOpacity::Opaque;
+	}
+	return counts[UInt64(EOpacity::Transparent)] == MICRO_TRIANGLES_COUNT ? EOpacity::Transparent : EOpacity::Mixed;
+}
+
+Void RaytraceScene::create_top_level_tree()
+{
+	DynamicArray<FVector3> instancesMin(instances.size());
+	DynamicArray<FVector3> instancesMax(instances.size());
+	for (UInt64 i = 0; i < instances.size(); ++i)
+	{
+		const GPUInstance& instance = instances[i];
+		const BVHBuilder& bvh = bottomLevelTrees[instance.modelId].bvh;
+		const BVHNode& root = bvh.hierarchy[bvh.rootId];
+
+		// World box has to contain all transformed corners of object box
+		instancesMin[i] = FVector3(Limits<Float32>::max());
+		instancesMax[i] = FVector3(-Limits<Float32>::max());
+		for (Int32 corner = 0; corner < 8; ++corner)
+		{
+			const FVector3 point((corner & 1) ? root.max.x : root.min.x,
+								 (corner & 2) ? root.max.y : root.min.y,
+								 (corner & 4) ? root.max.z : root.min.z);
+			const FVector3 worldPoint = FVector3(instance.objectToWorld * FVector4(point, 1.0f));
+			instancesMin[i] = glm::min(instancesMin[i], worldPoint);
+			instancesMax[i] = glm::max(instancesMax[i], worldPoint);
+		}
+	}
+	topLevelTree.create_instance_tree(instancesMin, instancesMax);
+}
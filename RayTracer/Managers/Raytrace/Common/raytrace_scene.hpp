@@ -0,0 +1,236 @@
+#pragma once
+#include "bvh_builder.hpp"
+#include "light_tree.hpp"
+
+struct Vertex;
+struct Texture;
+struct Model;
+
+/** Alpha of albedo under material, triangle or micro triangle compared to cutoff, only mixed ones sample texture during traversal */
+enum class EOpacity : UInt8
+{
+	Opaque = 0U,
+	Transparent,
+	Mixed,
+	Count
+};
+
+/** How lambertian bounces find lights, the heuristics weight shadow ray to sampled light against cosine sampled bounce */
+enum class ELightSampling : UInt8
+{
+	// One continuation ray, which follows light or cosine sampling with the same probability
+	Mixture = 0U,
+	BalanceHeuristic,
+	PowerHeuristic,
+	Count
+};
+
+/** How light is chosen for light sampling, tree prefers lights close to shading point and facing it */
+enum class ELightSelection : UInt8
+{
+	// Constant time, by power only
+	AliasTable = 0U,
+	LightTree,
+	Count
+};
+
+struct GPUMaterial
+{
+	Int32 albedo;
+	Int32 normal;
+	Int32 roughness;
+	Int32 metalness;
+
+	Int32 emission;
+	Float32 indexOfRefraction;
+	// Opacity of the whole albedo, triangles are classified only for mixed materials
+	Int32 opacity;
+};
+
+/** Model placed in scene, rays are transformed into object space of its bottom level tree */
+struct GPUInstance
+{
+	FMatrix4 objectToWorld;
+	FMatrix4 worldToObject;
+	Int32 rootId;
+	Int32 wideRootId;
+	Int32 modelId;
+	// Emissive triangles of model are lights of instance from that one in order of their light ids
+	Int32 lightsOffset;
+};
+
+/** Light source is triangle of model in one of its instances, lights are entries of alias table for sampling in constant time */
+struct EmissionTriangle
+{
+	Int32 triangleId;
+	Int32 instanceId;
+	// Light is kept with that probability, otherwise its alias is sampled
+	Float32 aliasProbability;
+	Int32 aliasId;
+	// Probability of sampling light, proportional to its area and emitted power
+	Float32 probability;
+	// World area, points are sampled uniformly on it
+	Float32 area;
+	// Leaf of light tree
+	Int32 nodeId;
+	Int32 padding;
+};
+
+/** Texel of HDR environment map is entry of alias table, so environment is sampled as light in constant time */
+struct EnvironmentTexel
+{
+	// Proportional to luminance times solid angle of texel, directions within texel are uniform in texture space
+	Float32 probability;
+	Float32 aliasProbability;
+	Int32 aliasId;
+};
+
+/** Positions of triangle for intersection tests only, normals and uvs are read from vertexes after hit */
+struct PackedTriangle
+{
+	FVector3 vertex;
+	Int32 materialId;
+	FVector3 edge1;
+	// Opaque or transparent triangle, otherwise opacity micromap of mixed one
+	Int32 opacityId;
+	FVector3 edge2;
+	// Light among lights of model for emissive triangle, otherwise -1
+	Int32 lightId;
+};
+
+/** Two bit opacity of every micro triangle, triangle is split into 8 rows of them in barycentric space */
+struct OpacityMicromap
+{
+	Array<UInt32, 4> states;
+};
+
+/** Ranges [first, end) of scene buffers, which were changed by refit, empty ones don't have to be uploaded */
+struct RefitRanges
+{
+	Pair<Int32, Int32> vertexes = { 0, 0 };
+	Pair<Int32, Int32> packedTriangles = { 0, 0 };
+	Pair<Int32, Int32> nodes = { 0, 0 };
+	// Wide and compressed trees share offsets of nodes
+	Pair<Int32, Int32> wideNodes = { 0, 0 };
+	Bool hasTopLevelTreeChanged = false;
+	// Emission triangles and light tree are rebuilt as a whole
+	Bool haveLightsChanged = false;
+};
+
+/** Scene of resource manager in layout of raytrace shader buffers, it doesn't need device, so CPU tracer shares it */
+class RaytraceScene
+{
+public:
+	// Triangle hit is discarded below that alpha of albedo, same as in shader
+	static constexpr Float32 MIN_ALPHA = 0.2f;
+	static constexpr Int32 OPAQUE_TRIANGLE = -1;
+	static constexpr Int32 TRANSPARENT_TRIANGLE = -2;
+	static constexpr Int32 MICROMAP_SUBDIVISION = 8;
+	static constexpr Int32 MICRO_TRIANGLES_COUNT = MICROMAP_SUBDIVISION * MICROMAP_SUBDIVISION;
+	// Same as in shader, wide tree deeper than (WIDE_STACK_SIZE - 1) / 3 levels would overflow it
+	static constexpr Int32 WIDE_STACK_SIZE = 64;
+	// Roulette bounces count, which turns russian roulette off, same as in shader
+	static constexpr Int32 NO_ROULETTE = -1;
+	// Shadow ray goes to environment with that probability, when scene has lights too
+	static constexpr Float32 ENVIRONMENT_PROBABILITY = 0.5f;
+
+	/** Every model gets its own tree in object space, models without triangles have no instances */
+	Void create();
+	/** Meshes of model appended in order, its tree is built from them, so tools building trees get the same ones */
+	static Void get_model_geometry(const Model& model, DynamicArray<Vertex>& vertexes, DynamicArray<UInt32>& indexes);
+	/** Updates trees of all models after vertexes were moved */
+	RefitRanges refit();
+	/** Moves vertexes of model, positions are in order of its meshes, the same as in model, then only its tree is refitted */
+	RefitRanges set_model_positions(Int32 modelId, const DynamicArray<FVector3>& positions);
+	/** Moves instance, only top level tree is rebuilt */
+	Void set_instance_transform(Int32 instanceId, const FMatrix4& transform);
+	/** Compares CPU traversal of binary, wide and compressed trees and of ray packets on the largest model */
+	Void benchmark_bvh() const;
+	/** Traversal of wide tree pushes up to 3 internal children per level, so stack of shader has to hold the deepest model */
+	[[nodiscard]]
+	Bool is_wide_stack_enough() const;
+
+	DynamicArray<GPUMaterial> materials;
+	DynamicArray<Vertex> vertexes;
+	DynamicArray<UInt32> indexes;
+	// One per three indexes, triangle starting at index i is packed at i / 3
+	DynamicArray<PackedTriangle> packedTriangles;
+	DynamicArray<OpacityMicromap> opacityMicromaps;
+	DynamicArray<EmissionTriangle> emissionTriangles;
+	LightTree lightTree;
+	DynamicArray<EnvironmentTexel> environmentTexels;
+	// Zero for black environment or for one without HDR data, then shadow rays go to lights only
+	Float32 environmentProbability = 0.0f;
+	DynamicArray<GPUInstance> instances;
+	DynamicArray<BVHNode> bottomLevelNodes;
+	DynamicArray<BVHOctantLinks> octantLinks;
+	DynamicArray<BVH4Node> wideHierarchy;
+	DynamicArray<CompressedBVHNode> compressedHierarchy;
+	BVHBuilder topLevelTree;
+	Int32 trianglesCount = 0;
+	// The deepest wide tree of all models, topology stays the same after refit
+	Int32 wideTreeDepth = 0;
+
+private:
+	static constexpr Int32 BENCHMARK_RAYS_COUNT = 1 << 20;
+
+	/** Tree of one model in object space, stored in buffers shared by all models */
+	struct BottomLevelTree
+	{
+		BVHBuilder bvh;
+		DynamicArray<BVH4Node> wideHierarchy;
+		Int32 vertexesOffset;
+		Int32 vertexesCount;
+		Int32 indexesOffset;
+		Int32 indexesCount;
+		Int32 nodesOffset;
+		Int32 wideNodesOffset;
+		DynamicArray<Int32> emissionTriangleIds;
+	};
+
+	DynamicArray<BottomLevelTree> bottomLevelTrees;
+	// Emitted power of every material, only emissive ones are read
+	DynamicArray<Float32> emittedPowers;
+
+	Void create_top_level_tree();
+	/** Refits binary and wide trees of model and repacks its triangles, its changed ranges are merged into ranges */
+	Void refit_tree(BottomLevelTree& tree, RefitRanges& ranges);
+	/** Top level tree and lights are shared by all models, so they are rebuilt once after refit of them */
+	Void update_refitted_scene(const RefitRanges& ranges);
+	/** Counts of texels, which aren't opaque or aren't transparent, in every rectangle starting at origin */
+	struct OpacityTable
+	{
+		IVector2 size;
+		DynamicArray<UInt32> notOpaqueCounts;
+		DynamicArray<UInt32> notTransparentCounts;
+	};
+
+	Void create_packed_triangles();
+	/** Triangles in range [first, end) of packed triangles */
+	Void pack_triangles(Int32 first, Int32 end);
+	/** Lights of every instance, every reference of emissive triangle gets its light id */
+	Void create_lights(const DynamicArray<Texture>& textures);
+	/** Weights of lights are area times emitted power, so table is rebuilt after lights were moved */
+	Void create_light_alias_table();
+	/** Bounds of lights are taken in world space, so tree is rebuilt after lights were moved */
+	Void create_light_tree();
+	/** Weights of texels are their luminance times sine of polar angle of their row */
+	Void create_environment_alias_table(const Texture& texture);
+	/** Vose's method, weights don't need to be normalized */
+	static Void create_alias_table(const DynamicArray<Float64>& weights, Float64 weightsSum, DynamicArray<Float32>& aliasProbabilities, DynamicArray<Int32>& aliasIds);
+	/** Average luminance of emission texture, one without data emits as white */
+	[[nodiscard]]
+	Float32 get_emitted_power(const Texture& texture) const;
+	/** Material opacity is taken from its whole albedo, triangles of mixed materials get micromaps */
+	Void create_opacity_micromaps(const DynamicArray<Texture>& textures);
+	[[nodiscard]]
+	Bool create_opacity_table(const Texture& texture, OpacityTable& table) const;
+	/** Texels of bilinear filter anywhere in bounds of uvs, with one texel of margin for rounding */
+	[[nodiscard]]
+	EOpacity get_opacity(const OpacityTable& table, const FVector2& uvMin, const FVector2& uvMax) const;
+	[[nodiscard]]
+	EOpacity get_triangle_opacity(const OpacityTable& table, Int32 triangleId, OpacityMicromap& micromap) const;
+	/** First references of every triangle in range of indexes, spatial splits can reference it several times */
+	[[nodiscard]]
+	DynamicArray<Int32> get_unique_triangles(Int32 indexesOffset, Int32 indexesCount) const;
+};
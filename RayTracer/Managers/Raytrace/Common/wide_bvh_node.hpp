@@ -0,0 +1,22 @@
+#pragma once
+
+/** Node with Width children, bounds of all children are stored as structure of arrays to test them at once */
+template<Int32 Width>
+struct alignas(16) WideBVHNode
+{
+	static constexpr Int32 WIDTH = Width;
+
+	Array<Float32, Width> minX;
+	Array<Float32, Width> minY;
+	Array<Float32, Width> minZ;
+	Array<Float32, Width> maxX;
+	Array<Float32, Width> maxY;
+	Array<Float32, Width> maxZ;
+	// Wide node id for internal child, offset of first index for leaf child and -1 for empty slot
+	Array<Int32, Width> childIds;
+	// Zero for internal child and empty slot
+	Array<Int32, Width> primitiveCounts;
+};
+
+using BVH4Node = WideBVHNode<4>;
+using BVH8Node = WideBVHNode<8>;
@@ -7,16 +7,27 @@
 #include "../Display/display_manager.hpp"
 #include "../Render/Common/command_buffer.hpp"
 #include "../Resource/resource_manager.hpp"
-#include "../Resource/Common/model.hpp"
 #include "../Resource/Common/handle.hpp"
-#include "../Resource/Common/material.hpp"
-#include "../Resource/Common/mesh.hpp"
 #include "Common/vertex.hpp"
 
+#include <chrono>
 #include <imgui.h>
 #include <magic_enum.hpp>
 #include <GLFW/glfw3.h>
 
+namespace
+{
+	/** Empty range of refit isn't uploaded */
+	template<typename Type>
+	Void update_buffer_range(SRenderManager& renderManager, const DynamicArray<Type>& data, const Pair<Int32, Int32>& range, Handle<Buffer> handle)
+	{
+		if (range.first < range.second)
+		{
+			renderManager.update_static_buffer(data, UInt64(range.first), UInt64(range.second - range.first), handle);
+		}
+	}
+}
+
 
 SRaytraceManager& SRaytraceManager::get()
 {
@@ -27,7 +38,6 @@ SRaytraceManager& SRaytraceManager::get()
 Void SRaytraceManager::startup()
 {
 	SPDLOG_INFO("Raytrace Manager startup.");
-	SResourceManager& resourceManager = SResourceManager::get();
 	SDisplayManager& displayManager = SDisplayManager::get();
 	SRenderManager& renderManager = SRenderManager::get();
 	areRaysRegenerated = false;
@@ -45,92 +55,36 @@ Void SRaytraceManager::startup()
 
 	renderTime = 0.0f;
 	maxBouncesCount = 6;
+	rouletteBouncesCount = RaytraceScene::NO_ROULETTE;
+	bvhFormat = EBVHFormat::Binary;
+	lightSampling = ELightSampling::PowerHeuristic;
+	lightSelection = ELightSelection::LightTree;
 	frameLimit = 0;
 	frameCount = 0;
 	backgroundColor = { 0.0f, 0.0f, 0.0f };
 
-	materials.reserve(resourceManager.get_materials().size());
-	for (const Material& material : resourceManager.get_materials())
+	raytraceScene.create();
+	if (!raytraceScene.is_wide_stack_enough())
 	{
-		GPUMaterial& gpuMaterial = materials.emplace_back();
-		gpuMaterial.albedo	  = material.textures[UInt64(ETextureType::Albedo)].id;
-		gpuMaterial.normal	  = material.textures[UInt64(ETextureType::Normal)].id;
-
-		if (material.textures[UInt64(ETextureType::RM)].id == Handle<Texture>::sNone.id)
-		{
-			gpuMaterial.roughness = material.textures[UInt64(ETextureType::Roughness)].id;
-			gpuMaterial.metalness = material.textures[UInt64(ETextureType::Metalness)].id;
-		} else {
-			gpuMaterial.roughness = material.textures[UInt64(ETextureType::RM)].id;
-			gpuMaterial.metalness = material.textures[UInt64(ETextureType::RM)].id;
-		}
-
-		gpuMaterial.emission  = material.textures[UInt64(ETextureType::Emission)].id;
-		gpuMaterial.indexOfRefraction  = material.indexOfRefraction;
+		SPDLOG_ERROR("Wide trees of depth {} overflow shader stack, binary tree is traced instead", raytraceScene.wideTreeDepth);
 	}
 
-	UInt64 vertexesSize = 0;
-	UInt64 indexesSize = 0;
-
-	const DynamicArray<Model>& models = resourceManager.get_models();
-	for (const Model& model : models)
-	{
-		for (Handle<Mesh> handle : model.meshes)
-		{
-			const Mesh& mesh = resourceManager.get_mesh_by_handle(handle);
-			vertexesSize += mesh.positions.size();
-			indexesSize  += mesh.indexes.size();
-		}
-	}
-	vertexes.reserve(vertexesSize);
-	indexes.reserve(indexesSize);
-	trianglesCount = Int32(indexesSize / 3);
-	// Predicting emission triangles count
-	emissionTriangles.reserve(glm::max(Int32(trianglesCount * 0.01f), 1));
-
-	for (const Model& model : models)
-	{
-		for (UInt64 i = 0; i < model.meshes.size(); ++i)
-		{
-			const Mesh& mesh = resourceManager.get_mesh_by_handle(model.meshes[i]);
-			for (UInt64 j = 0; j < mesh.positions.size(); ++j)
-			{
-				Vertex& vertex = vertexes.emplace_back();
-				vertex.position   = mesh.positions[j];
-				vertex.normal	  = mesh.normals[j];
-				vertex.uv		  = mesh.uvs[j];
-				vertex.materialId = model.materials[i].id;
-			}
-		}
-	}
-
-	UInt32 indexesOffset = 0;
-	for (const Model& model : models)
-	{
-		for (const Handle<Mesh> handle : model.meshes)
-		{
-			const Mesh& mesh = resourceManager.get_mesh_by_handle(handle);
-			for (UInt64 j = 0; j < mesh.indexes.size(); ++j)
-			{
-				UInt32 index = mesh.indexes[j] + indexesOffset;
-				const GPUMaterial& gpuMaterial = materials[vertexes[index].materialId];
-				if (j % 3 == 0 && gpuMaterial.emission != -1)
-				{
-					emissionTriangles.emplace_back(UInt32(indexes.size()));
-				}
-				indexes.emplace_back(index);
-			}
-			indexesOffset += UInt32(mesh.positions.size());
-		}
-	}
-
-	bvh.create_tree(vertexes, indexes);
-
-	vertexesHandle			= renderManager.create_static_buffer(vertexes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-	indexesHandle			= renderManager.create_static_buffer(indexes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-	materialsHandle			= renderManager.create_static_buffer(materials, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-	bvhHandle				= renderManager.create_static_buffer(bvh.hierarchy, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-	emissionTrianglesHandle = renderManager.create_static_buffer(emissionTriangles, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	vertexesHandle			= renderManager.create_static_buffer(raytraceScene.vertexes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	indexesHandle			= renderManager.create_static_buffer(raytraceScene.indexes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	materialsHandle			= renderManager.create_static_buffer(raytraceScene.materials, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	bvhHandle				= renderManager.create_static_buffer(raytraceScene.bottomLevelNodes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	// Storage buffer can't be empty, its only light isn't sampled, when scene has none
+	const DynamicArray<EmissionTriangle> noLights(1, EmissionTriangle{});
+	emissionTrianglesHandle = renderManager.create_static_buffer(raytraceScene.emissionTriangles.empty() ? noLights : raytraceScene.emissionTriangles, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	wideBvhHandle			= renderManager.create_static_buffer(raytraceScene.wideHierarchy, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	compressedBvhHandle		= renderManager.create_static_buffer(raytraceScene.compressedHierarchy, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	topLevelBvhHandle		= renderManager.create_static_buffer(raytraceScene.topLevelTree.hierarchy, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	instancesHandle			= renderManager.create_static_buffer(raytraceScene.instances, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	octantLinksHandle		= renderManager.create_static_buffer(raytraceScene.octantLinks, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	packedTrianglesHandle	= renderManager.create_static_buffer(raytraceScene.packedTriangles, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	opacityMicromapsHandle	= renderManager.create_static_buffer(raytraceScene.opacityMicromaps, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	lightTreeHandle			= renderManager.create_static_buffer(raytraceScene.lightTree.nodes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	environmentTexelsHandle = renderManager.create_static_buffer(raytraceScene.environmentTexels, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
 
 	directionTexture.image = renderManager.create_image(displayManager.get_framebuffer_size(),
@@ -399,6 +353,7 @@ Void SRaytraceManager::ray_trace(Camera& camera)
 
 	RaytraceConstants constants{};
 	constants.backgroundColor		 = backgroundColor;
+	constants.environmentProbability = raytraceScene.environmentProbability;
 	constants.cameraPosition		 = camera.get_position();
 	constants.pixelDeltaU			 = pixelDeltaU;
 	constants.pixelDeltaV			 = pixelDeltaV;
@@ -407,11 +362,15 @@ Void SRaytraceManager::ray_trace(Camera& camera)
 	constants.invFrameCount			 = 1.0f / Float32(frameCount + 1);
 	constants.time					 = renderTime;
 	constants.frameCount			 = frameCount;
-	constants.trianglesCount		 = trianglesCount;
-	constants.emissionTrianglesCount = Int32(emissionTriangles.size());
+	constants.trianglesCount		 = raytraceScene.trianglesCount;
+	constants.emissionTrianglesCount = Int32(raytraceScene.emissionTriangles.size());
 	constants.maxBouncesCount		 = maxBouncesCount;
-	constants.rootId				 = bvh.rootId;
+	constants.rouletteBouncesCount	 = rouletteBouncesCount;
+	constants.rootId				 = raytraceScene.topLevelTree.rootId;
 	constants.environmentMapId		 = Int32(resourceManager.get_textures().size() - 1ULL);
+	constants.bvhFormat				 = Int32(raytraceScene.is_wide_stack_enough() ? bvhFormat : EBVHFormat::Binary);
+	constants.lightSampling			 = Int32(lightSampling);
+	constants.lightSelection		 = Int32(lightSelection);
 
 	commandBuffer.set_constants(raytracePipeline,
 								VK_SHADER_STAGE_COMPUTE_BIT,
@@ -661,6 +620,96 @@ Void SRaytraceManager::create_descriptors()
 							 VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
 							 VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT);
 
+	raytracePool.add_binding("SceneDataLayout",
+							 0,
+							 5,
+							 VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+							 1,
+							 VK_SHADER_STAGE_COMPUTE_BIT,
+							 VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT,
+							 VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+							 VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT);
+
+	raytracePool.add_binding("SceneDataLayout",
+							 0,
+							 6,
+							 VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+							 1,
+							 VK_SHADER_STAGE_COMPUTE_BIT,
+							 VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT,
+							 VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+							 VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT);
+
+	raytracePool.add_binding("SceneDataLayout",
+							 0,
+							 7,
+							 VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+							 1,
+							 VK_SHADER_STAGE_COMPUTE_BIT,
+							 VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT,
+							 VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+							 VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT);
+
+	raytracePool.add_binding("SceneDataLayout",
+							 0,
+							 8,
+							 VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+							 1,
+							 VK_SHADER_STAGE_COMPUTE_BIT,
+							 VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT,
+							 VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+							 VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT);
+
+	raytracePool.add_binding("SceneDataLayout",
+							 0,
+							 9,
+							 VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+							 1,
+							 VK_SHADER_STAGE_COMPUTE_BIT,
+							 VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT,
+							 VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+							 VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT);
+
+	raytracePool.add_binding("SceneDataLayout",
+							 0,
+							 10,
+							 VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+							 1,
+							 VK_SHADER_STAGE_COMPUTE_BIT,
+							 VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT,
+							 VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+							 VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT);
+
+	raytracePool.add_binding("SceneDataLayout",
+							 0,
+							 11,
+							 VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+							 1,
+							 VK_SHADER_STAGE_COMPUTE_BIT,
+							 VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT,
+							 VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+							 VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT);
+
+	raytracePool.add_binding("SceneDataLayout",
+							 0,
+							 12,
+							 VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+							 1,
+							 VK_SHADER_STAGE_COMPUTE_BIT,
+							 VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT,
+							 VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+							 VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT);
+
+	raytracePool.add_binding("SceneDataLayout",
+							 0,
+							 13,
+							 VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+							 1,
+							 VK_SHADER_STAGE_COMPUTE_BIT,
+							 VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT,
+							 VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+							 VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT);
+
 	raytracePool.create_layouts(renderManager.get_logical_device(), nullptr);
 
 	DynamicArray<VkPushConstantRange> raytraceConstants;
@@ -693,27 +742,72 @@ Void SRaytraceManager::setup_descriptors()
 	VkDescriptorBufferInfo& vertexesInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
 	vertexesInfo.buffer = renderManager.get_buffer_by_handle(vertexesHandle).get_buffer();
 	vertexesInfo.offset = 0;
-	vertexesInfo.range  = sizeof(vertexes[0]) * vertexes.size();
+	vertexesInfo.range  = sizeof(raytraceScene.vertexes[0]) * raytraceScene.vertexes.size();
 	
 	VkDescriptorBufferInfo& indexesInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
 	indexesInfo.buffer = renderManager.get_buffer_by_handle(indexesHandle).get_buffer();
 	indexesInfo.offset = 0;
-	indexesInfo.range  = sizeof(indexes[0]) * indexes.size();
+	indexesInfo.range  = sizeof(raytraceScene.indexes[0]) * raytraceScene.indexes.size();
 
 	VkDescriptorBufferInfo& materialsInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
 	materialsInfo.buffer = renderManager.get_buffer_by_handle(materialsHandle).get_buffer();
 	materialsInfo.offset = 0;
-	materialsInfo.range  = sizeof(materials[0]) * materials.size();
+	materialsInfo.range  = sizeof(raytraceScene.materials[0]) * raytraceScene.materials.size();
 
 	VkDescriptorBufferInfo& bvhInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
 	bvhInfo.buffer = renderManager.get_buffer_by_handle(bvhHandle).get_buffer();
 	bvhInfo.offset = 0;
-	bvhInfo.range = sizeof(bvh.hierarchy[0]) * bvh.hierarchy.size();
+	bvhInfo.range = sizeof(raytraceScene.bottomLevelNodes[0]) * raytraceScene.bottomLevelNodes.size();
 
 	VkDescriptorBufferInfo& emissionTrianglesInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
 	emissionTrianglesInfo.buffer = renderManager.get_buffer_by_handle(emissionTrianglesHandle).get_buffer();
 	emissionTrianglesInfo.offset = 0;
-	emissionTrianglesInfo.range  = sizeof(emissionTriangles[0]) * emissionTriangles.size();
+	emissionTrianglesInfo.range  = sizeof(EmissionTriangle) * glm::max(raytraceScene.emissionTriangles.size(), UInt64(1));
+
+	VkDescriptorBufferInfo& wideBvhInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
+	wideBvhInfo.buffer = renderManager.get_buffer_by_handle(wideBvhHandle).get_buffer();
+	wideBvhInfo.offset = 0;
+	wideBvhInfo.range  = sizeof(raytraceScene.wideHierarchy[0]) * raytraceScene.wideHierarchy.size();
+
+	VkDescriptorBufferInfo& compressedBvhInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
+	compressedBvhInfo.buffer = renderManager.get_buffer_by_handle(compressedBvhHandle).get_buffer();
+	compressedBvhInfo.offset = 0;
+	compressedBvhInfo.range  = sizeof(raytraceScene.compressedHierarchy[0]) * raytraceScene.compressedHierarchy.size();
+
+	VkDescriptorBufferInfo& topLevelBvhInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
+	topLevelBvhInfo.buffer = renderManager.get_buffer_by_handle(topLevelBvhHandle).get_buffer();
+	topLevelBvhInfo.offset = 0;
+	topLevelBvhInfo.range  = sizeof(raytraceScene.topLevelTree.hierarchy[0]) * raytraceScene.topLevelTree.hierarchy.size();
+
+	VkDescriptorBufferInfo& instancesInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
+	instancesInfo.buffer = renderManager.get_buffer_by_handle(instancesHandle).get_buffer();
+	instancesInfo.offset = 0;
+	instancesInfo.range  = sizeof(raytraceScene.instances[0]) * raytraceScene.instances.size();
+
+	VkDescriptorBufferInfo& octantLinksInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
+	octantLinksInfo.buffer = renderManager.get_buffer_by_handle(octantLinksHandle).get_buffer();
+	octantLinksInfo.offset = 0;
+	octantLinksInfo.range  = sizeof(raytraceScene.octantLinks[0]) * raytraceScene.octantLinks.size();
+
+	VkDescriptorBufferInfo& packedTrianglesInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
+	packedTrianglesInfo.buffer = renderManager.get_buffer_by_handle(packedTrianglesHandle).get_buffer();
+	packedTrianglesInfo.offset = 0;
+	packedTrianglesInfo.range  = sizeof(raytraceScene.packedTriangles[0]) * raytraceScene.packedTriangles.size();
+
+	VkDescriptorBufferInfo& opacityMicromapsInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
+	opacityMicromapsInfo.buffer = renderManager.get_buffer_by_handle(opacityMicromapsHandle).get_buffer();
+	opacityMicromapsInfo.offset = 0;
+	opacityMicromapsInfo.range  = sizeof(raytraceScene.opacityMicromaps[0]) * raytraceScene.opacityMicromaps.size();
+
+	VkDescriptorBufferInfo& lightTreeInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
+	lightTreeInfo.buffer = renderManager.get_buffer_by_handle(lightTreeHandle).get_buffer();
+	lightTreeInfo.offset = 0;
+	lightTreeInfo.range  = sizeof(raytraceScene.lightTree.nodes[0]) * raytraceScene.lightTree.nodes.size();
+
+	VkDescriptorBufferInfo& environmentTexelsInfo = sceneResources.emplace_back().bufferInfos.emplace_back();
+	environmentTexelsInfo.buffer = renderManager.get_buffer_by_handle(environmentTexelsHandle).get_buffer();
+	environmentTexelsInfo.offset = 0;
+	environmentTexelsInfo.range  = sizeof(raytraceScene.environmentTexels[0]) * raytraceScene.environmentTexels.size();
 
 	sceneData = raytracePool.add_set(sceneLayout, sceneResources, "SceneData");
 
@@ -879,6 +973,63 @@ Void SRaytraceManager::refresh()
 	shouldRefresh = true;
 }
 
+Void SRaytraceManager::benchmark_bvh() const
+{
+	raytraceScene.benchmark_bvh();
+}
+
+Void SRaytraceManager::refit_bvh()
+{
+	// Deforming models are refitted one by one by set_model_positions, only this refit of whole scene is logged
+	const auto startTime = std::chrono::steady_clock::now();
+	const RefitRanges ranges = raytraceScene.refit();
+	const Float32 refitTime = std::chrono::duration<Float32, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+	SPDLOG_INFO("Scene refitted in {:.2f} ms, changed nodes: [{}, {})", refitTime, ranges.nodes.first, ranges.nodes.second);
+	update_refitted_buffers(ranges);
+}
+
+Void SRaytraceManager::set_model_positions(Int32 modelId, const DynamicArray<FVector3>& positions)
+{
+	update_refitted_buffers(raytraceScene.set_model_positions(modelId, positions));
+}
+
+Void SRaytraceManager::update_refitted_buffers(const RefitRanges& ranges)
+{
+	SRenderManager& renderManager = SRenderManager::get();
+
+	// Buffers are read by raytrace pass only, so the one in flight has to finish, not the whole device
+	renderManager.get_logical_device().wait_for_fence(renderManager.get_fence_by_handle(raytraceInFlight), true);
+	update_buffer_range(renderManager, raytraceScene.vertexes, ranges.vertexes, vertexesHandle);
+	update_buffer_range(renderManager, raytraceScene.packedTriangles, ranges.packedTriangles, packedTrianglesHandle);
+	update_buffer_range(renderManager, raytraceScene.bottomLevelNodes, ranges.nodes, bvhHandle);
+	update_buffer_range(renderManager, raytraceScene.wideHierarchy, ranges.wideNodes, wideBvhHandle);
+	update_buffer_range(renderManager, raytraceScene.compressedHierarchy, ranges.wideNodes, compressedBvhHandle);
+	if (ranges.hasTopLevelTreeChanged)
+	{
+		renderManager.update_static_buffer(raytraceScene.topLevelTree.hierarchy, 0, raytraceScene.topLevelTree.hierarchy.size(), topLevelBvhHandle);
+	}
+	if (ranges.haveLightsChanged)
+	{
+		renderManager.update_static_buffer(raytraceScene.emissionTriangles, 0, raytraceScene.emissionTriangles.size(), emissionTrianglesHandle);
+		renderManager.update_static_buffer(raytraceScene.lightTree.nodes, 0, raytraceScene.lightTree.nodes.size(), lightTreeHandle);
+	}
+	refresh();
+}
+
+Void SRaytraceManager::set_instance_transform(Int32 instanceId, const FMatrix4& transform)
+{
+	SRenderManager& renderManager = SRenderManager::get();
+	raytraceScene.set_instance_transform(instanceId, transform);
+
+	// Instance count is the same, so top level tree keeps its size
+	renderManager.get_logical_device().wait_idle();
+	renderManager.update_static_buffer(raytraceScene.instances, instanceId, 1, instancesHandle);
+	renderManager.update_static_buffer(raytraceScene.emissionTriangles, 0, raytraceScene.emissionTriangles.size(), emissionTrianglesHandle);
+	renderManager.update_static_buffer(raytraceScene.lightTree.nodes, 0, raytraceScene.lightTree.nodes.size(), lightTreeHandle);
+	renderManager.update_static_buffer(raytraceScene.topLevelTree.hierarchy, 0, raytraceScene.topLevelTree.hierarchy.size(), topLevelBvhHandle);
+	refresh();
+}
+
 Void SRaytraceManager::shutdown()
 {
 	SPDLOG_INFO("Raytrace Manager shutdown.");
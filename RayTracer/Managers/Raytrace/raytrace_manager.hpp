@@ -5,20 +5,17 @@
 #include "../Render/Common/descriptor_pool.hpp"
 #include "../Render/Common/pipeline.hpp"
 #include "../Render/Common/render_pass.hpp"
-#include "Common/bvh_builder.hpp"
+#include "Common/raytrace_scene.hpp"
 
 
 class CommandBuffer;
 
-struct GPUMaterial
+enum class EBVHFormat : UInt8
 {
-	Int32 albedo;
-	Int32 normal;
-	Int32 roughness;
-	Int32 metalness;
-
-	Int32 emission;
-	Float32 indexOfRefraction; 
+	Binary = 0U,
+	Wide,
+	Compressed,
+	Count
 };
 
 struct RayGenerationConstants
@@ -32,7 +29,9 @@ struct RayGenerationConstants
 
 struct RaytraceConstants
 {
-	FVector3 backgroundColor; alignas(16)
+	FVector3 backgroundColor;
+	// Fills padding of background color, push constants are close to their minimum limit of 128 bytes
+	Float32  environmentProbability; alignas(16)
 	FVector3 cameraPosition; alignas(16)
 	FVector3 pixelDeltaU; alignas(16)
 	FVector3 pixelDeltaV; alignas(16)
@@ -44,11 +43,15 @@ struct RaytraceConstants
 	Float32  invFrameCount;
 	Int32	 frameCount;
 	Int32	 maxBouncesCount;
+	Int32	 rouletteBouncesCount;
 
 	Int32	 trianglesCount;
 	Int32	 emissionTrianglesCount;
 	Int32	 rootId;
 	Int32	 environmentMapId;
+	Int32	 bvhFormat;
+	Int32	 lightSampling;
+	Int32	 lightSelection;
 };
 
 struct Vertex;
@@ -73,11 +76,24 @@ public:
 
 	Void reload_shaders();
 	Void refresh();
+	/** Compares CPU traversal of binary, wide and compressed trees of current scene */
+	Void benchmark_bvh() const;
+	/** Updates trees and their buffers after vertexes were moved, topology stays the same */
+	Void refit_bvh();
+	/** Deforms model, positions are in order of its meshes, only its ranges of buffers are uploaded after raytrace pass in flight */
+	Void set_model_positions(Int32 modelId, const DynamicArray<FVector3>& positions);
+	/** Moves instance, only top level tree is rebuilt */
+	Void set_instance_transform(Int32 instanceId, const FMatrix4& transform);
 	Void shutdown();
 
 	Bool isEnabled;
 	Int32 frameLimit;
 	Int32 maxBouncesCount;
+	// Russian roulette terminates paths after that many bounces, NO_ROULETTE of scene turns it off
+	Int32 rouletteBouncesCount;
+	EBVHFormat bvhFormat;
+	ELightSampling lightSampling;
+	ELightSelection lightSelection;
 
 private:
 	SRaytraceManager() = default;
@@ -93,21 +109,18 @@ private:
 	Handle<VkCommandPool> raytraceCommandPool;
 	Handle<CommandBuffer> rayGenerationBuffer, raytraceBuffer, renderBuffer;
 	Handle<Shader> rayGeneration, raytrace, screenV, screenF;
-	Handle<Buffer> vertexesHandle, indexesHandle, materialsHandle, bvhHandle, emissionTrianglesHandle;
+	Handle<Buffer> vertexesHandle, indexesHandle, materialsHandle, bvhHandle, emissionTrianglesHandle, wideBvhHandle, compressedBvhHandle;
+	Handle<Buffer> topLevelBvhHandle, instancesHandle, octantLinksHandle, packedTrianglesHandle, opacityMicromapsHandle;
+	Handle<Buffer> lightTreeHandle, environmentTexelsHandle;
 	Handle<DescriptorSetData> sceneData, accumulationImage, directionImage, bindlessTextures;
 	Array<Handle<DescriptorSetData>, 2> fragmentImages, screenImages;
-	BVHBuilder bvh;
+	RaytraceScene raytraceScene;
 	Texture directionTexture, accumulationTexture;
 	Array<Texture, 2> screenTextures;
 
-	DynamicArray<GPUMaterial> materials;
-	DynamicArray<Vertex> vertexes;
-	DynamicArray<UInt32> indexes;
-	DynamicArray<UInt32> emissionTriangles;
-
 	FVector3 originPixel, pixelDeltaU, pixelDeltaV, backgroundColor;
 	Float32 renderTime;
-	Int32 frameCount, trianglesCount;
+	Int32 frameCount;
 	Bool shouldRefresh;
 	Bool areRaysRegenerated;
 	UInt64 currentImageIndex;
@@ -120,4 +133,6 @@ private:
 	Void create_descriptors();
 	Void setup_descriptors();
 	Void create_quad_buffers();
+	/** Only changed ranges are uploaded, lights and top level tree only when they were rebuilt */
+	Void update_refitted_buffers(const RefitRanges& ranges);
 };
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include "../Resource/Common/texture.hpp"
 #include "../Resource/Common/mesh.hpp"
 #include "../Resource/Common/model.hpp"
+#include "../Resource/Common/instance.hpp"
 #include "../Raytrace/raytrace_manager.hpp"
 #include "Camera/camera.hpp"
 #include "Common/command_buffer.hpp"
@@ -155,12 +156,47 @@ Void SRenderManager::update_imgui(Float32 deltaTimeMs)
     ImGui::DragInt("Frame limit", &raytraceManager.frameLimit, 1, 0, Limits<Int32>::max());
     Int32 bounces = raytraceManager.maxBouncesCount;
     ImGui::SliderInt("Max bounces", &raytraceManager.maxBouncesCount, 0, 64);
+    Int32 rouletteBounces = raytraceManager.rouletteBouncesCount;
+    ImGui::SliderInt("Roulette after bounces",
+                     &raytraceManager.rouletteBouncesCount,
+                     RaytraceScene::NO_ROULETTE,
+                     64,
+                     raytraceManager.rouletteBouncesCount == RaytraceScene::NO_ROULETTE ? "Off" : "%d");
 
-    if (raytraceManager.maxBouncesCount != bounces)
+    if (raytraceManager.maxBouncesCount != bounces || raytraceManager.rouletteBouncesCount != rouletteBounces)
     {
         raytraceManager.refresh();
     }
 
+    Int32 bvhFormat = Int32(raytraceManager.bvhFormat);
+    if (ImGui::Combo("BVH format", &bvhFormat, "Binary\0Wide (BVH4)\0Compressed (BVH4, 8 bit)\0"))
+    {
+        raytraceManager.bvhFormat = EBVHFormat(bvhFormat);
+    }
+
+    Int32 lightSampling = Int32(raytraceManager.lightSampling);
+    if (ImGui::Combo("Light sampling", &lightSampling, "Mixture\0Shadow rays, balance heuristic\0Shadow rays, power heuristic\0"))
+    {
+        raytraceManager.lightSampling = ELightSampling(lightSampling);
+        raytraceManager.refresh();
+    }
+
+    Int32 lightSelection = Int32(raytraceManager.lightSelection);
+    if (ImGui::Combo("Light selection", &lightSelection, "Alias table\0Light tree\0"))
+    {
+        raytraceManager.lightSelection = ELightSelection(lightSelection);
+        raytraceManager.refresh();
+    }
+
+    if (ImGui::Button("Benchmark BVH"))
+    {
+        raytraceManager.benchmark_bvh();
+    }
+    if (ImGui::Button("Refit BVH"))
+    {
+        raytraceManager.refit_bvh();
+    }
+
     if (ImGui::Button("Reload Shaders"))
     {
         if (raytraceManager.isEnabled)
@@ -181,6 +217,8 @@ Void SRenderManager::update_imgui(Float32 deltaTimeMs)
             resourceManager.save_texture(texture);
         }
         ImGui::Text("Accumulated frames: %d", raytraceManager.get_frame_count());
+        const IVector2 imageSize = raytraceManager.get_screen_texture().size;
+        ImGui::Text("Samples: %.2f M/s", Float32(imageSize.x) * Float32(imageSize.y) / (deltaTimeMs * 1000000.0f));
     }
 
     ImGui::Checkbox("Raytrace enabled", &raytraceManager.isEnabled);
@@ -256,7 +294,7 @@ Void SRenderManager::render_imgui()
     }
 }
 
-Void SRenderManager::render(Camera& camera, const DynamicArray<Model>& models, Float32 time)
+Void SRenderManager::render(Camera& camera, const DynamicArray<Instance>& instances, Float32 time)
 {
 	const VkFence imguiFence = get_fence_by_handle(imguiInFlight);
     logicalDevice.wait_for_fence(imguiFence, true);
@@ -300,8 +338,9 @@ Void SRenderManager::render(Camera& camera, const DynamicArray<Model>& models, F
     const DescriptorSetData& textureSet = descriptorPool.get_set_data_by_name("Textures");
     commandBuffer.bind_descriptor_set(graphicsPipeline, textureSet.set, textureSet.setNumber);
 
-    for (const Model& model : models)
+    for (const Instance& instance : instances)
     {
+        const Model& model = resourceManager.get_model_by_handle(instance.model);
         for (UInt64 i = 0; i < model.meshes.size(); ++i)
         {
             const Mesh& mesh = resourceManager.get_mesh_by_handle(model.meshes[i]);
@@ -318,7 +357,7 @@ Void SRenderManager::render(Camera& camera, const DynamicArray<Model>& models, F
             commandBuffer.bind_index_buffer(indexBuffer, 0, VK_INDEX_TYPE_UINT32);
 
             VertexConstants vertexConstants{};
-            vertexConstants.model = FMatrix4(1.0f);
+            vertexConstants.model = instance.transform;
             FragmentConstants fragmentConstants{};
             fragmentConstants.albedoId = material.textures[UInt64(ETextureType::Albedo)].id;
             
@@ -1384,14 +1423,14 @@ Void SRenderManager::copy_image_to_buffer(Buffer& buffer, Image& image)
     end_quick_commands(commandBuffer);
 }
 
-Void SRenderManager::copy_buffer(const Buffer& source, Buffer& destination)
+Void SRenderManager::copy_buffer(const Buffer& source, Buffer& destination, VkDeviceSize destinationOffset)
 {
     VkCommandBuffer commandBuffer;
     begin_quick_commands(commandBuffer);
 
     VkBufferCopy copyRegion{};
     copyRegion.srcOffset = 0; // Optional
-    copyRegion.dstOffset = 0; // Optional
+    copyRegion.dstOffset = destinationOffset;
     copyRegion.size      = source.get_size();
     vkCmdCopyBuffer(commandBuffer, source.get_buffer(), destination.get_buffer(), 1, &copyRegion);
 
@@ -13,7 +13,7 @@
 
 
 class Camera;
-struct Model;
+struct Instance;
 struct Mesh;
 struct Texture;
 class Image;
@@ -56,7 +56,7 @@ public:
 
 	Void update_imgui(Float32 deltaTimeMs);
 	Void render_imgui();
-	Void render(Camera& camera, const DynamicArray<Model>& models, Float32 time);
+	Void render(Camera& camera, const DynamicArray<Instance>& instances, Float32 time);
 
 
 	[[nodiscard]]
@@ -168,6 +168,34 @@ public:
 
 		return handle;
 	}
+
+	/** Uploads only count elements starting at first, buffer has to be created from the same array */
+	template<typename Type>
+	Void update_static_buffer(const DynamicArray<Type>& data, UInt64 first, UInt64 count, const Handle<Buffer> handle)
+	{
+		const UInt64 bufferSize = sizeof(data[0]) * count;
+		if (bufferSize == 0)
+		{
+			return;
+		}
+
+		Buffer stagingBuffer;
+		stagingBuffer.create(physicalDevice,
+							 logicalDevice,
+							 bufferSize,
+							 VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+							 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+							 nullptr);
+
+		Void* addressToGPU;
+		vkMapMemory(logicalDevice.get_device(), stagingBuffer.get_memory(), 0, bufferSize, 0, &addressToGPU);
+		memcpy(addressToGPU, data.data() + first, bufferSize);
+		vkUnmapMemory(logicalDevice.get_device(), stagingBuffer.get_memory());
+
+		copy_buffer(stagingBuffer, get_buffer_by_handle(handle), sizeof(data[0]) * first);
+
+		stagingBuffer.clear(logicalDevice, nullptr);
+	}
 	
 	Handle<RenderPass> create_render_pass(VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT, 
 										  Bool depthTest = true, 
@@ -246,7 +274,7 @@ private:
 	Void generate_mipmaps(Image& image);
 	Void copy_buffer_to_image(const Buffer& buffer, Image& image);
 	Void copy_image_to_buffer(Buffer& buffer, Image& image);
-	Void copy_buffer(const Buffer& source, Buffer& destination);
+	Void copy_buffer(const Buffer& source, Buffer& destination, VkDeviceSize destinationOffset = 0);
 	Void begin_quick_commands(VkCommandBuffer &commandBuffer);
 	Void end_quick_commands(VkCommandBuffer commandBuffer);
 
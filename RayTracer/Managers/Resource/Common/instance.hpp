@@ -0,0 +1,11 @@
+#pragma once
+
+struct Model;
+
+/** Model placed in scene, every glTF node with mesh becomes one instance */
+struct Instance
+{
+	Handle<Model> model;
+	FMatrix4 transform;
+	String name;
+};
@@ -7,11 +7,13 @@
 
 #include "Common/handle.hpp"
 #include "Common/model.hpp"
+#include "Common/instance.hpp"
 #include "Common/material.hpp"
 #include "Common/mesh.hpp"
 #include "Common/texture.hpp"
 
 #include <filesystem>
+#include <glm/gtc/quaternion.hpp>
 
 SResourceManager& SResourceManager::get()
 {
@@ -71,27 +73,66 @@ Void SResourceManager::load_gltf_asset(const std::filesystem::path & filePath)
 		return;
 	}
 
-	for (tinygltf::Node& gltfNode : gltfModel.nodes)
+	if (gltfModel.scenes.empty())
+	{ // Without scenes every node is placed on its own
+		for (Int32 nodeId = 0; nodeId < Int32(gltfModel.nodes.size()); ++nodeId)
+		{
+			const tinygltf::Node& gltfNode = gltfModel.nodes[nodeId];
+			if (gltfNode.mesh == -1)
+			{
+				continue;
+			}
+
+			const Handle<Model> model = load_model(filePath, gltfNode.mesh, gltfModel);
+			if (model.id == Handle<Model>::sNone.id)
+			{
+				SPDLOG_WARN("Model of node {} wasn't loaded, node is skipped", gltfNode.name);
+				continue;
+			}
+			instances.push_back({ model, get_node_transform(gltfNode), gltfNode.name });
+		}
+		return;
+	}
+
+	const Int32 sceneId = gltfModel.defaultScene >= 0 ? gltfModel.defaultScene : 0;
+	for (const Int32 nodeId : gltfModel.scenes[sceneId].nodes)
+	{
+		load_node(filePath, nodeId, FMatrix4(1.0f), gltfModel);
+	}
+}
+
+Void SResourceManager::load_node(const std::filesystem::path &filePath, 
+								 Int32 nodeId, 
+								 const FMatrix4 &parentTransform, 
+								 tinygltf::Model &gltfModel)
+{
+	const tinygltf::Node& gltfNode = gltfModel.nodes[nodeId];
+	const FMatrix4 transform = parentTransform * get_node_transform(gltfNode);
+	if (gltfNode.mesh != -1) //Skip nodes without meshes
 	{
-		//TODO: change it later
-		if (gltfNode.mesh == -1) //Skip nodes without meshes
+		const Handle<Model> model = load_model(filePath, gltfNode.mesh, gltfModel);
+		if (model.id != Handle<Model>::sNone.id)
 		{
-			continue;
+			instances.push_back({ model, transform, gltfNode.name });
+		} else {
+			SPDLOG_WARN("Model of node {} wasn't loaded, node is skipped", gltfNode.name);
 		}
-		load_model(filePath, gltfNode, gltfModel);
+	}
+
+	for (const Int32 childId : gltfNode.children)
+	{
+		load_node(filePath, childId, transform, gltfModel);
 	}
 }
 
-Handle<Model> SResourceManager::load_model(const std::filesystem::path &filePath, const tinygltf::Node &gltfNode, tinygltf::Model &gltfModel)
+Handle<Model> SResourceManager::load_model(const std::filesystem::path &filePath, Int32 meshId, tinygltf::Model &gltfModel)
 {
-	const String modelName = filePath.stem().string() + gltfNode.name;
+	tinygltf::Mesh& gltfMesh = gltfModel.meshes[meshId];
+	const String modelName = filePath.stem().string() + gltfMesh.name + std::to_string(meshId);
 	if (nameToIdModels.find(modelName) != nameToIdModels.end())
-	{
-		SPDLOG_WARN("Model with name {} already exist!", modelName);
-		//TODO: think of it
+	{ // Mesh referenced by several nodes is shared by their instances
 		return get_model_handle_by_name(modelName);
 	}
-	tinygltf::Mesh& gltfMesh = gltfModel.meshes[gltfNode.mesh];
 
 	const UInt64 modelId = models.size();
 	Model& model		 = models.emplace_back();
@@ -554,6 +595,11 @@ const DynamicArray<Model>& SResourceManager::get_models() const
 	return models;
 }
 
+const DynamicArray<Instance>& SResourceManager::get_instances() const
+{
+	return instances;
+}
+
 DynamicArray<Mesh>& SResourceManager::get_meshes()
 {
 	return meshes;
@@ -587,4 +633,42 @@ Void SResourceManager::shutdown()
 
 	nameToIdModels.clear();
 	models.clear();
+	instances.clear();
+}
+
+FMatrix4 SResourceManager::get_node_transform(const tinygltf::Node &gltfNode) const
+{
+	// Node has either whole matrix in column major order or translation, rotation and scale
+	FMatrix4 transform(1.0f);
+	if (gltfNode.matrix.size() == 16)
+	{
+		for (Int32 i = 0; i < 16; ++i)
+		{
+			transform[i / 4][i % 4] = Float32(gltfNode.matrix[i]);
+		}
+		return transform;
+	}
+
+	if (gltfNode.translation.size() == 3)
+	{
+		transform[3] = FVector4(Float32(gltfNode.translation[0]), 
+								Float32(gltfNode.translation[1]), 
+								Float32(gltfNode.translation[2]), 
+								1.0f);
+	}
+	if (gltfNode.rotation.size() == 4)
+	{
+		const glm::quat rotation(Float32(gltfNode.rotation[3]), 
+								 Float32(gltfNode.rotation[0]), 
+								 Float32(gltfNode.rotation[1]), 
+								 Float32(gltfNode.rotation[2]));
+		transform *= glm::mat4_cast(rotation);
+	}
+	if (gltfNode.scale.size() == 3)
+	{
+		transform[0] *= Float32(gltfNode.scale[0]);
+		transform[1] *= Float32(gltfNode.scale[1]);
+		transform[2] *= Float32(gltfNode.scale[2]);
+	}
+	return transform;
 }
\ No newline at end of file
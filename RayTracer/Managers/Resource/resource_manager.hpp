@@ -16,6 +16,7 @@ namespace std
 struct Texture;
 struct Material;
 struct Model;
+struct Instance;
 struct Mesh;
 enum class ETextureType : Int16;
 
@@ -33,8 +34,12 @@ public:
 	Void load_gltf_asset(const String& filePath);
 	Void load_gltf_asset(const std::filesystem::path &filePath);
 
+	Void			 load_node(const std::filesystem::path &filePath, 
+							   Int32 nodeId, 
+							   const FMatrix4 &parentTransform, 
+							   tinygltf::Model &gltfModel);
 	Handle<Model>    load_model(const std::filesystem::path &filePath, 
-								const tinygltf::Node &gltfNode, 
+								Int32 meshId, 
 								tinygltf::Model &gltfModel);
 	Handle<Mesh>     load_mesh(const String &meshName, tinygltf::Primitive &primitive, tinygltf::Model &gltfModel);
 	Handle<Material> load_material(const std::filesystem::path &assetPath, 
@@ -68,6 +73,8 @@ public:
 
 	[[nodiscard]]
 	const DynamicArray<Model>    &get_models()    const;
+	[[nodiscard]]
+	const DynamicArray<Instance> &get_instances() const;
 	DynamicArray<Mesh>           &get_meshes();
 	[[nodiscard]]
 	const DynamicArray<Material> &get_materials() const;
@@ -101,11 +108,15 @@ protected:
 
 private:
 	SResourceManager() = default;
+	FMatrix4 get_node_transform(const tinygltf::Node &gltfNode) const;
+
 	~SResourceManager() = default;
 
 	HashMap<String, Handle<Model>> nameToIdModels;
 	DynamicArray<Model> models;
 
+	DynamicArray<Instance> instances;
+
 	HashMap<String, Handle<Mesh>> nameToIdMeshes;
 	DynamicArray<Mesh> meshes;
 
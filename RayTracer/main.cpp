@@ -49,7 +49,7 @@ Int32 main()
 			currentFrame = Float32(glfwGetTime());
 			deltaTimeMs = currentFrame - lastFrame;
 			lastFrame = currentFrame;
-			renderManager.render(camera, resourceManager.get_models(), time);
+			renderManager.render(camera, resourceManager.get_instances(), time);
 		}
 		renderManager.render_imgui();
 	}
@@ -0,0 +1,358 @@
+#include <chrono>
+#include <stdexcept>
+
+#include "Managers/Resource/resource_manager.hpp"
+#include "Managers/Resource/Common/handle.hpp"
+#include "Managers/Resource/Common/texture.hpp"
+#include "Managers/Raytrace/Common/raytrace_scene.hpp"
+#include "Managers/Raytrace/Common/cpu_raytracer.hpp"
+#include "Managers/Raytrace/Common/vertex.hpp"
+#include "Utilities/task_scheduler.hpp"
+
+
+namespace
+{
+	/** Scene and camera default to the ones of renderer, so images can be compared with saved screen */
+	struct Options
+	{
+		String path = "Resources/Assets/SponzaLighted/SponzaLighted.gltf";
+		String environmentMapPath = "Resources/Textures/EnvironmentMap.hdr";
+		String outputPath = "Reference.png";
+		IVector2 imageSize = { 1280, 720 };
+		Int32 samplesCount = 64;
+		Int32 maxBouncesCount = 6;
+		// Russian roulette is off unless given
+		Optional<Int32> rouletteBouncesCount;
+		UInt32 seed = 0U;
+		ECPUTraceMode traceMode = ECPUTraceMode::Path;
+		ELightSampling lightSampling = ELightSampling::PowerHeuristic;
+		ELightSelection lightSelection = ELightSelection::LightTree;
+		// Traces the same samples with the other mode, logs throughput of both and checks that images are equal
+		Bool isComparing = false;
+		FVector3 position = { 5.0f, 2.0f, 0.0f };
+		Float32 yaw = -180.0f;
+		Float32 pitch = 0.0f;
+		Float32 fov = 70.0f;
+	};
+
+	Void print_usage()
+	{
+		SPDLOG_INFO("Usage: ReferenceRenderer [scene.gltf] [options]");
+		SPDLOG_INFO("  --size <width> <height>  image size");
+		SPDLOG_INFO("  --samples <count>        samples per pixel");
+		SPDLOG_INFO("  --bounces <count>        max bounces, same as in renderer");
+		SPDLOG_INFO("  --roulette <count>       bounces before russian roulette, off by default");
+		SPDLOG_INFO("  --seed <value>           0 gives the same random numbers as shader");
+		SPDLOG_INFO("  --mode <path|wavefront>  whole paths per pixel or sorted batches of rays per bounce");
+		SPDLOG_INFO("  --compare                traces again with the other mode and compares images");
+		SPDLOG_INFO("  --lights <sampling>      mixture, balance or power, the heuristics weight shadow rays to lights");
+		SPDLOG_INFO("  --selection <table|tree> lights chosen by power only or by importance to shading point");
+		SPDLOG_INFO("  --output <path>          saved PNG image");
+		SPDLOG_INFO("  --environment <path>     HDR environment map");
+		SPDLOG_INFO("  --position <x> <y> <z>   camera position");
+		SPDLOG_INFO("  --yaw <degrees>, --pitch <degrees>, --fov <degrees>");
+		SPDLOG_INFO("Run from RayTracer directory, trees are cached in its Cache folder");
+	}
+
+	/** Values follow name of option, their count was checked by caller */
+	Bool parse_option(const String& name, Char* values[], Options& options)
+	{
+		if (name == "--size")
+		{
+			options.imageSize = { std::stoi(values[0]), std::stoi(values[1]) };
+			return true;
+		}
+		if (name == "--samples")
+		{
+			options.samplesCount = std::stoi(values[0]);
+			return true;
+		}
+		if (name == "--bounces")
+		{
+			options.maxBouncesCount = std::stoi(values[0]);
+			return true;
+		}
+		if (name == "--roulette")
+		{
+			options.rouletteBouncesCount = std::stoi(values[0]);
+			return true;
+		}
+		if (name == "--seed")
+		{
+			options.seed = UInt32(std::stoul(values[0]));
+			return true;
+		}
+		if (name == "--mode")
+		{
+			const String mode = values[0];
+			if (mode != "path" && mode != "wavefront")
+			{
+				SPDLOG_ERROR("Unknown mode {}", mode);
+				return false;
+			}
+			options.traceMode = mode == "path" ? ECPUTraceMode::Path : ECPUTraceMode::Wavefront;
+			return true;
+		}
+		if (name == "--compare")
+		{
+			options.isComparing = true;
+			return true;
+		}
+		if (name == "--lights")
+		{
+			const String lightSampling = values[0];
+			if (lightSampling != "mixture" && lightSampling != "balance" && lightSampling != "power")
+			{
+				SPDLOG_ERROR("Unknown light sampling {}", lightSampling);
+				return false;
+			}
+			options.lightSampling = lightSampling == "mixture" ? ELightSampling::Mixture
+								  : lightSampling == "balance" ? ELightSampling::BalanceHeuristic : ELightSampling::PowerHeuristic;
+			return true;
+		}
+		if (name == "--selection")
+		{
+			const String lightSelection = values[0];
+			if (lightSelection != "table" && lightSelection != "tree")
+			{
+				SPDLOG_ERROR("Unknown light selection {}", lightSelection);
+				return false;
+			}
+			options.lightSelection = lightSelection == "table" ? ELightSelection::AliasTable : ELightSelection::LightTree;
+			return true;
+		}
+		if (name == "--output")
+		{
+			options.outputPath = values[0];
+			return true;
+		}
+		if (name == "--environment")
+		{
+			options.environmentMapPath = values[0];
+			return true;
+		}
+		if (name == "--position")
+		{
+			options.position = { std::stof(values[0]), std::stof(values[1]), std::stof(values[2]) };
+			return true;
+		}
+		if (name == "--yaw")
+		{
+			options.yaw = std::stof(values[0]);
+			return true;
+		}
+		if (name == "--pitch")
+		{
+			options.pitch = std::stof(values[0]);
+			return true;
+		}
+		if (name == "--fov")
+		{
+			options.fov = std::stof(values[0]);
+			return true;
+		}
+
+		SPDLOG_ERROR("Unknown option {}", name);
+		return false;
+	}
+
+	Bool parse_options(Int32 argc, Char* argv[], Options& options)
+	{
+		Int32 i = 1;
+		if (argc > 1 && String(argv[1]).rfind("--", 0) != 0)
+		{
+			options.path = argv[1];
+			i = 2;
+		}
+
+		while (i < argc)
+		{
+			const String name = argv[i];
+			Int32 valuesCount = 1;
+			if (name == "--position")
+			{
+				valuesCount = 3;
+			}
+			if (name == "--size")
+			{
+				valuesCount = 2;
+			}
+			if (name == "--compare")
+			{
+				valuesCount = 0;
+			}
+			if (i + valuesCount >= argc)
+			{
+				SPDLOG_ERROR("Missing value of option {}", name);
+				return false;
+			}
+			const Int32 valueId = i + 1;
+			i += valuesCount + 1;
+
+			// Numbers are parsed by std::stoi, std::stoul and std::stof, which throw on malformed or too large values
+			try
+			{
+				if (!parse_option(name, argv + valueId, options))
+				{
+					return false;
+				}
+			}
+			catch (const std::exception&)
+			{
+				SPDLOG_ERROR("Invalid value of option {}", name);
+				return false;
+			}
+		}
+
+		if (options.imageSize.x <= 0 || options.imageSize.y <= 0 || options.samplesCount <= 0)
+		{
+			SPDLOG_ERROR("Image size and samples count have to be positive");
+			return false;
+		}
+		if (options.maxBouncesCount < 0 || options.rouletteBouncesCount.value_or(0) < 0)
+		{
+			SPDLOG_ERROR("Bounces counts can't be negative");
+			return false;
+		}
+		return true;
+	}
+
+	/** Same vectors as Camera::update_camera_vectors, camera itself depends on window */
+	CPURaytracer::View create_view(const Options& options)
+	{
+		CPURaytracer::View view;
+		view.position = options.position;
+		view.forward.x = glm::cos(glm::radians(options.yaw)) * glm::cos(glm::radians(options.pitch));
+		view.forward.y = glm::sin(glm::radians(options.pitch));
+		view.forward.z = glm::sin(glm::radians(options.yaw)) * glm::cos(glm::radians(options.pitch));
+		view.forward = glm::normalize(view.forward);
+		view.right = glm::normalize(glm::cross(view.forward, FVector3(0.0f, 1.0f, 0.0f)));
+		view.up = glm::normalize(glm::cross(view.right, view.forward));
+		view.fov = options.fov;
+		view.viewBounds = { 0.001f, 5000.0f };
+		return view;
+	}
+
+	Void log_statistics(ECPUTraceMode mode, const CPURaytracer::Statistics& statistics)
+	{
+		UInt64 raysCount = 0ULL;
+		for (const UInt64 count : statistics.raysCounts)
+		{
+			raysCount += count;
+		}
+		const String name = mode == ECPUTraceMode::Path ? "Path" : "Wavefront";
+		SPDLOG_INFO("{} tracer: {:.2f} M rays, {:.2f} M rays/s with shading",
+					name,
+					Float64(raysCount) / 1000000.0,
+					Float64(raysCount) / (statistics.totalTime * 1000000.0));
+		if (mode != ECPUTraceMode::Wavefront)
+		{
+			return;
+		}
+
+		// Intersection stage alone, camera rays are coherent and the following bounces are sorted
+		UInt64 secondaryRaysCount = 0ULL;
+		Float64 secondaryTime = 0.0;
+		for (UInt64 i = 0; i < statistics.raysCounts.size(); ++i)
+		{
+			SPDLOG_INFO("  Bounce {}: {:.2f} M rays, {:.2f} M rays/s",
+						i + 1,
+						Float64(statistics.raysCounts[i]) / 1000000.0,
+						Float64(statistics.raysCounts[i]) / (glm::max(statistics.traceTimes[i], 0.000001) * 1000000.0));
+			if (i > 0)
+			{
+				secondaryRaysCount += statistics.raysCounts[i];
+				secondaryTime += statistics.traceTimes[i];
+			}
+		}
+		SPDLOG_INFO("  Bounces 2+: {:.2f} M rays/s", Float64(secondaryRaysCount) / (glm::max(secondaryTime, 0.000001) * 1000000.0));
+	}
+
+	Void render(CPURaytracer& raytracer, const Options& options, ECPUTraceMode mode, Texture& image)
+	{
+		raytracer.traceMode = mode;
+		raytracer.setup(create_view(options), options.imageSize);
+
+		SPDLOG_INFO("Tracing {}x{} image, {} samples per pixel, {} threads",
+					options.imageSize.x,
+					options.imageSize.y,
+					options.samplesCount,
+					TaskScheduler::get().get_threads_count());
+		const Float64 pixelsCount = Float64(options.imageSize.x) * Float64(options.imageSize.y);
+		const auto begin = std::chrono::steady_clock::now();
+		for (Int32 i = 0; i < options.samplesCount; ++i)
+		{
+			const auto frameBegin = std::chrono::steady_clock::now();
+			raytracer.trace_frame();
+			const Float64 frameTime = std::chrono::duration<Float64>(std::chrono::steady_clock::now() - frameBegin).count();
+			SPDLOG_INFO("Sample {}/{}: {:.3f} s, {:.2f} M samples/s",
+						i + 1,
+						options.samplesCount,
+						frameTime,
+						pixelsCount / (frameTime * 1000000.0));
+		}
+		const Float64 totalTime = std::chrono::duration<Float64>(std::chrono::steady_clock::now() - begin).count();
+		SPDLOG_INFO("Traced in {:.2f} s, {:.2f} M samples/s",
+					totalTime,
+					pixelsCount * Float64(options.samplesCount) / (totalTime * 1000000.0));
+		log_statistics(mode, raytracer.get_statistics());
+		raytracer.resolve(image);
+	}
+}
+
+Int32 main(Int32 argc, Char* argv[])
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		print_usage();
+		return 1;
+	}
+
+	SResourceManager& resourceManager = SResourceManager::get();
+	resourceManager.startup();
+	resourceManager.load_gltf_asset(options.path);
+	resourceManager.load_texture(options.environmentMapPath, "EnvironmentMap", ETextureType::HDR);
+
+	RaytraceScene scene;
+	scene.create();
+
+	CPURaytracer raytracer(scene, resourceManager.get_textures());
+	raytracer.maxBouncesCount = options.maxBouncesCount;
+	raytracer.rouletteBouncesCount = options.rouletteBouncesCount.value_or(RaytraceScene::NO_ROULETTE);
+	raytracer.lightSampling = options.lightSampling;
+	raytracer.lightSelection = options.lightSelection;
+	raytracer.environmentMapId = Int32(resourceManager.get_textures().size() - 1ULL);
+	raytracer.seed = options.seed;
+
+	Texture image;
+	image.name = options.outputPath;
+	render(raytracer, options, options.traceMode, image);
+	if (image.data == nullptr)
+	{
+		resourceManager.shutdown();
+		return 1;
+	}
+	resourceManager.save_texture(image);
+
+	if (options.isComparing)
+	{
+		Texture otherImage;
+		render(raytracer, options, options.traceMode == ECPUTraceMode::Path ? ECPUTraceMode::Wavefront : ECPUTraceMode::Path, otherImage);
+		if (otherImage.data != nullptr)
+		{
+			const UInt64 bytesCount = UInt64(image.size.x) * UInt64(image.size.y) * UInt64(image.channels);
+			if (memcmp(image.data, otherImage.data, bytesCount) == 0)
+			{
+				SPDLOG_INFO("Images of both modes are equal");
+			} else {
+				SPDLOG_WARN("Images of both modes differ");
+			}
+			free(otherImage.data);
+		}
+	}
+	free(image.data);
+
+	resourceManager.shutdown();
+	return 0;
+}